@@ -0,0 +1,798 @@
+// Headless benchmark for the file system core in filesystem.h
+//
+// Runs workloads against a freshly formatted volume and reports throughput and latency
+// percentiles per operation, optionally appending machine-readable results to JSON or CSV.
+//
+//   bench [--workload all|metadata|sequential|random|sparse|async|deep|wide|search|churn] [--ops N] [--seed N]
+//         [--block-size B] [--blocks N] [--inodes N] [--cache N] [--image PATH]
+//         [--file-size BYTES] [--io-size BYTES] [--queue N] [--depth N] [--width N]
+//         [--kernel avx2|sse2|scalar] [--label TEXT] [--json PATH] [--csv PATH]
+
+#include "filesystem.h"
+#include <ctype.h>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+// Benchmark Definitions
+
+#define MAX_RESULTS 64
+
+// Latency samples and totals for one operation of one workload
+typedef struct {
+    const char* workload;
+    const char* operation;
+    long count;
+    long failures;
+    long long bytes;       // Bytes moved, 0 for metadata operations
+    double seconds;        // Time spent inside the operation, wall-clock time for overlapping requests
+    uint64_t* samples;     // Latency of each call in nanoseconds
+    long capacity;
+} OpStats;
+
+// Run configuration
+typedef struct {
+    const char* workload;
+    long ops;
+    unsigned long long seed;
+    int block_size;
+    int block_count;
+    int inode_count;
+    int cache_size;
+    const char* image;
+    int file_size;
+    int io_size;
+    int queue;             // Async requests kept in flight
+    int depth;
+    int width;
+    const char* kernel;    // Name matching kernel, NULL for the fastest one
+    const char* label;
+    const char* json_path;
+    const char* csv_path;
+} BenchConfig;
+
+// Global Variables
+
+static OpStats results[MAX_RESULTS];
+static int result_count = 0;
+static unsigned long long rng_state = 1;
+static int saved_stdout = -1;
+
+// Helper Functions
+
+// Monotonic clock in nanoseconds
+static uint64_t now_ns() {
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// xorshift64*, so runs with the same seed do the same work
+static unsigned long long next_random() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static long random_below(long limit) {
+    return limit > 0 ? (long)(next_random() % (unsigned long long)limit) : 0;
+}
+
+// The core reports every operation on stdout; silence it while measuring
+static void quiet_stdout(int quiet) {
+    fflush(stdout);
+#ifdef _WIN32
+    if (quiet && saved_stdout == -1) {
+        saved_stdout = _dup(_fileno(stdout));
+        int null_fd = _open("NUL", _O_WRONLY);
+        _dup2(null_fd, _fileno(stdout));
+        _close(null_fd);
+    } else if (!quiet && saved_stdout != -1) {
+        _dup2(saved_stdout, _fileno(stdout));
+        _close(saved_stdout);
+        saved_stdout = -1;
+    }
+#else
+    if (quiet && saved_stdout == -1) {
+        saved_stdout = dup(fileno(stdout));
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, fileno(stdout));
+        close(null_fd);
+    } else if (!quiet && saved_stdout != -1) {
+        dup2(saved_stdout, fileno(stdout));
+        close(saved_stdout);
+        saved_stdout = -1;
+    }
+#endif
+}
+
+// Result Functions
+
+// Find or add the stats slot for an operation of a workload
+static OpStats* op_stats(const char* workload, const char* operation) {
+    for (int i = 0; i < result_count; i++) {
+        if (strcmp(results[i].workload, workload) == 0 && strcmp(results[i].operation, operation) == 0) {
+            return &results[i];
+        }
+    }
+    if (result_count == MAX_RESULTS) {
+        fprintf(stderr, "Error: Too many benchmark results\n");
+        exit(1);
+    }
+    OpStats* stats = &results[result_count++];
+    memset(stats, 0, sizeof(OpStats));
+    stats->workload = workload;
+    stats->operation = operation;
+    return stats;
+}
+
+// Add one latency sample without counting its time, for requests that overlap
+static void record_sample(OpStats* stats, uint64_t elapsed, int ok, long long bytes) {
+    if (stats->count == stats->capacity) {
+        stats->capacity = stats->capacity ? stats->capacity * 2 : 1024;
+        stats->samples = realloc(stats->samples, stats->capacity * sizeof(uint64_t));
+        if (stats->samples == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed for latency samples\n");
+            exit(1);
+        }
+    }
+    stats->samples[stats->count++] = elapsed;
+    stats->bytes += bytes;
+    if (!ok) {
+        stats->failures++;
+    }
+}
+
+// Record one call that started at start; ok is 0 when the call failed
+static void record_op(OpStats* stats, uint64_t start, int ok, long long bytes) {
+    uint64_t elapsed = now_ns() - start;
+    record_sample(stats, elapsed, ok, bytes);
+    stats->seconds += elapsed / 1e9;
+}
+
+static int compare_samples(const void* a, const void* b) {
+    uint64_t left = *(const uint64_t*)a;
+    uint64_t right = *(const uint64_t*)b;
+    return (left > right) - (left < right);
+}
+
+// Nearest-rank percentile of sorted samples
+static uint64_t percentile(const OpStats* stats, double fraction) {
+    if (stats->count == 0) {
+        return 0;
+    }
+    long rank = (long)(fraction * stats->count + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > stats->count) rank = stats->count;
+    return stats->samples[rank - 1];
+}
+
+static double ops_per_sec(const OpStats* stats) {
+    return stats->seconds > 0 ? stats->count / stats->seconds : 0;
+}
+
+static double mb_per_sec(const OpStats* stats) {
+    return stats->seconds > 0 ? stats->bytes / stats->seconds / (1024.0 * 1024.0) : 0;
+}
+
+// Volume Functions
+
+// Start each workload on an empty volume
+static int fresh_volume(const BenchConfig* config) {
+    if (config->image != NULL) {
+        return format_image(config->image, config->block_size, config->block_count, config->inode_count, config->cache_size);
+    }
+    return format_filesystem(config->block_size, config->block_count, config->inode_count, config->cache_size);
+}
+
+// Workload Functions
+
+// Small-file churn: create, open, close, rename and delete, one file at a time
+static void run_metadata(const BenchConfig* config) {
+    OpStats* create_stats = op_stats("metadata", "create_file");
+    OpStats* open_stats = op_stats("metadata", "open_file");
+    OpStats* rename_stats = op_stats("metadata", "rename_file");
+    OpStats* delete_stats = op_stats("metadata", "delete_file");
+    char name[64];
+    char new_name[64];
+
+    for (long i = 0; i < config->ops; i++) {
+        snprintf(name, sizeof(name), "meta_%ld", i);
+        snprintf(new_name, sizeof(new_name), "meta_%ld_renamed", i);
+
+        uint64_t start = now_ns();
+        int ok = create_file(name, (int)random_below(config->block_size * 4), 7) != -1;
+        record_op(create_stats, start, ok, 0);
+
+        start = now_ns();
+        int fd = open_file(name);
+        record_op(open_stats, start, fd != -1, 0);
+        if (fd != -1) {
+            close_file(fd);
+        }
+
+        start = now_ns();
+        ok = rename_file(name, new_name) == 0;
+        record_op(rename_stats, start, ok, 0);
+
+        start = now_ns();
+        ok = delete_file(new_name) == 0;
+        record_op(delete_stats, start, ok, 0);
+    }
+}
+
+// Stream one large file out and back in io_size pieces
+static void run_sequential(const BenchConfig* config) {
+    OpStats* write_stats = op_stats("sequential", "write_file");
+    OpStats* read_stats = op_stats("sequential", "read_file");
+    char* buffer = malloc(config->io_size);
+    for (int i = 0; i < config->io_size; i++) {
+        buffer[i] = (char)next_random();
+    }
+
+    if (create_file("stream", 0, 7) == -1) {
+        write_stats->failures++;
+        free(buffer);
+        return;
+    }
+    int fd = open_file("stream");
+    for (long pass = 0; pass * config->file_size < (long long)config->ops * config->io_size; pass++) {
+        set_file_position(fd, 0);
+        for (int position = 0; position + config->io_size <= config->file_size; position += config->io_size) {
+            uint64_t start = now_ns();
+            int written = write_file(fd, buffer, config->io_size);
+            record_op(write_stats, start, written == config->io_size, written > 0 ? written : 0);
+        }
+        set_file_position(fd, 0);
+        for (int position = 0; position + config->io_size <= config->file_size; position += config->io_size) {
+            uint64_t start = now_ns();
+            int bytes_read = read_file(fd, buffer, config->io_size);
+            record_op(read_stats, start, bytes_read == config->io_size, bytes_read > 0 ? bytes_read : 0);
+        }
+    }
+    close_file(fd);
+    free(buffer);
+}
+
+// Random io_size reads and writes inside one preallocated file
+static void run_random(const BenchConfig* config) {
+    OpStats* write_stats = op_stats("random", "write_file");
+    OpStats* read_stats = op_stats("random", "read_file");
+    char* buffer = malloc(config->io_size);
+    for (int i = 0; i < config->io_size; i++) {
+        buffer[i] = (char)next_random();
+    }
+
+    if (create_file("random", config->file_size, 7) == -1) {
+        write_stats->failures++;
+        free(buffer);
+        return;
+    }
+    int fd = open_file("random");
+    long slots = config->file_size / config->io_size;
+    for (long i = 0; i < config->ops; i++) {
+        set_file_position(fd, (int)(random_below(slots) * config->io_size));
+        uint64_t start = now_ns();
+        if (next_random() & 1) {
+            int written = write_file(fd, buffer, config->io_size);
+            record_op(write_stats, start, written == config->io_size, written > 0 ? written : 0);
+        } else {
+            int bytes_read = read_file(fd, buffer, config->io_size);
+            record_op(read_stats, start, bytes_read == config->io_size, bytes_read > 0 ? bytes_read : 0);
+        }
+    }
+    close_file(fd);
+    free(buffer);
+}
+
+// Write past the end of a file: every pwrite_file skips io_size bytes, and a pread_file of the
+// skipped bytes fails unless they read back as zeros. The file reuses the blocks of a deleted
+// file full of other bytes, so a gap that is not zeroed shows them.
+static void run_sparse(const BenchConfig* config) {
+    OpStats* write_stats = op_stats("sparse", "pwrite_file");
+    OpStats* read_stats = op_stats("sparse", "pread_file");
+    char* buffer = malloc(config->io_size);
+    char* gap = malloc(config->io_size);
+    memset(buffer, 0x5a, config->io_size);
+
+    long done = 0;
+    while (done < config->ops) {
+        if (create_file("stale", 0, 7) == -1 || create_file("sparse", 0, 7) == -1) {
+            write_stats->failures++;
+            break;
+        }
+        int fd = open_file("stale");
+        for (int position = 0; position + config->io_size <= config->file_size; position += config->io_size) {
+            write_file(fd, buffer, config->io_size);
+        }
+        close_file(fd);
+        delete_file("stale");
+
+        fd = open_file("sparse");
+        for (int position = config->io_size; position + config->io_size <= config->file_size && done < config->ops;
+             position += 2 * config->io_size, done++) {
+            uint64_t start = now_ns();
+            int written = pwrite_file(fd, buffer, config->io_size, position);
+            record_op(write_stats, start, written == config->io_size, written > 0 ? written : 0);
+
+            start = now_ns();
+            int bytes_read = pread_file(fd, gap, config->io_size, position - config->io_size);
+            int zeroed = bytes_read == config->io_size;
+            for (int i = 0; zeroed && i < config->io_size; i++) {
+                zeroed = gap[i] == 0;
+            }
+            record_op(read_stats, start, zeroed, bytes_read > 0 ? bytes_read : 0);
+        }
+        close_file(fd);
+        delete_file("sparse");
+    }
+    free(buffer);
+    free(gap);
+}
+
+// One async request slot of run_async
+typedef struct {
+    AsyncIo io;
+    OpStats* stats;
+    uint64_t start;
+    int expected;
+    int busy;
+} AsyncSlot;
+
+// Completion callback: latency runs from submission to completion
+static void async_done(AsyncIo* io) {
+    AsyncSlot* slot = io->context;
+    record_sample(slot->stats, now_ns() - slot->start, io->result == slot->expected, io->result > 0 ? io->result : 0);
+    slot->busy = 0;
+}
+
+// Random io_size reads and writes inside one preallocated file, queue requests in flight.
+// Throughput is measured over wall-clock time since the requests overlap.
+static void run_async(const BenchConfig* config) {
+    OpStats* write_stats = op_stats("async", "write_file_async");
+    OpStats* read_stats = op_stats("async", "read_file_async");
+    AsyncSlot* slots = calloc(config->queue, sizeof(AsyncSlot));
+    char* buffers = malloc((size_t)config->queue * config->io_size);
+    for (long i = 0; i < (long)config->queue * config->io_size; i++) {
+        buffers[i] = (char)next_random();
+    }
+
+    if (create_file("async", config->file_size, 7) == -1) {
+        write_stats->failures++;
+        free(slots);
+        free(buffers);
+        return;
+    }
+    int fd = open_file("async");
+    long slot_count = config->file_size / config->io_size;
+    uint64_t begin = now_ns();
+    for (long i = 0; i < config->ops; i++) {
+        AsyncSlot* slot = NULL;
+        while (slot == NULL) {
+            for (int s = 0; s < config->queue && slot == NULL; s++) {
+                if (!slots[s].busy) {
+                    slot = &slots[s];
+                }
+            }
+            if (slot == NULL) {
+                io_poll(1);
+            }
+        }
+        char* buffer = buffers + (slot - slots) * (size_t)config->io_size;
+        int write = (int)(next_random() & 1);
+        slot->stats = write ? write_stats : read_stats;
+        slot->expected = config->io_size;
+        slot->busy = 1;
+        io_future_init(&slot->io, async_done, slot);
+        set_file_position(fd, (int)(random_below(slot_count) * config->io_size));
+        slot->start = now_ns();
+        int queued = write ? write_file_async(fd, buffer, config->io_size, &slot->io)
+                           : read_file_async(fd, buffer, config->io_size, &slot->io);
+        if (queued == -1) {
+            record_sample(slot->stats, now_ns() - slot->start, 0, 0);
+            slot->busy = 0;
+        }
+    }
+    io_drain();
+    double seconds = (now_ns() - begin) / 1e9;
+    // Split the wall-clock time between the two operations by request count
+    long total = write_stats->count + read_stats->count;
+    if (total > 0) {
+        write_stats->seconds = seconds * write_stats->count / total;
+        read_stats->seconds = seconds * read_stats->count / total;
+    }
+    close_file(fd);
+    free(slots);
+    free(buffers);
+}
+
+// Build a chain of depth directories with a file at every level, resolve random
+// levels by path, then delete the whole chain; repeated until ops paths are resolved
+static void run_deep(const BenchConfig* config) {
+    OpStats* mkdir_stats = op_stats("deep", "create_dir");
+    OpStats* create_stats = op_stats("deep", "create_file");
+    OpStats* navigate_stats = op_stats("deep", "navigate_path");
+    OpStats* delete_stats = op_stats("deep", "delete_by_path");
+    size_t path_size = (size_t)config->depth * 16 + 1;
+    char** paths = malloc(config->depth * sizeof(char*));
+    char name[64];
+
+    for (long round = 0, resolved = 0; resolved < config->ops; round++) {
+        DirectoryStruct* root = create_root_dir();
+        DirectoryStruct* dir = root;
+        for (int level = 0; level < config->depth; level++) {
+            paths[level] = malloc(path_size);
+            snprintf(paths[level], path_size, "%s%sd%d", level ? paths[level - 1] : "", level ? "/" : "", level);
+
+            snprintf(name, sizeof(name), "d%d", level);
+            uint64_t start = now_ns();
+            dir = create_dir(name, dir);
+            record_op(mkdir_stats, start, dir != NULL, 0);
+
+            snprintf(name, sizeof(name), "deep_%ld_%d", round, level);
+            start = now_ns();
+            DirectoryStruct* file = create_file_at(dir, name, config->block_size, 7);
+            record_op(create_stats, start, file != NULL, 0);
+        }
+
+        for (int i = 0; i < config->depth * 4 && resolved < config->ops; i++, resolved++) {
+            int level = (int)random_below(config->depth);
+            uint64_t start = now_ns();
+            DirectoryStruct* found = navigate_path(root, paths[level]);
+            record_op(navigate_stats, start, found != NULL, 0);
+        }
+
+        uint64_t start = now_ns();
+        int ok = delete_by_path(root, "d0") == 0;
+        record_op(delete_stats, start, ok, 0);
+
+        for (int level = 0; level < config->depth; level++) {
+            free(paths[level]);
+        }
+        delete_node(root);
+    }
+    free(paths);
+}
+
+// Fill one directory with width files, resolve random children by path, then delete each
+static void run_wide(const BenchConfig* config) {
+    OpStats* create_stats = op_stats("wide", "create_file");
+    OpStats* navigate_stats = op_stats("wide", "navigate_path");
+    OpStats* delete_stats = op_stats("wide", "delete_by_path");
+    char path[64];
+
+    DirectoryStruct* root = create_root_dir();
+    create_dir("wide", root);
+    DirectoryStruct* wide = navigate_path(root, "wide");
+    for (int i = 0; i < config->width; i++) {
+        snprintf(path, sizeof(path), "w%d", i);
+        uint64_t start = now_ns();
+        DirectoryStruct* file = create_file_at(wide, path, 0, 7);
+        record_op(create_stats, start, file != NULL, 0);
+    }
+
+    for (long i = 0; i < config->ops; i++) {
+        snprintf(path, sizeof(path), "wide/w%ld", random_below(config->width));
+        uint64_t start = now_ns();
+        DirectoryStruct* found = navigate_path(root, path);
+        record_op(navigate_stats, start, found != NULL, 0);
+    }
+
+    for (int i = 0; i < config->width; i++) {
+        snprintf(path, sizeof(path), "wide/w%d", i);
+        uint64_t start = now_ns();
+        int ok = delete_by_path(root, path) == 0;
+        record_op(delete_stats, start, ok, 0);
+    }
+    delete_node(root);
+}
+
+// Report Functions
+
+static void print_results() {
+    printf("%-11s %-15s %9s %8s %12s %10s %10s %10s %9s\n",
+           "workload", "operation", "count", "failed", "ops/s", "p50(us)", "p99(us)", "p999(us)", "MB/s");
+    for (int i = 0; i < result_count; i++) {
+        OpStats* stats = &results[i];
+        printf("%-11s %-15s %9ld %8ld %12.0f %10.2f %10.2f %10.2f %9.1f\n",
+               stats->workload, stats->operation, stats->count, stats->failures, ops_per_sec(stats),
+               percentile(stats, 0.50) / 1e3, percentile(stats, 0.99) / 1e3, percentile(stats, 0.999) / 1e3,
+               mb_per_sec(stats));
+    }
+}
+
+// Write JSON string contents, escaping what needs it
+static void write_json_string(FILE* file, const char* text) {
+    fputc('"', file);
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\') {
+            fputc('\\', file);
+        }
+        if ((unsigned char)*text >= 0x20) {
+            fputc(*text, file);
+        }
+    }
+    fputc('"', file);
+}
+
+// Write one JSON document describing the run
+static int write_json(const BenchConfig* config, long long timestamp) {
+    FILE* file = fopen(config->json_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Cannot write %s\n", config->json_path);
+        return -1;
+    }
+    fprintf(file, "{\n  \"label\": ");
+    write_json_string(file, config->label);
+    fprintf(file, ",\n  \"timestamp\": %lld,\n  \"seed\": %llu,\n", timestamp, config->seed);
+    fprintf(file, "  \"block_size\": %d,\n  \"block_count\": %d,\n  \"inode_count\": %d,\n  \"cache_size\": %d,\n",
+            config->block_size, config->block_count, config->inode_count, config->cache_size);
+    fprintf(file, "  \"image\": %s,\n  \"results\": [\n", config->image ? "true" : "false");
+    for (int i = 0; i < result_count; i++) {
+        OpStats* stats = &results[i];
+        fprintf(file, "    {\"workload\": \"%s\", \"operation\": \"%s\", \"count\": %ld, \"failures\": %ld, "
+                      "\"ops_per_sec\": %.1f, \"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"mb_per_sec\": %.2f}%s\n",
+                stats->workload, stats->operation, stats->count, stats->failures, ops_per_sec(stats),
+                (unsigned long long)percentile(stats, 0.50), (unsigned long long)percentile(stats, 0.99),
+                (unsigned long long)percentile(stats, 0.999), mb_per_sec(stats), i + 1 < result_count ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+    return 0;
+}
+
+// Append one CSV row per operation, writing the header when the file is new
+static int write_csv(const BenchConfig* config, long long timestamp) {
+    FILE* file = fopen(config->csv_path, "a");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Cannot write %s\n", config->csv_path);
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    if (ftell(file) == 0) {
+        fprintf(file, "label,timestamp,block_size,cache_size,workload,operation,count,failures,ops_per_sec,p50_ns,p99_ns,p999_ns,mb_per_sec\n");
+    }
+    for (int i = 0; i < result_count; i++) {
+        OpStats* stats = &results[i];
+        fprintf(file, "%s,%lld,%d,%d,%s,%s,%ld,%ld,%.1f,%llu,%llu,%llu,%.2f\n",
+                config->label, timestamp, config->block_size, config->cache_size, stats->workload, stats->operation,
+                stats->count, stats->failures, ops_per_sec(stats), (unsigned long long)percentile(stats, 0.50),
+                (unsigned long long)percentile(stats, 0.99), (unsigned long long)percentile(stats, 0.999), mb_per_sec(stats));
+    }
+    fclose(file);
+    return 0;
+}
+
+// Spread width files with random names over directories of 64, then look up random pieces
+// of those names: four characters through the trigram index, two characters and any case
+// by scanning every name
+static void run_search(const BenchConfig* config) {
+    OpStats* search_stats = op_stats("search", "search_names");
+    OpStats* scan_stats = op_stats("search", "search_names(2)");
+    OpStats* folded_stats = op_stats("search", "search_folded");
+    char name[32];
+    char fragment[8];
+
+    DirectoryStruct* root = create_root_dir();
+    DirectoryStruct* dir = NULL;
+    for (int i = 0; i < config->width; i++) {
+        if (i % 64 == 0) {
+            snprintf(name, sizeof(name), "dir%d", i / 64);
+            dir = create_dir(name, root);
+        }
+        snprintf(name, sizeof(name), "%08llx.dat", next_random() & 0xffffffffULL);
+        create_file_at(dir, name, 0, 7);
+    }
+
+    for (long i = 0; i < config->ops; i++) {
+        DirectoryStruct* folder = root->children[random_below(root->child_count)];
+        DirectoryStruct* file = folder->children[random_below(folder->child_count)];
+        memcpy(fragment, file->name + random_below(5), 4);
+        fragment[4] = '\0';
+        DirectoryStruct** matches = NULL;
+        uint64_t start = now_ns();
+        int count = search_names(root, fragment, &matches);
+        record_op(search_stats, start, count > 0, 0);
+        free(matches);
+
+        fragment[0] = (char)toupper((unsigned char)fragment[0]);
+        start = now_ns();
+        count = search_names_folded(root, fragment, &matches);
+        record_op(folded_stats, start, count > 0, 0);
+        free(matches);
+
+        fragment[0] = (char)tolower((unsigned char)fragment[0]);
+        fragment[2] = '\0';
+        start = now_ns();
+        count = search_names(root, fragment, &matches);
+        record_op(scan_stats, start, count > 0, 0);
+        free(matches);
+    }
+    delete_node(root);
+}
+
+// The tree the churn workload changes, searched from a second thread
+typedef struct {
+    DirectoryStruct* root;
+    OpStats* stats;
+    int done;              // Set once run_churn stops changing the tree
+} ChurnSearch;
+
+// Search the churned tree until run_churn is done with it
+static THREAD_FUNCTION churn_search(void* arg) {
+    ChurnSearch* search = arg;
+    static const char* fragments[] = {".dat", "batch", "f1", "_3"};
+    for (long i = 0; !__atomic_load_n(&search->done, __ATOMIC_ACQUIRE); i++) {
+        DirectoryStruct** matches = NULL;
+        uint64_t start = now_ns();
+        int count = search_names(search->root, fragments[i % 4], &matches);
+        record_op(search->stats, start, count >= 0, 0);
+        free(matches);
+    }
+    return THREAD_RESULT;
+}
+
+// Fill folders of 32 files, move each into one of two holding folders and delete the one
+// moved eight rounds before, while another thread keeps searching the whole tree
+static void run_churn(const BenchConfig* config) {
+    OpStats* create_stats = op_stats("churn", "create_file");
+    OpStats* move_stats = op_stats("churn", "move_node");
+    OpStats* delete_stats = op_stats("churn", "delete_node");
+    ChurnSearch search = {create_root_dir(), op_stats("churn", "search_names"), 0};
+    DirectoryStruct* holders[2] = {create_dir("left", search.root), create_dir("right", search.root)};
+    DirectoryStruct* folders[8] = {NULL};
+    char name[64];
+
+    Thread searcher;
+    int searching = thread_start(&searcher, churn_search, &search) == 0;
+    for (long round = 0, created = 0; created < config->ops; round++) {
+        snprintf(name, sizeof(name), "batch%ld", round);
+        DirectoryStruct* folder = create_dir(name, search.root);
+        if (folder == NULL) {
+            break;
+        }
+        for (int i = 0; i < 32; i++, created++) {
+            snprintf(name, sizeof(name), "f%ld_%d.dat", round, i);
+            uint64_t start = now_ns();
+            DirectoryStruct* file = create_file_at(folder, name, 0, 7);
+            record_op(create_stats, start, file != NULL, 0);
+        }
+
+        uint64_t start = now_ns();
+        int ok = move_node(folder, holders[round % 2]) == 0;
+        record_op(move_stats, start, ok, 0);
+
+        DirectoryStruct** slot = &folders[round % 8];
+        if (*slot != NULL) {
+            start = now_ns();
+            delete_node(*slot);
+            record_op(delete_stats, start, 1, 0);
+        }
+        *slot = folder;
+    }
+    __atomic_store_n(&search.done, 1, __ATOMIC_RELEASE);
+    if (searching) {
+        thread_join(searcher);
+    }
+    delete_node(search.root);
+}
+
+// Main Function
+
+static void usage() {
+    fprintf(stderr,
+            "Usage: bench [--workload all|metadata|sequential|random|sparse|async|deep|wide|search|churn] [--ops N] [--seed N]\n"
+            "             [--block-size B] [--blocks N] [--inodes N] [--cache N] [--image PATH]\n"
+            "             [--file-size BYTES] [--io-size BYTES] [--queue N] [--depth N] [--width N]\n"
+            "             [--kernel avx2|sse2|scalar] [--label TEXT] [--json PATH] [--csv PATH]\n");
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config = {"all", 10000, 1, 4096, 32768, 16384, 256, NULL, 16 * 1024 * 1024, 4096, 128, 64, 4096, NULL, "", NULL, NULL};
+
+    for (int i = 1; i < argc; i++) {
+        const char* option = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (value == NULL) {
+            usage();
+            return 1;
+        }
+        i++;
+        if (strcmp(option, "--workload") == 0) config.workload = value;
+        else if (strcmp(option, "--ops") == 0) config.ops = atol(value);
+        else if (strcmp(option, "--seed") == 0) config.seed = strtoull(value, NULL, 10);
+        else if (strcmp(option, "--block-size") == 0) config.block_size = atoi(value);
+        else if (strcmp(option, "--blocks") == 0) config.block_count = atoi(value);
+        else if (strcmp(option, "--inodes") == 0) config.inode_count = atoi(value);
+        else if (strcmp(option, "--cache") == 0) config.cache_size = atoi(value);
+        else if (strcmp(option, "--image") == 0) config.image = value;
+        else if (strcmp(option, "--file-size") == 0) config.file_size = atoi(value);
+        else if (strcmp(option, "--io-size") == 0) config.io_size = atoi(value);
+        else if (strcmp(option, "--queue") == 0) config.queue = atoi(value);
+        else if (strcmp(option, "--depth") == 0) config.depth = atoi(value);
+        else if (strcmp(option, "--width") == 0) config.width = atoi(value);
+        else if (strcmp(option, "--kernel") == 0) config.kernel = value;
+        else if (strcmp(option, "--label") == 0) config.label = value;
+        else if (strcmp(option, "--json") == 0) config.json_path = value;
+        else if (strcmp(option, "--csv") == 0) config.csv_path = value;
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if (config.ops < 1 || config.io_size < 1 || config.file_size < config.io_size || config.queue < 1 ||
+        config.depth < 1 || config.width < 1) {
+        fprintf(stderr, "Error: --ops, --io-size, --queue, --depth and --width must be positive and --file-size at least --io-size\n");
+        return 1;
+    }
+    rng_state = config.seed ? config.seed : 1;
+    if (select_name_kernel(config.kernel) != 0) {
+        fprintf(stderr, "Error: The %s name kernel is not available\n", config.kernel);
+        return 1;
+    }
+
+    static const struct {
+        const char* name;
+        void (*run)(const BenchConfig*);
+    } workloads[] = {
+        {"metadata", run_metadata},
+        {"sequential", run_sequential},
+        {"random", run_random},
+        {"sparse", run_sparse},
+        {"async", run_async},
+        {"deep", run_deep},
+        {"wide", run_wide},
+        {"search", run_search},
+        {"churn", run_churn},
+    };
+    int ran = 0;
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        if (strcmp(config.workload, "all") != 0 && strcmp(config.workload, workloads[i].name) != 0) {
+            continue;
+        }
+        quiet_stdout(1);
+        int formatted = fresh_volume(&config);
+        if (formatted == 0) {
+            workloads[i].run(&config);
+        }
+        quiet_stdout(0);
+        if (formatted != 0) {
+            fprintf(stderr, "Error: Cannot format a volume of %d blocks of %d bytes\n", config.block_count, config.block_size);
+            return 1;
+        }
+        ran++;
+    }
+    if (ran == 0) {
+        fprintf(stderr, "Error: Unknown workload %s\n", config.workload);
+        usage();
+        return 1;
+    }
+    quiet_stdout(1);
+    release_volume();
+    quiet_stdout(0);
+
+    for (int i = 0; i < result_count; i++) {
+        qsort(results[i].samples, results[i].count, sizeof(uint64_t), compare_samples);
+    }
+    print_results();
+    long long timestamp = (long long)time(NULL);
+    if (config.json_path != NULL && write_json(&config, timestamp) != 0) {
+        return 1;
+    }
+    if (config.csv_path != NULL && write_csv(&config, timestamp) != 0) {
+        return 1;
+    }
+    return 0;
+}
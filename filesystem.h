@@ -2,30 +2,208 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_NAME_SIMD 1 // Vector name kernels, picked at run time by what the CPU supports
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
 
 // File System Definitions
 
-#define MAX_BLOCKS 1024
-#define MAX_INODES 256
-#define BLOCK_SIZE 64
+#define DEFAULT_BLOCK_COUNT 1024 // Geometry used by initialize_filesystem and new GUI images
+#define DEFAULT_INODE_COUNT 256
+#define DEFAULT_BLOCK_SIZE 64
+#define MIN_BLOCK_SIZE 64 // Block sizes are powers of two in this range
+#define MAX_BLOCK_SIZE 65536
 #define FILE_NAME_LENGTH 255
-#define INDEX_BLOCK_SIZE 12
-#define MAX_OPEN_FILES 100
+#define INODE_EXTENTS 4 // Extents (or extent tree node pointers) held in the inode itself
+#define EXTENT_MAX_DEPTH 16 // Index levels an extent tree can grow to
+#define FD_CHUNK_SIZE 256 // Descriptor table grows by this many entries
+#define FD_MAX_CHUNKS 4096
+#define MAX_OPEN_FILES (FD_CHUNK_SIZE * FD_MAX_CHUNKS)
+#define FD_THREAD_CACHE 32 // Free descriptors each thread keeps to itself
 #define BUFFER_SIZE 64
-#define CACHE_SIZE 16
-#define JOURNAL_SIZE 100
+#define CACHE_SIZE 16 // Default cache capacity in blocks, see init_cache
+#define CACHE_MAX_SHARDS 64 // Power of two, the cache is split into up to this many segments
+#define CACHE_MIN_SHARD_BLOCKS 8 // Smallest segment worth splitting off
+#define CACHE_HIT_BATCH 64 // Hits a thread counts privately before adding them to its shard's stats
+#define LOG_SIZE (256 * 1024) // Bytes of the write-ahead log region in every volume
+#define LOG_MAGIC 0x474F4C57 // "WLOG", first word of every log record
+#define GROUP_COMMIT_TXNS 32 // Committed transactions buffered before the log is written
+#define GROUP_COMMIT_BYTES (64 * 1024)
+#define LOG_RECENT_RANGES 8 // Ranges of the open transaction a new change may be folded into
+#define LOG_DELTA_BYTES 0 // Kinds of delta: new bytes of a volume range, which follow it
+#define LOG_DELTA_ALLOC 1 // Blocks offset to offset + length - 1 were allocated, nothing follows
+#define LOG_DELTA_FREE 2  // Those blocks were freed
+#define LOG_DELTA_UNLINK 3 // Inodes offset to offset + length - 1 were deleted with their directory entries
+#define LOG_COPY_UNLINK SIZE_MAX // LogRange copy of a run of unlinked inodes, which has no bytes
+#define LOG_LSN_PENDING UINT64_MAX // Cache block changed by a transaction that has not committed
+#define IO_QUEUE_DEPTH 256 // Backing-store requests the async engine keeps in flight
+#define WRITEBACK_INTERVAL_MS 100 // The flusher looks for old dirty blocks this often
+#define WRITEBACK_EXPIRE_MS 1000 // Blocks dirty for this long are written back
+#define WRITEBACK_BACKGROUND_RATIO 10 // Percent of the cache dirty before the flusher writes everything it can
+#define WRITEBACK_DIRTY_RATIO 40 // Percent of the cache dirty at which writers wait for the flusher
+#define WRITEBACK_BATCH 64 // Blocks the flusher pins and writes at a time
+#define READAHEAD_MIN 4 // Blocks in the first window read ahead of a sequential stream
+#define READAHEAD_MAX 64 // Largest window, also kept to a quarter of the cache
+#define IO_READ 0
+#define IO_WRITE 1
+#define CHILD_HASH_THRESHOLD 8 // Children scanned linearly up to this count
+#define DENTRY_CACHE_SIZE 256 // Power of two
+#define DENTRY_PATH_LENGTH 256
+#define SEARCH_COMPACT_MIN 1024 // Removed names kept in the search index before it may be rebuilt
+#define NAME_SCAN_PADDING 32 // Readable bytes past the end of text handed to name_scan
+#define FS_MAGIC 0x31565346 // "FSV1" little-endian, first word of every volume
+#define FS_VERSION 8
+#define PAGE_ALIGNMENT 4096 // Data region alignment inside the volume
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024) // In-memory volumes at least this large ask for huge pages
+#define ROOT_INODE 0 // Reserved for the root directory, which has no directory entry
+#define INODE_LOCK_SHARDS 64 // Power of two, inodes share reader/writer locks by number
+#define NODE_SLAB_BYTES (128 * 1024) // Power of two, tree nodes are carved from slabs aligned to this
+#define NAME_ARENA_BYTES (64 * 1024) // Interned names are carved from chunks this large
+#define NAME_CLASS_BYTES 8 // Freed interned names are reused by size in steps of this
+
+// Lock Definitions
+
+#ifdef _WIN32
+typedef SRWLOCK RwLock;
+typedef SRWLOCK Mutex;
+#define rwlock_init(lock) InitializeSRWLock(lock)
+#define rwlock_read_lock(lock) AcquireSRWLockShared(lock)
+#define rwlock_read_unlock(lock) ReleaseSRWLockShared(lock)
+#define rwlock_write_lock(lock) AcquireSRWLockExclusive(lock)
+#define rwlock_write_unlock(lock) ReleaseSRWLockExclusive(lock)
+#define mutex_init(lock) InitializeSRWLock(lock)
+#define mutex_lock(lock) AcquireSRWLockExclusive(lock)
+#define mutex_unlock(lock) ReleaseSRWLockExclusive(lock)
+typedef CONDITION_VARIABLE CondVar;
+#define cond_init(cond) InitializeConditionVariable(cond)
+#define cond_signal(cond) WakeConditionVariable(cond)
+#define cond_broadcast(cond) WakeAllConditionVariable(cond)
+#define cond_wait_ms(cond, lock, ms) SleepConditionVariableSRW(cond, lock, ms, 0)
+typedef HANDLE Thread;
+#define THREAD_FUNCTION DWORD WINAPI
+#define THREAD_RESULT 0
+#define thread_start(thread, function, arg) ((*(thread) = CreateThread(NULL, 0, function, arg, 0, NULL)) != NULL ? 0 : -1)
+#define thread_join(thread) (WaitForSingleObject(thread, INFINITE), CloseHandle(thread))
+#define thread_yield() SwitchToThread()
+#define THREAD_LOCAL __declspec(thread)
+typedef DWORD ThreadKey;
+#define THREAD_KEY_DESTRUCTOR VOID WINAPI
+#define thread_key_create(key, destructor) ((*(key) = FlsAlloc(destructor)) != FLS_OUT_OF_INDEXES ? 0 : -1)
+#define thread_key_set(key, value) FlsSetValue(key, value)
+#else
+typedef pthread_rwlock_t RwLock;
+typedef pthread_mutex_t Mutex;
+#define rwlock_init(lock) pthread_rwlock_init(lock, NULL)
+#define rwlock_read_lock(lock) pthread_rwlock_rdlock(lock)
+#define rwlock_read_unlock(lock) pthread_rwlock_unlock(lock)
+#define rwlock_write_lock(lock) pthread_rwlock_wrlock(lock)
+#define rwlock_write_unlock(lock) pthread_rwlock_unlock(lock)
+#define mutex_init(lock) pthread_mutex_init(lock, NULL)
+#define mutex_lock(lock) pthread_mutex_lock(lock)
+#define mutex_unlock(lock) pthread_mutex_unlock(lock)
+typedef pthread_cond_t CondVar;
+#define cond_init(cond) pthread_cond_init(cond, NULL)
+#define cond_signal(cond) pthread_cond_signal(cond)
+#define cond_broadcast(cond) pthread_cond_broadcast(cond)
+#define cond_wait_ms(cond, lock, ms) posix_cond_wait_ms(cond, lock, ms)
+typedef pthread_t Thread;
+#define THREAD_FUNCTION void*
+#define THREAD_RESULT NULL
+#define thread_start(thread, function, arg) pthread_create(thread, NULL, function, arg)
+#define thread_join(thread) pthread_join(thread, NULL)
+#define thread_yield() sched_yield()
+#define THREAD_LOCAL __thread
+typedef pthread_key_t ThreadKey;
+#define THREAD_KEY_DESTRUCTOR void
+#define thread_key_create(key, destructor) pthread_key_create(key, destructor)
+#define thread_key_set(key, value) pthread_setspecific(key, value)
+
+// Wait on a condition for at most ms milliseconds
+static inline void posix_cond_wait_ms(CondVar* cond, Mutex* lock, int ms) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ms / 1000;
+    until.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(cond, lock, &until);
+}
+#endif
 
 // Data Structures
 
-// Superblock definition
+// Superblock definition, stored at the start of the volume
 typedef struct {
+    int magic;
+    int version;
     int total_blocks;
     int free_blocks;
     int block_size;
     int inode_count;
     int free_inodes;
+    int name_hash_size;
+    // Byte offsets of each region from the start of the volume
+    int64_t bitmap_offset;
+    int64_t inode_offset;
+    int64_t directory_offset;
+    int64_t name_index_offset;
+    int64_t data_offset;
+    int64_t volume_size;
+    int64_t log_offset;      // Write-ahead log region, between the name index and the data
+    int64_t log_size;
+    uint64_t log_start_lsn;  // LSN of the record at the start of the log region
+    int64_t inode_bitmap_offset;  // One bit per inode, set while it is in use
+    int64_t slot_bitmap_offset;   // One bit per directory entry, set while it is in use
+    int free_blocks_valid;        // free_blocks was written at a clean unmount; 0 means recount it
 } superblock;
 
+// Extent: a run of file blocks stored in consecutive disk blocks
+typedef struct {
+    int logical;   // First file block it maps
+    int physical;  // Disk block holding that file block
+    int length;    // Number of blocks
+} Extent;
+
+// Extent tree node, fills one disk block. Leaves (level 0) map file blocks; the extents of
+// index nodes point at the node one level down (physical) covering length file blocks.
+typedef struct {
+    int count;
+    int level;
+    Extent extents[];
+} ExtentNode;
+
+// Block runs freed by a bulk delete, handed back to the bitmap together by free_block_batch
+typedef struct {
+    Extent* runs;  // Only physical and length are used
+    int count;
+    int capacity;
+} BlockBatch;
+
+#define EXTENTS_PER_NODE ((int)((sb->block_size - sizeof(ExtentNode)) / sizeof(Extent)))
+
 // Inode definition
 typedef struct {
     int inode_number;
@@ -34,24 +212,43 @@ typedef struct {
     int permissions;
     int owner;
     int timestamps[3];
-    int data_blocks[INDEX_BLOCK_SIZE];
+    int extent_depth;  // 0: extents map data, otherwise they point at tree nodes of level extent_depth - 1
+    int extent_count;
+    Extent extents[INODE_EXTENTS];  // Sorted by logical block
+    int entry_index;   // Its directory entry, -1 for the root directory and free inodes
 } inode;
 
-// Directory Entry definition
+// Directory Entry definition, keyed by the directory it is in and its name
 typedef struct {
     char name[FILE_NAME_LENGTH];
     int inode_number;
+    int parent_inode;  // Directory inode holding the entry
 } DirectoryEntry;
 
-// Directory definition
+// Directory definition, one entry per inode
 typedef struct {
-    DirectoryEntry entries[MAX_INODES];
+    int entry_count;
+    int reserved;
+    DirectoryEntry entries[];
 } Directory;
 
-// Open file definition
+// What stat_inode reports about an inode
+typedef struct {
+    int inode_number;
+    char file_type;    // 'f' for files, 'd' for directories
+    int size;          // Bytes for a file, entries for a directory
+    int blocks;        // Data blocks mapped
+    int permissions;
+    int parent_inode;  // Directory holding its entry, -1 for the root directory
+    int timestamps[3];
+} FileStat;
+
+// Open file definition. The position belongs to the thread using the descriptor.
 typedef struct {
     int inode_number;
     int current_position;
+    struct Readahead* readahead;  // Sequential read tracking, NULL until the descriptor reads
+    int readahead_claimed;        // Set while a thread uses readahead, see readahead_track
 } OpenFile;
 
 // Permissions definition
@@ -61,704 +258,5828 @@ typedef struct {
     unsigned char execute;
 } Permissions;
 
-// Hierarchical Directory Structure
-typedef struct DirectoryStruct {
-    char name[100];
+// Hierarchical Directory Structure. The core does not lock these trees: a tree shared
+// between threads needs its owner to serialize changes to it.
+// Nodes come from slabs (see node_alloc). The fields that walks, lookups and the subtree
+// totals read fill one cache line; the rest sit in the node's NodeCold.
+typedef struct __attribute__((aligned(64))) DirectoryStruct {
+    const char* name;  // Interned (see intern_name), shared by nodes with the same name
     struct DirectoryStruct* parent;
     struct DirectoryStruct** children;
+    struct DirectoryStruct** child_table;  // Open-addressed name index over children, NULL while small
+    int64_t subtree_bytes;  // File bytes in the subtree, kept up to date by the tree and write functions
+    int name_len;      // strlen(name)
     int child_count;
-    int max_children;
-    Permissions permissions;
     int is_directory;  // New field: 1 for directory, 0 for file
     int inode_number;  // Add this to link with the file system's inode
+    int subtree_files;      // Files in the subtree, counting the node itself
+    int subtree_dirs;       // Directories in the subtree, counting the node itself
 } DirectoryStruct;
 
+// Fields of a tree node that are rarely read, found with node_cold
+typedef struct {
+    int max_children;
+    int child_table_size;   // Power of two, 0 when there is no table
+    int search_id;          // Slot in the name search index, -1 while the node is not in a tree
+    int child_index;        // Position in the parent's children array
+    Permissions permissions;
+} NodeCold;
+
+// A run of tree nodes and their cold fields, aligned to NODE_SLAB_BYTES so a node finds its
+// slab by masking its address
+#define NODE_SLAB_NODES ((NODE_SLAB_BYTES - 64) / (sizeof(DirectoryStruct) + sizeof(NodeCold)))
+typedef struct NodeSlab {
+    struct NodeSlab* next;
+    DirectoryStruct nodes[NODE_SLAB_NODES];  // Starts on the slab's second cache line
+    NodeCold cold[NODE_SLAB_NODES];
+} NodeSlab;
+
+// A name shared by every tree node called that, its text follows
+typedef struct InternedName {
+    struct InternedName* next;  // Next name in the same intern bucket, or on a free list
+    unsigned int hash;
+    int refs;                   // Nodes using the name
+    int length;
+    char text[];
+} InternedName;
+
+#define NAME_CLASSES ((sizeof(InternedName) + FILE_NAME_LENGTH + NAME_CLASS_BYTES - 1) / NAME_CLASS_BYTES + 1)
+
+// Buffer cache lists (CAR replacement policy: CLOCK with adaptive replacement)
+#define CACHE_T1 0    // Resident clock of blocks seen once recently
+#define CACHE_T2 1    // Resident clock of blocks seen more than once
+#define CACHE_B1 2    // Ghost of a block evicted from T1
+#define CACHE_B2 3    // Ghost of a block evicted from T2
+#define CACHE_FREE 4  // Unused entry
+#define CACHE_LISTS 5
+
 // Buffer cache structure
 typedef struct {
     int block_num;
-    char data[BLOCK_SIZE];
+    int list;        // Which CACHE_* list the entry is on
+    int prev, next;  // Neighbours on that list, -1 at the ends
+    int hash_next;   // Next entry in the same hash bucket
     int dirty;
-    int last_used;
+    int64_t dirtied_at;  // monotonic_ms() when the entry last went from clean to dirty
+    int pins;        // Outstanding borrows, a pinned entry is never evicted; -1 while the flusher copies it
+    int referenced;  // CLOCK bit, set on a hit without moving the entry; -1 until a block read ahead is used
+    uint64_t lsn;    // Record holding the block's last logged change, 0 if it has none; the
+                     // frame is not written back before that record is in the log
+    char* data;      // Cache frame, NULL for ghosts and free entries
 } CacheBlock;
 
-// Journal entry structure
+// Doubly linked cache list. For T1 and T2 the head is the clock hand; for B1 and B2 it is the oldest ghost.
+typedef struct {
+    int head;
+    int tail;
+    int size;
+} CacheList;
+
+// Scatter/gather segment for readv_file and writev_file
+typedef struct {
+    char* base;
+    int length;
+} FileIoVec;
+
+// A cache block lent out by borrow_block, valid until release_block
 typedef struct {
-    int operation; // 0: write, 1: create, 2: delete, 3: rename
+    const char* data;  // Points into the cache frame, not a copy
+    int length;        // Bytes of file data available at data
     int block_num;
-    char data[BLOCK_SIZE];
-    int file_size;
-    char filename[FILE_NAME_LENGTH];
-    char old_filename[FILE_NAME_LENGTH];
-    char new_filename[FILE_NAME_LENGTH];
-} JournalEntry;
+} BlockRef;
+
+// Buffer cache counters
+typedef struct {
+    long hits;
+    long misses;
+    long evictions;
+    long writebacks;
+    long prefetched;  // Blocks read ahead into the cache
+} CacheStats;
+
+// One segment of the buffer cache, holding the blocks that hash to it. Hits take the
+// lock shared and only set a reference bit; misses and evictions take it exclusively.
+typedef struct __attribute__((aligned(64))) {
+    RwLock lock;
+    CacheBlock* entries;       // 2 * capacity entries, resident blocks plus ghosts
+    int capacity;              // Resident blocks
+    int* buckets;              // Hash heads by block number, -1 if empty
+    int bucket_mask;
+    char* frames;              // capacity frames of block_size bytes
+    char** free_frames;        // Stack of frames not owned by a resident entry
+    int free_frame_count;
+    CacheList lists[CACHE_LISTS];
+    int target_t1;             // CAR's adaptive target size for T1
+    CacheStats stats;          // Hits arrive in batches, see CACHE_HIT_BATCH
+} CacheShard;
+
+// Write-ahead log record: one committed transaction, followed by its deltas
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;          // CRC-32C of the record after this field
+    uint64_t lsn;          // Consecutive from the superblock's log_start_lsn
+    uint32_t length;       // Whole record in bytes, a multiple of 8
+    uint32_t delta_count;
+} LogRecord;
+
+// A change made by a transaction: a byte range of the volume, its new bytes following padded
+// to 8, a run of blocks allocated or freed, or a run of inodes deleted
+typedef struct {
+    int64_t offset;  // Byte offset, or first block
+    uint32_t length;
+    uint32_t kind;   // LOG_DELTA_*
+} LogDelta;
+
+// A byte range of the volume changed by the open transaction and its new bytes
+typedef struct {
+    int64_t offset;
+    int64_t length;
+    size_t copy;  // Where the bytes start in the thread's log_copy
+} LogRange;
+
+// Journal counters
+typedef struct {
+    long transactions;
+    long group_writes;   // Log writes, each covering one or more transactions
+    long checkpoints;
+    long bytes_logged;
+} JournalStats;
+
+// Future for an asynchronous request. It completes when every backing-store request it
+// was split into has; the callback then runs from io_poll or io_wait on some thread.
+typedef struct AsyncIo {
+    int pending;                           // Parts still in flight, plus one while being queued
+    int done;                              // Set once the result is final
+    int failed;
+    long result;                           // Bytes transferred, -1 if any part failed
+    void (*callback)(struct AsyncIo* io);  // May be NULL
+    void* context;                         // Left for the callback
+    struct AsyncIo* next_ready;            // Completed futures waiting for their callback
+} AsyncIo;
+
+// A descriptor's sequential read state and the window read ahead of it
+typedef struct Readahead {
+    int next_position;  // Where a read continuing the stream starts
+    int window;         // Blocks in the last window issued, 0 outside a stream
+    int ahead;          // First logical block not yet read ahead
+    int pending;        // Blocks in the window in flight, 0 if none
+    int pending_start;  // Its first logical block
+    long generation;    // Writes to the inode's lock shard when it was issued
+    int* block_nums;    // Physical block of each staged block, -1 where it was resident
+    char* staging;      // READAHEAD_MAX blocks, allocated with the first window
+    AsyncIo io;
+} Readahead;
+
+// One read or write of the backing store, a part of an AsyncIo
+typedef struct IoRequest {
+    int opcode;               // IO_READ or IO_WRITE
+    char* buffer;
+    size_t length;
+    int64_t offset;           // Byte offset in the volume
+    long result;              // Bytes transferred or -1, once run without a ring
+    AsyncIo* future;
+    struct IoRequest* next;   // Free list, or the completed list when there is no ring
+} IoRequest;
+
+// Async I/O counters
+typedef struct {
+    long submitted;           // Requests handed to the engine
+    long completed;
+    long batches;             // Submissions that carried at least one request
+    long max_in_flight;
+    int using_ring;           // 1 if requests go through io_uring, 0 if they run synchronously
+} IoStats;
+
+// Background writeback counters
+typedef struct {
+    long passes;             // Times the flusher looked for blocks to write
+    long blocks_written;
+    long writes;             // Backing-store writes, each covering a run of neighbouring blocks
+    long throttled;          // Writes that waited for the flusher because too much was dirty
+    int dirty_blocks;        // Dirty resident blocks right now
+} WritebackStats;
+
+// Inode lock shard, one per cache line
+typedef struct __attribute__((aligned(64))) {
+    RwLock lock;
+    long writes;  // Changes to the data of the shard's inodes, counted under the lock
+} InodeLockShard;
+
+// Ids of the indexed names holding one trigram, ascending because ids only grow
+typedef struct {
+    uint32_t key;  // The trigram's three bytes plus one, 0 for an empty slot
+    int count;
+    int capacity;
+    int* ids;
+} TrigramPosting;
+
+// Decides whether a node whose name holds the fragment is a match; nonzero keeps it. Called
+// with search_lock held, so it must not change the tree.
+typedef int (*SearchFilter)(const DirectoryStruct* node, void* context);
+
+// Matches gathered by one search, and what they must satisfy
+typedef struct {
+    DirectoryStruct* scope;   // Only nodes below it match
+    SearchFilter filter;      // NULL keeps every node below scope
+    void* context;
+    DirectoryStruct** nodes;  // malloc'd, handed to the caller
+    int count;
+    int capacity;
+} SearchResults;
+
+// A search run in slices of ids by search_names_next, so the caller can stop, report
+// progress and let writers at the index in between
+typedef struct {
+    int next_id;              // First id the next slice looks at
+    int id_count;             // Ids in the index as of the last slice
+    unsigned int generation;  // search_generation the ids belong to
+} SearchCursor;
+
+// Path resolution cache entry
+typedef struct {
+    unsigned int sequence;    // Odd while the entry is being rewritten
+    unsigned int hash;
+    unsigned int generation;  // Entry is valid only while equal to dentry_generation
+    DirectoryStruct* root;
+    DirectoryStruct* node;
+    char path[DENTRY_PATH_LENGTH];
+} DentryCacheEntry;
 
 
 // Global Variables
 
-superblock sb;
-inode inodes[MAX_INODES];
-Directory directory;
-OpenFile open_files[MAX_OPEN_FILES];
-unsigned char blocks[MAX_BLOCKS * BLOCK_SIZE];
-unsigned char block_bitmap[MAX_BLOCKS / 8];
-CacheBlock cache[CACHE_SIZE];
-int cache_clock = 0;
-JournalEntry journal[JOURNAL_SIZE];
-int journal_index = 0;
+// The mounted volume: superblock, block bitmap, inode table, directory, name index and
+// data blocks laid out in one region, either heap memory or a mapped image file. The tables
+// point into meta_base: the volume itself, or for an image a copy-on-write mapping of
+// everything before the log region, so changes reach the image only through the log.
+unsigned char* volume_base = NULL;
+unsigned char* meta_base = NULL;
+superblock* sb = NULL;
+inode* inodes = NULL;
+Directory* directory = NULL;
+unsigned char* blocks = NULL;
+uint64_t* block_bitmap = NULL;         // Bit i of word w is block w * 64 + i
+uint64_t* inode_bitmap = NULL;         // Inodes in use, same bit order
+uint64_t* slot_bitmap = NULL;          // Directory entries in use
+int* name_hash_heads = NULL;           // First directory entry in each bucket, -1 if empty
+int* name_hash_next = NULL;            // Next directory entry in the same bucket
+int name_index_ready = 0;              // The name index matches the directory; 0 after a mount until first use
+uint64_t* atime_dirty = NULL;          // Inodes whose access time changed since the mount
+int volume_is_image = 0;               // Volume is mapped from an image file
+size_t volume_mapped_size = 0;         // Length of an anonymous mapping holding an in-memory volume, 0 if heap allocated
+#ifdef _WIN32
+HANDLE image_file = INVALID_HANDLE_VALUE;
+HANDLE image_mapping = NULL;
+#else
+int image_fd = -1;
+#endif
 
-// Cache Initialization
+OpenFile* fd_chunks[FD_MAX_CHUNKS];  // Descriptor table, NULL past the last chunk
+int fd_chunk_count = 0;
+int* fd_free_stack = NULL;           // Free descriptors not cached by any thread
+int fd_free_count = 0;
+unsigned int fd_generation = 0;      // Bumped when the table is reset
+THREAD_LOCAL int fd_local[FD_THREAD_CACHE];  // This thread's free descriptors, lowest on top
+THREAD_LOCAL int fd_local_count = 0;
+THREAD_LOCAL unsigned int fd_local_generation = 0;
+THREAD_LOCAL int fd_local_watched = 0;  // fd_exit_key is set for this thread
+ThreadKey fd_exit_key;               // Its destructor hands a finished thread's cache back
+int fd_exit_key_ready = 0;
+int alloc_hint = 0;                    // Next-fit cursor, where the next block search starts
+int inode_hint = 0;                    // No inode below this one is free
+int slot_hint = 0;                     // No directory entry below this one is free
+DirectoryStruct** inode_nodes = NULL;  // Tree node of each file inode, NULL if it has none
+CacheShard* cache_shards = NULL;
+int cache_shard_count = 0;          // Power of two
+int cache_capacity = 0;             // Resident blocks over all shards
+THREAD_LOCAL long cache_pending_hits[CACHE_MAX_SHARDS];  // Hits not yet added to the shard stats
+int cache_dirty_blocks = 0;         // Dirty resident blocks over all shards
+Thread writeback_thread;
+int writeback_running = 0;          // The flusher thread has been started and not yet joined
+int writeback_stop = 0;             // Asks the flusher to finish
+long writeback_passes = 0;          // Passes the flusher has finished
+int writeback_background_ratio = WRITEBACK_BACKGROUND_RATIO;
+int writeback_dirty_ratio = WRITEBACK_DIRTY_RATIO;
+int writeback_expire_ms = WRITEBACK_EXPIRE_MS;
+CondVar writeback_wake;             // Signalled to start a pass before the interval is up
+CondVar writeback_progress;         // Broadcast when a pass ends
+WritebackStats writeback_stats;
+THREAD_LOCAL LogRange* log_ranges = NULL;   // Ranges changed by this thread's open transaction
+THREAD_LOCAL int log_range_count = 0;
+THREAD_LOCAL int log_range_capacity = 0;
+THREAD_LOCAL unsigned char* log_copy = NULL;  // New bytes of those ranges
+THREAD_LOCAL size_t log_copy_used = 0;
+THREAD_LOCAL size_t log_copy_capacity = 0;
+THREAD_LOCAL size_t log_delta_bytes = 0;    // Bytes those ranges take in the record, deltas included
+THREAD_LOCAL BlockBatch log_allocs = {NULL, 0, 0};  // Block runs allocated by the open transaction
+THREAD_LOCAL BlockBatch log_frees = {NULL, 0, 0};   // Block runs it freed, still set in the bitmap
+THREAD_LOCAL int journal_depth = 0;         // Nesting of journal_begin calls
+unsigned char* log_buffer = NULL;   // Committed records waiting for the next group write
+size_t log_buffer_used = 0;
+size_t log_buffer_capacity = 0;
+int log_buffer_records = 0;
+uint64_t log_next_lsn = 1;          // LSN of the next transaction to commit
+uint64_t log_durable_lsn = 0;       // Last LSN written to the log region
+BlockBatch log_released = {NULL, 0, 0};  // Runs freed by committed records, reusable once they are in the log
+int log_released_blocks = 0;
+int64_t log_tail = 0;               // Bytes of the log region written since the last checkpoint
+int log_unlinks_applied = 0;        // The last journal_apply deleted inodes
+uint32_t crc32c_table[256];
+JournalStats journal_stats;
+IoRequest io_requests[IO_QUEUE_DEPTH];
+IoRequest* io_free_requests = NULL;
+IoRequest* io_completed = NULL;     // Finished without a ring, reaped by the next poll
+AsyncIo* io_ready = NULL;           // Futures whose callbacks have not run yet
+int io_in_flight = 0;
+int io_unsubmitted = 0;             // Requests queued on the ring but not yet passed to the kernel
+int io_started = 0;
+IoStats io_stats;
+#ifdef HAVE_IO_URING
+int io_ring_fd = -1;
+unsigned* io_sq_tail = NULL;
+unsigned* io_sq_mask = NULL;
+unsigned* io_sq_array = NULL;
+struct io_uring_sqe* io_sqes = NULL;
+unsigned* io_cq_head = NULL;
+unsigned* io_cq_tail = NULL;
+unsigned* io_cq_mask = NULL;
+struct io_uring_cqe* io_cqes = NULL;
+#endif
+DentryCacheEntry dentry_cache[DENTRY_CACHE_SIZE];
+unsigned int dentry_generation = 1;   // Bumped to invalidate every cached path at once
+DirectoryStruct** search_nodes = NULL; // Node of each search id, NULL once removed
+char* search_text = NULL;              // Names of all ids packed in id order, each ended by '\0'
+int* search_offsets = NULL;            // Start of each id's name in search_text, plus the end of the text
+int search_text_length = 0;
+int search_text_capacity = 0;          // Bytes allocated beyond search_text_length are zero
+int search_node_count = 0;             // Ids handed out since the index was last rebuilt
+int search_node_capacity = 0;
+int search_live_count = 0;             // Ids still naming a node
+unsigned int search_generation = 0;    // Bumped when the index is rebuilt and ids change
+TrigramPosting* trigram_table = NULL;  // Open-addressed by trigram
+int trigram_table_size = 0;            // Power of two, 0 before the first name is added
+int trigram_count = 0;
 
-void init_cache() {
-    for (int i = 0; i < CACHE_SIZE; i++) {
-        cache[i].block_num = -1;
-        cache[i].dirty = 0;
-        cache[i].last_used = 0;
-    }
+// Tree node and name storage
+NodeSlab* node_slabs = NULL;           // Every slab, newest first
+int node_slab_used = NODE_SLAB_NODES;  // Nodes handed out from the newest slab
+DirectoryStruct* free_nodes = NULL;    // Freed nodes, linked through parent
+InternedName** name_table = NULL;      // Intern buckets by name hash
+int name_table_size = 0;               // Power of two, 0 before the first name
+int name_count = 0;                    // Distinct names in use
+InternedName* free_names[NAME_CLASSES];  // Freed names by size class
+char* name_arena = NULL;               // Unused part of the newest arena chunk
+size_t name_arena_left = 0;
+
+// Locks, taken in this order: namespace_lock, one inode lock, journal_lock, cache shard locks
+// (by index when several are held), io_lock. alloc_lock (taken last, also inside journal_lock),
+// name_index_lock (inside namespace_lock) and fd_lock are held only briefly and never while
+// taking another lock.
+// Formatting, mounting and resizing the cache need every other caller to be idle.
+RwLock namespace_lock;              // Directory entries and sizes, name index, inode and slot bitmaps, sb->free_inodes
+InodeLockShard inode_locks[INODE_LOCK_SHARDS];  // An inode's size, extents, permissions and data
+Mutex alloc_lock;                   // Block bitmap, alloc_hint, sb->free_blocks
+Mutex name_index_lock;              // Rebuilding the name index on first use after a mount
+                                    // Each cache shard has its own lock
+Mutex journal_lock;                 // Group buffer, LSNs, log tail, checkpoints
+Mutex fd_lock;                      // Descriptor table growth and the shared free stack
+Mutex io_lock;                      // Async I/O engine: ring, request pool and futures
+Mutex writeback_lock;               // Held by the flusher for a pass and by cache_lock_all, before shard locks
+Mutex flusher_lock;                 // Flusher state and its condition variables, taken on its own
+RwLock search_lock;                 // Name search index, taken on its own
+Mutex node_lock;                    // Node slabs and the name intern table, taken on its own
+int locks_ready = 0;
+
+// Cache List Functions
+
+// Unlink an entry from the list it is on
+void cache_list_remove(CacheShard* shard, int e) {
+    CacheBlock* cache = shard->entries;
+    CacheList* list = &shard->lists[cache[e].list];
+    if (cache[e].prev != -1) cache[cache[e].prev].next = cache[e].next; else list->head = cache[e].next;
+    if (cache[e].next != -1) cache[cache[e].next].prev = cache[e].prev; else list->tail = cache[e].prev;
+    list->size--;
 }
 
-// Cache Functions
+// Append an entry at the tail of a list (just behind the clock hand for T1 and T2)
+void cache_list_push(CacheShard* shard, int list_id, int e) {
+    CacheBlock* cache = shard->entries;
+    CacheList* list = &shard->lists[list_id];
+    cache[e].list = list_id;
+    cache[e].prev = list->tail;
+    cache[e].next = -1;
+    if (list->tail != -1) cache[list->tail].next = e; else list->head = e;
+    list->tail = e;
+    list->size++;
+}
 
-// Function to get a block from cache or disk
-char* get_block(int block_num) {
-    // Check if block is in cache
-    for (int i = 0; i < CACHE_SIZE; i++) {
-        if (cache[i].block_num == block_num) {
-            cache[i].last_used = cache_clock++;
-            return cache[i].data;
-        }
-    }
+// Move an entry to the tail of a list
+void cache_list_move(CacheShard* shard, int list_id, int e) {
+    cache_list_remove(shard, e);
+    cache_list_push(shard, list_id, e);
+}
 
-    // If not in cache, load from disk
-    int lru_index = 0;
-    for (int i = 1; i < CACHE_SIZE; i++) {
-        if (cache[i].last_used < cache[lru_index].last_used) {
-            lru_index = i;
-        }
-    }
+// Cache Hash Functions
+
+unsigned int cache_hash(int block_num) {
+    return (unsigned int)block_num * 2654435761u;
+}
+
+// The shard a block lives in, chosen by the high hash bits so buckets use the low ones
+CacheShard* cache_shard(int block_num) {
+    return &cache_shards[(cache_hash(block_num) >> 24) & (unsigned int)(cache_shard_count - 1)];
+}
+
+int cache_shard_index(CacheShard* shard) {
+    return (int)(shard - cache_shards);
+}
 
-    // If dirty, write back to disk
-    if (cache[lru_index].dirty) {
-        memcpy(&blocks[cache[lru_index].block_num * BLOCK_SIZE], cache[lru_index].data, BLOCK_SIZE);
+// Find the entry (resident or ghost) for a block in its shard, -1 if there is none
+int cache_lookup(CacheShard* shard, int block_num) {
+    int e = shard->buckets[cache_hash(block_num) & (unsigned int)shard->bucket_mask];
+    while (e != -1 && shard->entries[e].block_num != block_num) {
+        e = shard->entries[e].hash_next;
     }
+    return e;
+}
 
-    // Load new block into cache
-    cache[lru_index].block_num = block_num;
-    memcpy(cache[lru_index].data, &blocks[block_num * BLOCK_SIZE], BLOCK_SIZE);
-    cache[lru_index].dirty = 0;
-    cache[lru_index].last_used = cache_clock++;
+void cache_hash_insert(CacheShard* shard, int e) {
+    int bucket = (int)(cache_hash(shard->entries[e].block_num) & (unsigned int)shard->bucket_mask);
+    shard->entries[e].hash_next = shard->buckets[bucket];
+    shard->buckets[bucket] = e;
+}
 
-    return cache[lru_index].data;
+void cache_hash_remove(CacheShard* shard, int e) {
+    int* link = &shard->buckets[cache_hash(shard->entries[e].block_num) & (unsigned int)shard->bucket_mask];
+    while (*link != e) {
+        link = &shard->entries[*link].hash_next;
+    }
+    *link = shard->entries[e].hash_next;
 }
 
-// Function to write a block to cache
-void write_block(int block_num, const char* data) {
-    char* cache_data = get_block(block_num);
-    memcpy(cache_data, data, BLOCK_SIZE);
+// Cache Initialization
 
-    // Find the cache entry and mark it as dirty
-    for (int i = 0; i < CACHE_SIZE; i++) {
-        if (cache[i].block_num == block_num) {
-            cache[i].dirty = 1;
-            break;
-        }
+// Release every shard's memory
+void free_cache_shards() {
+    for (int i = 0; i < cache_shard_count; i++) {
+        free(cache_shards[i].entries);
+        free(cache_shards[i].buckets);
+        free(cache_shards[i].frames);
+        free(cache_shards[i].free_frames);
+    }
+    free(cache_shards);
+    cache_shards = NULL;
+    cache_shard_count = 0;
+}
+
+// Set up an empty shard holding capacity blocks
+void init_cache_shard(CacheShard* shard, int capacity) {
+    int entries = capacity * 2;
+    int buckets = 1;
+    while (buckets < entries * 2) {
+        buckets *= 2;
     }
+    rwlock_init(&shard->lock);
+    shard->entries = malloc(entries * sizeof(CacheBlock));
+    shard->buckets = malloc(buckets * sizeof(int));
+    shard->frames = malloc((size_t)capacity * sb->block_size);
+    shard->free_frames = malloc(capacity * sizeof(char*));
+    if (!shard->entries || !shard->buckets || !shard->frames || !shard->free_frames) {
+        printf("Error: Memory allocation failed for a cache of %d blocks\n", capacity);
+        exit(1);
+    }
+    shard->capacity = capacity;
+    shard->bucket_mask = buckets - 1;
+    shard->target_t1 = 0;
 
-    // Add to journal
-    journal[journal_index].operation = 0; // write operation
-    journal[journal_index].block_num = block_num;
-    memcpy(journal[journal_index].data, data, BLOCK_SIZE);
-    journal_index = (journal_index + 1) % JOURNAL_SIZE;
+    for (int i = 0; i < buckets; i++) {
+        shard->buckets[i] = -1;
+    }
+    for (int i = 0; i < CACHE_LISTS; i++) {
+        shard->lists[i] = (CacheList){-1, -1, 0};
+    }
+    for (int i = 0; i < entries; i++) {
+        shard->entries[i].block_num = -1;
+        shard->entries[i].dirty = 0;
+        shard->entries[i].pins = 0;
+        shard->entries[i].referenced = 0;
+        shard->entries[i].lsn = 0;
+        shard->entries[i].data = NULL;
+        cache_list_push(shard, CACHE_FREE, i);
+    }
+    for (int i = 0; i < capacity; i++) {
+        shard->free_frames[i] = shard->frames + (size_t)i * sb->block_size;
+    }
+    shard->free_frame_count = capacity;
+    memset(&shard->stats, 0, sizeof(shard->stats));
 }
 
-// Function to flush cache to disk
-void flush_cache() {
-    for (int i = 0; i < CACHE_SIZE; i++) {
-        if (cache[i].dirty) {
-            memcpy(&blocks[cache[i].block_num * BLOCK_SIZE], cache[i].data, BLOCK_SIZE);
-            cache[i].dirty = 0;
-        }
+// Set up an empty cache holding capacity blocks (drops any previous contents unflushed).
+// Large caches are split into shards of at least CACHE_MIN_SHARD_BLOCKS blocks.
+void init_cache(int capacity) {
+    if (capacity < 1) {
+        capacity = 1;
+    }
+    free_cache_shards();
+    int shards = 1;
+    while (shards * 2 <= CACHE_MAX_SHARDS && capacity / (shards * 2) >= CACHE_MIN_SHARD_BLOCKS) {
+        shards *= 2;
+    }
+    cache_shards = malloc(shards * sizeof(CacheShard));
+    if (cache_shards == NULL) {
+        printf("Error: Memory allocation failed for a cache of %d blocks\n", capacity);
+        exit(1);
     }
+    cache_shard_count = shards;
+    cache_capacity = capacity;
+    for (int i = 0; i < shards; i++) {
+        init_cache_shard(&cache_shards[i], capacity / shards + (i < capacity % shards ? 1 : 0));
+    }
+    memset(cache_pending_hits, 0, sizeof(cache_pending_hits));
+    cache_dirty_blocks = 0;
 }
 
-// Directory Functions
+// Cache Functions
 
-// Create the root directory
-DirectoryStruct* create_root_dir() {
-    DirectoryStruct* root = (DirectoryStruct*)malloc(sizeof(DirectoryStruct));
-    if (root == NULL) {
-        printf("Error: Memory allocation failed for root directory\n");
-        return NULL;
+// Milliseconds from an arbitrary fixed point, never going back
+int64_t monotonic_ms() {
+#ifdef _WIN32
+    return (int64_t)GetTickCount64();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+#endif
+}
+
+// Mark a resident entry dirty, counting it and noting when if it was clean; caller holds the
+// shard lock, shared is enough
+void cache_set_dirty(CacheBlock* entry) {
+    if (!__atomic_load_n(&entry->dirty, __ATOMIC_RELAXED) && __atomic_exchange_n(&entry->dirty, 1, __ATOMIC_ACQ_REL) == 0) {
+        __atomic_store_n(&entry->dirtied_at, monotonic_ms(), __ATOMIC_RELAXED);
+        __atomic_fetch_add(&cache_dirty_blocks, 1, __ATOMIC_RELAXED);
     }
+}
+
+// Is the last logged change to a resident entry in the log region, so its frame may be written back
+int cache_logged(CacheBlock* entry) {
+    return __atomic_load_n(&entry->lsn, __ATOMIC_ACQUIRE) <= __atomic_load_n(&log_durable_lsn, __ATOMIC_ACQUIRE);
+}
 
-    strcpy(root->name, "root");
-    root->parent = NULL;
-    root->children = NULL;
-    root->child_count = 0;
-    root->max_children = 0;
-    root->permissions = (Permissions){1, 1, 1}; // Default permissions: read, write, execute
+// Write a resident entry back to disk if it is dirty
+void cache_writeback(CacheShard* shard, int e) {
+    CacheBlock* entry = &shard->entries[e];
+    if (entry->dirty) {
+        memcpy(&blocks[(size_t)entry->block_num * sb->block_size], entry->data, sb->block_size);
+        entry->dirty = 0;
+        __atomic_fetch_sub(&cache_dirty_blocks, 1, __ATOMIC_RELAXED);
+        shard->stats.writebacks++;
+    }
+}
 
-    return root;
+// Turn a resident entry into a ghost on ghost_list, freeing its frame
+void cache_demote(CacheShard* shard, int e, int ghost_list) {
+    cache_writeback(shard, e);
+    shard->free_frames[shard->free_frame_count++] = shard->entries[e].data;
+    shard->entries[e].data = NULL;
+    cache_list_move(shard, ghost_list, e);
+    shard->stats.evictions++;
 }
 
-// Create a new directory
-DirectoryStruct* create_dir(const char* dir_name, DirectoryStruct* parent) {
-    DirectoryStruct* dir = (DirectoryStruct*)malloc(sizeof(DirectoryStruct));
-    strcpy(dir->name, dir_name);
-    dir->parent = parent;
-    dir->children = NULL;
-    dir->child_count = 0;
-    dir->max_children = 0;
-    dir->permissions = (Permissions){1, 1, 1}; // Default permissions
+// Forget the oldest ghost of a ghost list
+void cache_drop_ghost(CacheShard* shard, int list_id) {
+    int e = shard->lists[list_id].head;
+    cache_hash_remove(shard, e);
+    shard->entries[e].block_num = -1;
+    cache_list_move(shard, CACHE_FREE, e);
+}
 
-    if (parent) {
-        if (parent->child_count >= parent->max_children) {
-            parent->max_children = parent->max_children ? parent->max_children * 2 : 1;
-            parent->children = realloc(parent->children, parent->max_children * sizeof(DirectoryStruct*));
+// CAR REPLACE: sweep the clock hands until an unreferenced, unpinned block is found and
+// evicted. Referenced T1 blocks graduate to T2; referenced T2 blocks get another lap. A
+// block whose last change is not in the log yet counts as pinned.
+// Returns -1 if every resident block is pinned.
+int cache_replace(CacheShard* shard) {
+    if (shard->free_frame_count > 0) {
+        return 0;
+    }
+    CacheBlock* cache = shard->entries;
+    int target = shard->target_t1 > 1 ? shard->target_t1 : 1;
+    // Two laps clear every reference bit, so the budget is only a backstop
+    int budget = 3 * (shard->lists[CACHE_T1].size + shard->lists[CACHE_T2].size) + 1;
+    int t1_pinned = 0, t2_pinned = 0;  // Pinned entries passed in a row, a clock full of them is skipped
+    while (budget-- > 0) {
+        int t1_usable = shard->lists[CACHE_T1].size > t1_pinned;
+        int t2_usable = shard->lists[CACHE_T2].size > t2_pinned;
+        if (t1_usable && (shard->lists[CACHE_T1].size >= target || !t2_usable)) {
+            int e = shard->lists[CACHE_T1].head;
+            if (cache[e].pins > 0 || !cache_logged(&cache[e])) {
+                t1_pinned++;
+                cache_list_move(shard, CACHE_T1, e);
+            } else if (cache[e].referenced > 0) {
+                t1_pinned = 0;
+                cache[e].referenced = 0;
+                cache_list_move(shard, CACHE_T2, e);
+            } else {
+                cache_demote(shard, e, CACHE_B1);
+                return 0;
+            }
+        } else if (t2_usable) {
+            int e = shard->lists[CACHE_T2].head;
+            if (cache[e].pins > 0 || !cache_logged(&cache[e])) {
+                t2_pinned++;
+                cache_list_move(shard, CACHE_T2, e);
+            } else if (cache[e].referenced > 0) {
+                t2_pinned = 0;
+                cache[e].referenced = 0;
+                cache_list_move(shard, CACHE_T2, e);
+            } else {
+                cache_demote(shard, e, CACHE_B2);
+                return 0;
+            }
+        } else {
+            break;  // Both clocks hold only pinned blocks
         }
-        parent->children[parent->child_count++] = dir;
     }
-
-    return dir;
+    return -1;
 }
 
-// Find directory by name
-DirectoryStruct* find_directory(DirectoryStruct* parent, const char* dir_name) {
-    if (parent == NULL || dir_name == NULL) {
-        return NULL;
+// Load a block that missed, evicting as CAR directs; caller holds the shard lock exclusively.
+// source holds the block when it was read ahead, NULL to copy it from the volume.
+// Returns the entry or -1 if every frame is pinned.
+int cache_load(CacheShard* shard, int block_num, const char* source) {
+    CacheBlock* cache = shard->entries;
+    int e = cache_lookup(shard, block_num);
+    if (e != -1 && (cache[e].list == CACHE_T1 || cache[e].list == CACHE_T2)) {
+        return e;  // Another thread loaded it while we waited for the lock
+    }
+    if (source == NULL) {
+        shard->stats.misses++;
+    } else {
+        shard->stats.prefetched++;
     }
 
-    for (int i = 0; i < parent->child_count; i++) {
-        if (strcmp(parent->children[i]->name, dir_name) == 0) {
-            return parent->children[i];
+    int resident = shard->lists[CACHE_T1].size + shard->lists[CACHE_T2].size;
+    if (resident == shard->capacity) {
+        if (cache_replace(shard) != 0) {
+            return -1;
+        }
+        // Keep the ghost history within the capacity bounds
+        if (e == -1) {
+            if (shard->lists[CACHE_T1].size + shard->lists[CACHE_B1].size == shard->capacity) {
+                cache_drop_ghost(shard, CACHE_B1);
+            } else if (resident + shard->lists[CACHE_B1].size + shard->lists[CACHE_B2].size == 2 * shard->capacity) {
+                cache_drop_ghost(shard, CACHE_B2);
+            }
         }
     }
 
-    return NULL;
+    int target_list = CACHE_T2;
+    int b1_size = shard->lists[CACHE_B1].size;
+    int b2_size = shard->lists[CACHE_B2].size;
+    if (e == -1) {
+        if (shard->lists[CACHE_FREE].size == 0) {
+            cache_drop_ghost(shard, b1_size > 0 ? CACHE_B1 : CACHE_B2);
+        }
+        e = shard->lists[CACHE_FREE].head;
+        cache[e].block_num = block_num;
+        cache_hash_insert(shard, e);
+        target_list = CACHE_T1;
+    } else if (cache[e].list == CACHE_B1) {
+        // Recently evicted from T1: favour recency
+        int step = b1_size >= b2_size ? 1 : b2_size / b1_size;
+        shard->target_t1 = shard->target_t1 + step < shard->capacity ? shard->target_t1 + step : shard->capacity;
+    } else {
+        // Recently evicted from T2: favour frequency
+        int step = b2_size >= b1_size ? 1 : b1_size / b2_size;
+        shard->target_t1 = shard->target_t1 - step > 0 ? shard->target_t1 - step : 0;
+    }
+
+    // Load the block into a free frame. A block read ahead is marked -1 so its first use
+    // counts as the load rather than as a second reference.
+    cache[e].data = shard->free_frames[--shard->free_frame_count];
+    memcpy(cache[e].data, source != NULL ? source : (const char*)&blocks[(size_t)block_num * sb->block_size], sb->block_size);
+    cache[e].dirty = 0;
+    cache[e].lsn = 0;
+    cache[e].referenced = source != NULL ? -1 : 0;
+    cache_list_move(shard, target_list, e);
+    return e;
 }
 
-// Get the file size
-int get_file_size(const char *filename) {
-    for (int i = 0; i < MAX_INODES; i++) {
-        if (directory.entries[i].inode_number != -1 && strcmp(directory.entries[i].name, filename) == 0) {
-            int inode_number = directory.entries[i].inode_number;
-            if (inode_number >= 0 && inode_number < MAX_INODES) {
-                return inodes[inode_number].file_size;
-            } else {
-                printf("Error: Invalid inode number %d for file %s\n", inode_number, filename);
-                return -1;
-            }
+// Pin a resident entry, waiting while the flusher copies it; caller holds the shard lock,
+// shared is enough
+void cache_pin(CacheBlock* entry) {
+    int pins = __atomic_load_n(&entry->pins, __ATOMIC_RELAXED);
+    for (;;) {
+        if (pins < 0) {
+            pins = __atomic_load_n(&entry->pins, __ATOMIC_RELAXED);  // The copy takes one memcpy
+        } else if (__atomic_compare_exchange_n(&entry->pins, &pins, pins + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
         }
     }
-    printf("Error: File %s not found\n", filename);
-    return -1; // Or handle error as appropriate in your context
 }
 
-// List all directories and subdirectories
-void list_directory(DirectoryStruct* dir, int depth) {
-    for (int i = 0; i < dir->child_count; i++) {
-        for (int j = 0; j < depth; j++) {
-            printf("  ");
-        }
-        printf("[DIR] %s\n", dir->children[i]->name);
-        list_directory(dir->children[i], depth + 1);
+// Count a hit privately, adding the batch to the shard's stats now and then
+void cache_count_hit(CacheShard* shard) {
+    int index = cache_shard_index(shard);
+    if (++cache_pending_hits[index] >= CACHE_HIT_BATCH) {
+        __atomic_fetch_add(&shard->stats.hits, cache_pending_hits[index], __ATOMIC_RELAXED);
+        cache_pending_hits[index] = 0;
     }
 }
 
+// Defined with the journal: write the committed records to the log, 1 if there were any
+int journal_write_committed();
 
-// Navigate directory path
-DirectoryStruct* navigate_path(DirectoryStruct* root, const char* path) {
-    char* path_copy = strdup(path);
-    char* token = strtok(path_copy, "/");
-    DirectoryStruct* current = root;
+// Find a block's frame, loading it on a miss, and optionally pin it (NULL if every frame is pinned).
+// reference is 0 for a reader back at the block its last read ended in, so CAR does not
+// count one pass over the block twice.
+char* cache_access(int block_num, int pin, int reference) {
+    CacheShard* shard = cache_shard(block_num);
 
-    while (token != NULL) {
-        DirectoryStruct* next = find_directory(current, token);
-        if (next == NULL) {
-            free(path_copy);
-            return NULL;
+    // Hit path: shared lock, no list changes, only the reference bit and the pin count
+    rwlock_read_lock(&shard->lock);
+    int e = cache_lookup(shard, block_num);
+    if (e != -1 && shard->entries[e].data != NULL) {
+        CacheBlock* entry = &shard->entries[e];
+        int referenced = __atomic_load_n(&entry->referenced, __ATOMIC_RELAXED);
+        if (reference && referenced <= 0) {
+            __atomic_store_n(&entry->referenced, referenced + 1, __ATOMIC_RELAXED);
+        }
+        if (pin) {
+            cache_pin(entry);
         }
-        current = next;
-        token = strtok(NULL, "/");
+        char* data = entry->data;
+        rwlock_read_unlock(&shard->lock);
+        cache_count_hit(shard);
+        return data;
     }
+    rwlock_read_unlock(&shard->lock);
 
-    free(path_copy);
-    return current;
+    char* data = NULL;
+    for (int attempt = 0; attempt < 2 && data == NULL; attempt++) {
+        rwlock_write_lock(&shard->lock);
+        e = cache_load(shard, block_num, NULL);
+        if (e != -1) {
+            data = shard->entries[e].data;
+            if (pin) {
+                shard->entries[e].pins++;
+            }
+        }
+        rwlock_write_unlock(&shard->lock);
+        // Frames held only until their changes are logged are freed by writing the log
+        if (data == NULL && (attempt > 0 || !journal_write_committed())) {
+            break;
+        }
+    }
+    if (data == NULL) {
+        printf("Error: Every cache block is pinned, cannot load block %d\n", block_num);
+    }
+    return data;
 }
 
+// Function to get a block from cache or disk (NULL if every frame is pinned).
+// Another thread can evict the frame once this returns; concurrent callers use pin_block.
+char* get_block(int block_num) {
+    return cache_access(block_num, 0, 1);
+}
 
-// Calculate directory size
-int calculate_directory_size(DirectoryStruct* dir) {
-    int total_size = 0;
-    for (int i = 0; i < dir->child_count; i++) {
-        if (dir->children[i]->child_count > 0) {
-            // This is a subdirectory
-            total_size += calculate_directory_size(dir->children[i]);
-        } else {
-            // This is a file
-            int file_size = get_file_size(dir->children[i]->name);
-            if (file_size >= 0)
-            {
-                total_size += file_size;
-            }
+// Get a block and keep it resident until unpin_block (NULL if every frame is pinned)
+char* pin_block(int block_num) {
+    return cache_access(block_num, 1, 1);
+}
+
+// Pin a block only if it is already resident, NULL on a miss (nothing is loaded)
+char* pin_resident_block(int block_num) {
+    CacheShard* shard = cache_shard(block_num);
+    rwlock_read_lock(&shard->lock);
+    int e = cache_lookup(shard, block_num);
+    char* data = NULL;
+    if (e != -1 && shard->entries[e].data != NULL) {
+        int referenced = __atomic_load_n(&shard->entries[e].referenced, __ATOMIC_RELAXED);
+        if (referenced <= 0) {
+            __atomic_store_n(&shard->entries[e].referenced, referenced + 1, __ATOMIC_RELAXED);
         }
+        cache_pin(&shard->entries[e]);
+        data = shard->entries[e].data;
     }
-    return total_size;
+    rwlock_read_unlock(&shard->lock);
+    if (data != NULL) {
+        cache_count_hit(shard);
+    }
+    return data;
 }
 
+// Is a block resident in the cache
+int cache_resident(int block_num) {
+    CacheShard* shard = cache_shard(block_num);
+    rwlock_read_lock(&shard->lock);
+    int e = cache_lookup(shard, block_num);
+    int resident = e != -1 && shard->entries[e].data != NULL;
+    rwlock_read_unlock(&shard->lock);
+    return resident;
+}
 
-// Set directory permissions
-void set_directory_permissions(DirectoryStruct* dir, unsigned char read, unsigned char write, unsigned char execute) {
-    dir->permissions.read = read;
-    dir->permissions.write = write;
-    dir->permissions.execute = execute;
+// Put a block read ahead into the cache unless it is resident already
+void cache_install(int block_num, const char* data) {
+    CacheShard* shard = cache_shard(block_num);
+    rwlock_write_lock(&shard->lock);
+    int e = cache_lookup(shard, block_num);
+    if (e == -1 || shard->entries[e].data == NULL) {
+        cache_load(shard, block_num, data);
+    }
+    rwlock_write_unlock(&shard->lock);
 }
 
-// Block Functions
+// Release a block taken with pin_block, marking it dirty if it was modified
+void unpin_block(int block_num, int dirty) {
+    CacheShard* shard = cache_shard(block_num);
+    rwlock_read_lock(&shard->lock);
+    int e = cache_lookup(shard, block_num);
+    if (e != -1 && shard->entries[e].data != NULL) {
+        if (dirty) {
+            cache_set_dirty(&shard->entries[e]);
+        }
+        if (__atomic_load_n(&shard->entries[e].pins, __ATOMIC_RELAXED) > 0) {
+            // Release, so a flusher that finds the entry unpinned sees what was written to it
+            __atomic_fetch_sub(&shard->entries[e].pins, 1, __ATOMIC_RELEASE);
+        }
+    }
+    rwlock_read_unlock(&shard->lock);
+}
 
-// Allocate a block
-int allocate_block() {
-    for (int i = 0; i < MAX_BLOCKS; i++) {
-        if (!(block_bitmap[i / 8] & (1 << (i % 8)))) {
-            block_bitmap[i / 8] |= (1 << (i % 8));
-            sb.free_blocks--;
-            return i;
+// Note the record holding the last change to a resident block, LOG_LSN_PENDING while the
+// transaction making it is open
+void cache_set_lsn(int block_num, uint64_t lsn) {
+    CacheShard* shard = cache_shard(block_num);
+    rwlock_read_lock(&shard->lock);
+    int e = cache_lookup(shard, block_num);
+    if (e != -1 && shard->entries[e].data != NULL) {
+        __atomic_store_n(&shard->entries[e].lsn, lsn, __ATOMIC_RELEASE);
+    }
+    rwlock_read_unlock(&shard->lock);
+}
+
+// Mark a resident block as modified so it is written back
+void mark_block_dirty(int block_num) {
+    CacheShard* shard = cache_shard(block_num);
+    rwlock_read_lock(&shard->lock);
+    int e = cache_lookup(shard, block_num);
+    if (e != -1 && shard->entries[e].data != NULL) {
+        cache_set_dirty(&shard->entries[e]);
+    }
+    rwlock_read_unlock(&shard->lock);
+}
+
+// Function to write a block to cache
+void write_block(int block_num, const char* data) {
+    char* cache_data = pin_block(block_num);
+    if (cache_data != NULL) {
+        if (cache_data != data) {
+            memcpy(cache_data, data, sb->block_size);
         }
+        unpin_block(block_num, 1);
     }
-    return -1;
 }
 
-// Free a block
-void free_block(int block_num) {
-    block_bitmap[block_num / 8] &= ~(1 << (block_num % 8));
-    sb.free_blocks++;
+// Write the mapped volume out to its image file
+void sync_image() {
+    if (!volume_is_image) {
+        return;
+    }
+#ifdef _WIN32
+    FlushViewOfFile(volume_base, 0);
+    FlushFileBuffers(image_file);
+#else
+    if (msync(volume_base, (size_t)sb->volume_size, MS_SYNC) != 0) {
+        printf("Error: Failed to sync the volume image\n");
+    }
+#endif
 }
 
-// File operations
+// Write length bytes of the mapped volume at offset out to its image file
+void sync_volume_range(int64_t offset, int64_t length) {
+    if (!volume_is_image) {
+        return;
+    }
+#ifdef _WIN32
+    FlushViewOfFile(volume_base + offset, (SIZE_T)length);
+    FlushFileBuffers(image_file);
+#else
+    int64_t start = offset - offset % sysconf(_SC_PAGESIZE);  // msync wants a page-aligned address
+    if (msync(volume_base + start, (size_t)(offset + length - start), MS_SYNC) != 0) {
+        printf("Error: Failed to sync the volume image\n");
+    }
+#endif
+}
 
-// Create a file
-int create_file(const char *filename, int size, int permissions) {
-    int blocks_needed = (size + sb.block_size - 1) / sb.block_size;
-    if (blocks_needed > INDEX_BLOCK_SIZE) {
-        printf("Error: File size too large for current implementation\n");
+// Async I/O Functions
+//
+// Reads and writes of the backing store are queued as IoRequests on an io_uring ring and
+// passed to the kernel in batches, so one thread can keep up to IO_QUEUE_DEPTH of them in
+// flight against an image. Without io_uring, and for in-memory volumes, each request runs
+// synchronously when queued and completes on the next poll. Completion is reported through
+// AsyncIo futures, which can be waited on or given a callback.
+
+#ifdef HAVE_IO_URING
+// Set up the ring, 0 on success; -1 leaves the engine synchronous
+int io_ring_setup() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, IO_QUEUE_DEPTH, &params);
+    if (fd < 0) {
         return -1;
     }
-    if (sb.free_blocks < blocks_needed || sb.free_inodes == 0) {
-        printf("Error: Not enough free space or inodes to create file %s\n", filename);
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(fd);  // Kernel predates IORING_OP_READ and IORING_OP_WRITE
         return -1;
     }
-    int block_nums[INDEX_BLOCK_SIZE];
-    for (int i = 0; i < blocks_needed; i++) {
-        block_nums[i] = allocate_block();
-        if (block_nums[i] == -1) {
-            for (int j = 0; j < i; j++) {
-                free_block(block_nums[j]);
-            }
-            printf("Error: Failed to allocate blocks for file %s\n", filename);
-            return -1;
-        }
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap && cq_size > sq_size) {
+        sq_size = cq_size;
     }
-    int inode_number = -1;
-    for (int i = 0; i < MAX_INODES; i++) {
-        if (inodes[i].inode_number == -1) {
-            inode_number = i;
-            break;
+    unsigned char* sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    unsigned char* cq = single_mmap ? sq : mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void* sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, params.sq_entries * sizeof(struct io_uring_sqe));
         }
-    }
-    if (inode_number == -1) {
-        for (int i = 0; i < blocks_needed; i++) {
-            free_block(block_nums[i]);
+        if (cq != MAP_FAILED && cq != sq) {
+            munmap(cq, cq_size);
         }
-        printf("Error: No free inodes available\n");
+        if (sq != MAP_FAILED) {
+            munmap(sq, sq_size);
+        }
+        close(fd);
         return -1;
     }
-    inodes[inode_number].inode_number = inode_number;
-    inodes[inode_number].file_size = size;
-    inodes[inode_number].permissions = permissions;
-    memcpy(inodes[inode_number].data_blocks, block_nums, sizeof(block_nums));
-    for (int i = 0; i < MAX_INODES; i++) {
-        if (directory.entries[i].inode_number == -1) {
-            strncpy(directory.entries[i].name, filename, FILE_NAME_LENGTH - 1);
-            directory.entries[i].name[FILE_NAME_LENGTH - 1] = '\0';
-            directory.entries[i].inode_number = inode_number;
-            break;
+    io_ring_fd = fd;
+    io_sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    io_sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    io_sq_array = (unsigned*)(sq + params.sq_off.array);
+    io_sqes = sqes;
+    io_cq_head = (unsigned*)(cq + params.cq_off.head);
+    io_cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    io_cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    io_cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+}
+#endif
+
+// Create the request pool and, where available, the ring (once per process)
+void io_engine_start() {
+    mutex_lock(&io_lock);
+    if (!io_started) {
+        for (int i = 0; i < IO_QUEUE_DEPTH; i++) {
+            io_requests[i].next = i + 1 < IO_QUEUE_DEPTH ? &io_requests[i + 1] : NULL;
         }
+        io_free_requests = &io_requests[0];
+#ifdef HAVE_IO_URING
+        io_stats.using_ring = io_ring_setup() == 0;
+#endif
+        io_started = 1;
     }
-    sb.free_inodes--;
-    return inode_number;
+    mutex_unlock(&io_lock);
 }
 
-// Delete a file
-int delete_file(const char *filename) {
-    for (int i = 0; i < MAX_INODES; i++) {
-        if (directory.entries[i].inode_number != -1 && strcmp(directory.entries[i].name, filename) == 0) {
-            int inode_number = directory.entries[i].inode_number;
-            if (inode_number < 0 || inode_number >= MAX_INODES) {
-                printf("Error: Invalid inode number %d for file %s\n", inode_number, filename);
-                return -1;
-            }
-            for (int j = 0; j < INDEX_BLOCK_SIZE; j++) {
-                int block_num = inodes[inode_number].data_blocks[j];
-                if (block_num >= 0 && block_num < MAX_BLOCKS) {
-                    free_block(block_num);
-                }
-                inodes[inode_number].data_blocks[j] = -1;
-            }
-            inodes[inode_number].inode_number = -1;
-            inodes[inode_number].file_size = 0;
-            directory.entries[i].inode_number = -1;
-            memset(directory.entries[i].name, 0, FILE_NAME_LENGTH);
-            sb.free_inodes++;
-            return 0;
+// Run a request synchronously, returning the bytes transferred or -1
+long io_execute(IoRequest* request) {
+    if (!volume_is_image) {
+        unsigned char* address = volume_base + request->offset;
+        if (request->opcode == IO_READ) {
+            memcpy(request->buffer, address, request->length);
+        } else {
+            memcpy(address, request->buffer, request->length);
+        }
+        return (long)request->length;
+    }
+#ifdef _WIN32
+    OVERLAPPED position;
+    memset(&position, 0, sizeof(position));
+    position.Offset = (DWORD)request->offset;
+    position.OffsetHigh = (DWORD)(request->offset >> 32);
+    DWORD transferred = 0;
+    BOOL ok = request->opcode == IO_READ
+        ? ReadFile(image_file, request->buffer, (DWORD)request->length, &transferred, &position)
+        : WriteFile(image_file, request->buffer, (DWORD)request->length, &transferred, &position);
+    return ok ? (long)transferred : -1;
+#else
+    size_t done = 0;
+    while (done < request->length) {
+        ssize_t count = request->opcode == IO_READ
+            ? pread(image_fd, request->buffer + done, request->length - done, (off_t)(request->offset + done))
+            : pwrite(image_fd, request->buffer + done, request->length - done, (off_t)(request->offset + done));
+        if (count <= 0) {
+            return -1;
         }
+        done += (size_t)count;
     }
+    return (long)done;
+#endif
 }
 
-// Open a file
-int open_file(const char *filename) {
-    for (int i = 0; i < MAX_INODES; i++) {
-        if (directory.entries[i].inode_number != -1 && strcmp(directory.entries[i].name, filename) == 0) {
-            int inode_number = directory.entries[i].inode_number;
-            for (int j = 0; j < MAX_OPEN_FILES; j++) {
-                if (open_files[j].inode_number == -1) {
-                    open_files[j].inode_number = inode_number;
-                    open_files[j].current_position = 0;
-                    inodes[inode_number].timestamps[2] = time(NULL);  // Update access time
-                    return j;  // Return file descriptor
-                }
-            }
-            return -1;  // Too many open files
+// Count one part of a future as finished; caller holds io_lock
+void io_future_part_done(AsyncIo* future, int ok, long bytes) {
+    if (!ok) {
+        future->failed = 1;
+    }
+    future->result += bytes;
+    if (--future->pending == 0) {
+        if (future->failed) {
+            future->result = -1;
+        }
+        if (future->callback != NULL) {
+            future->next_ready = io_ready;
+            io_ready = future;
         }
+        __atomic_store_n(&future->done, 1, __ATOMIC_RELEASE);
     }
-    return -1;  // File not found
 }
 
-// Close a file
-void close_file(int file_descriptor) {
-    if (file_descriptor >= 0 && file_descriptor < MAX_OPEN_FILES) {
-        if (open_files[file_descriptor].inode_number != -1) {
-            open_files[file_descriptor].inode_number = -1;
-            open_files[file_descriptor].current_position = 0;
-            printf("File descriptor %d closed successfully\n", file_descriptor);
-        } else {
-            printf("Error: File descriptor %d is not open\n", file_descriptor);
+// Record a finished request against its future and recycle it; caller holds io_lock
+void io_complete(IoRequest* request, long result) {
+    AsyncIo* future = request->future;
+    request->next = io_free_requests;
+    io_free_requests = request;
+    io_in_flight--;
+    io_stats.completed++;
+    io_future_part_done(future, result == (long)request->length, result > 0 ? result : 0);
+}
+
+// Pass queued requests to the kernel; caller holds io_lock
+void io_submit_locked() {
+#ifdef HAVE_IO_URING
+    while (io_unsubmitted > 0) {
+        int submitted = (int)syscall(__NR_io_uring_enter, io_ring_fd, io_unsubmitted, 0, 0, NULL, 0);
+        if (submitted < 0) {
+            break;  // EAGAIN or EBUSY: retried on the next submit or poll
         }
-    } else {
-        printf("Error: Invalid file descriptor %d\n", file_descriptor);
+        io_unsubmitted -= submitted;
+        io_stats.batches++;
     }
+#endif
 }
 
-// Function to set file permissions
-void set_permissions(int inode_num, int permissions) {
-    if (inode_num >= 0 && inode_num < MAX_INODES) {
-        inodes[inode_num].permissions = permissions;
+// Collect finished requests, blocking for one if wait is set and none are ready. Caller
+// holds io_lock, which stays held while blocked so no other thread can take the completion
+// being waited for. Callbacks are left on io_ready.
+void io_reap(int wait) {
+    io_submit_locked();
+    while (io_completed != NULL) {
+        IoRequest* request = io_completed;
+        io_completed = request->next;
+        io_complete(request, request->result);
+    }
+#ifdef HAVE_IO_URING
+    if (io_stats.using_ring) {
+        unsigned head = *io_cq_head;
+        if (wait && io_in_flight > io_unsubmitted && head == __atomic_load_n(io_cq_tail, __ATOMIC_ACQUIRE)) {
+            syscall(__NR_io_uring_enter, io_ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        }
+        while (head != __atomic_load_n(io_cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &io_cqes[head & *io_cq_mask];
+            io_complete((IoRequest*)(uintptr_t)cqe->user_data, (long)cqe->res);
+            head++;
+        }
+        __atomic_store_n(io_cq_head, head, __ATOMIC_RELEASE);
     }
+#endif
 }
 
-// Function to check file permissions
-int check_permissions(int inode_num, int requested_permission) {
-    if (inode_num >= 0 && inode_num < MAX_INODES) {
-        return (inodes[inode_num].permissions & requested_permission) != 0;
+// Run the callbacks of completed futures; called without io_lock held
+void io_run_callbacks() {
+    mutex_lock(&io_lock);
+    AsyncIo* ready = io_ready;
+    io_ready = NULL;
+    mutex_unlock(&io_lock);
+    while (ready != NULL) {
+        AsyncIo* next = ready->next_ready;
+        ready->callback(ready);
+        ready = next;
     }
-    return 0;
 }
 
-// Read from a file
-int read_file(int file_descriptor, char *buffer, int size) {
-    if (file_descriptor < 0 || file_descriptor >= MAX_OPEN_FILES || open_files[file_descriptor].inode_number == -1) {
-        return -1;
+// Prepare a future; callback (optional) runs once it completes
+void io_future_init(AsyncIo* io, void (*callback)(AsyncIo* io), void* context) {
+    memset(io, 0, sizeof(*io));
+    io->callback = callback;
+    io->context = context;
+}
+
+// Hold a future open while its parts are queued, so it cannot complete half built
+void io_future_hold(AsyncIo* io) {
+    mutex_lock(&io_lock);
+    io->pending++;
+    mutex_unlock(&io_lock);
+}
+
+// Drop the hold taken by io_future_hold and submit the parts queued under it. bytes were
+// moved synchronously on the future's behalf; ok is 0 if that failed.
+void io_future_release(AsyncIo* io, int ok, long bytes) {
+    mutex_lock(&io_lock);
+    io_future_part_done(io, ok, bytes);
+    io_submit_locked();
+    mutex_unlock(&io_lock);
+}
+
+// Queue a read or write of length bytes at a volume offset as a part of io.
+// The buffer must stay valid until io completes.
+void io_queue(AsyncIo* io, int opcode, char* buffer, size_t length, int64_t offset) {
+    mutex_lock(&io_lock);
+    while (io_free_requests == NULL) {
+        io_reap(1);  // Every request is in flight, wait for one to finish
+    }
+    IoRequest* request = io_free_requests;
+    io_free_requests = request->next;
+    request->opcode = opcode;
+    request->buffer = buffer;
+    request->length = length;
+    request->offset = offset;
+    request->future = io;
+    io->pending++;
+    io_in_flight++;
+    io_stats.submitted++;
+    if (io_in_flight > io_stats.max_in_flight) {
+        io_stats.max_in_flight = io_in_flight;
+    }
+#ifdef HAVE_IO_URING
+    if (io_stats.using_ring && volume_is_image) {
+        unsigned tail = *io_sq_tail;
+        unsigned index = tail & *io_sq_mask;
+        struct io_uring_sqe* sqe = &io_sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode == IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+        sqe->fd = image_fd;
+        sqe->addr = (uint64_t)(uintptr_t)buffer;
+        sqe->len = (unsigned)length;
+        sqe->off = (uint64_t)offset;
+        sqe->user_data = (uint64_t)(uintptr_t)request;
+        io_sq_array[index] = index;
+        __atomic_store_n(io_sq_tail, tail + 1, __ATOMIC_RELEASE);
+        io_unsubmitted++;
+        mutex_unlock(&io_lock);
+        return;
     }
-    int inode_number = open_files[file_descriptor].inode_number;
+#endif
+    request->result = io_execute(request);
+    request->next = io_completed;
+    io_completed = request;
+    mutex_unlock(&io_lock);
+}
 
-    // Check read permissions
-    if (!check_permissions(inode_number, 4)) { // 4 is read permission
-        printf("Error: No read permission for file\n");
-        return -1;
+// Pass every queued request to the kernel
+void io_submit() {
+    mutex_lock(&io_lock);
+    io_submit_locked();
+    mutex_unlock(&io_lock);
+}
+
+// Reap completed requests and run ready callbacks; wait blocks until at least one
+// request has finished if any are in flight. Returns the requests still in flight.
+int io_poll(int wait) {
+    mutex_lock(&io_lock);
+    io_reap(wait);
+    int in_flight = io_in_flight;
+    mutex_unlock(&io_lock);
+    io_run_callbacks();
+    return in_flight;
+}
+
+// Block until io completes and return its result without running any callbacks, for
+// callers holding file system locks
+long io_wait_result(AsyncIo* io) {
+    mutex_lock(&io_lock);
+    while (!__atomic_load_n(&io->done, __ATOMIC_ACQUIRE)) {
+        io_reap(1);
     }
+    mutex_unlock(&io_lock);
+    return io->result;
+}
 
-    int current_position = open_files[file_descriptor].current_position;
-    int file_size = inodes[inode_number].file_size;
-    int bytes_to_read = (current_position + size > file_size) ? (file_size - current_position) : size;
-    int bytes_read = 0;
+// Block until io completes and return its result (bytes transferred, or -1)
+long io_wait(AsyncIo* io) {
+    long result = io_wait_result(io);
+    io_run_callbacks();
+    return result;
+}
 
-    while (bytes_read < bytes_to_read) {
-        int block_index = current_position / BLOCK_SIZE;
-        int block_offset = current_position % BLOCK_SIZE;
-        int block_number = inodes[inode_number].data_blocks[block_index];
-        int bytes_from_block = BLOCK_SIZE - block_offset;
-        if (bytes_from_block > bytes_to_read - bytes_read) {
-            bytes_from_block = bytes_to_read - bytes_read;
-        }
+// Wait for every request in flight
+void io_drain() {
+    if (!io_started) {
+        return;
+    }
+    while (io_poll(1) > 0) {
+    }
+}
 
-        // Use get_block to access data through cache
-        char* block_data = get_block(block_number);
-        memcpy(buffer + bytes_read, block_data + block_offset, bytes_from_block);
+// Read the async I/O counters
+IoStats get_io_stats() {
+    mutex_lock(&io_lock);
+    IoStats stats = io_stats;
+    mutex_unlock(&io_lock);
+    return stats;
+}
 
-        bytes_read += bytes_from_block;
-        current_position += bytes_from_block;
+// Hold off every writeback of cache blocks: a flusher pass in progress could otherwise land
+// an older copy later, and evictions could reuse a frame. Takes writeback_lock and every shard.
+void cache_lock_all() {
+    mutex_lock(&writeback_lock);
+    for (int i = 0; i < cache_shard_count; i++) {
+        rwlock_write_lock(&cache_shards[i].lock);
     }
+}
 
-    open_files[file_descriptor].current_position = current_position;
-    inodes[inode_number].timestamps[2] = time(NULL);  // Update access time
-    return bytes_read;
+void cache_unlock_all() {
+    for (int i = cache_shard_count - 1; i >= 0; i--) {
+        rwlock_write_unlock(&cache_shards[i].lock);
+    }
+    mutex_unlock(&writeback_lock);
 }
 
-// Write to a file
-int write_file(int file_descriptor, const char *buffer, int size) {
-    if (file_descriptor < 0 || file_descriptor >= MAX_OPEN_FILES || open_files[file_descriptor].inode_number == -1) {
-        return -1;
+// Write every dirty resident block whose changes are logged back to the volume as one batch
+// of async writes and wait for them; caller holds cache_lock_all
+void cache_writeback_all() {
+    AsyncIo io;
+    io_future_init(&io, NULL, NULL);
+    io_future_hold(&io);
+    for (int i = 0; i < cache_shard_count; i++) {
+        CacheShard* shard = &cache_shards[i];
+        for (int list_id = CACHE_T1; list_id <= CACHE_T2; list_id++) {
+            for (int e = shard->lists[list_id].head; e != -1; e = shard->entries[e].next) {
+                CacheBlock* entry = &shard->entries[e];
+                if (entry->dirty && cache_logged(entry)) {
+                    io_queue(&io, IO_WRITE, entry->data, sb->block_size,
+                             sb->data_offset + (int64_t)entry->block_num * sb->block_size);
+                    entry->dirty = 0;
+                    __atomic_fetch_sub(&cache_dirty_blocks, 1, __ATOMIC_RELAXED);
+                    shard->stats.writebacks++;
+                }
+            }
+        }
     }
-    int inode_number = open_files[file_descriptor].inode_number;
+    io_future_release(&io, 1, 0);
+    if (io_wait_result(&io) < 0) {
+        printf("Error: Failed to write cached blocks back to the volume\n");
+    }
+}
 
-    // Check write permissions
-    if (!check_permissions(inode_number, 2)) { // 2 is write permission
-        printf("Error: No write permission for file\n");
-        return -1;
+// Writeback Functions
+//
+// A flusher thread writes dirty cache blocks back in the background: those dirty for longer
+// than writeback_expire_ms on every pass, and all of them once more than the background
+// share of the cache is dirty. A pass sorts the blocks it picked by number, pins a batch at a
+// time so none can be evicted and rewritten under it, copies each block and clears its dirty
+// bit, and writes runs of neighbouring blocks with one request each. Blocks pinned by someone
+// else are left for a later pass; a writer that pins a block after it was copied marks it
+// dirty again, so its change goes out with a later pass. Writers that find more than the
+// dirty share of the cache dirty wait for a pass to finish. A block is only written once the
+// journal record that last changed it is in the log; when a pass finds blocks whose records
+// are still buffered, it writes the buffered group first.
+
+// Dirty blocks making up ratio percent of the cache, at least one
+int writeback_threshold(int ratio) {
+    int blocks = (int)((int64_t)cache_capacity * ratio / 100);
+    return blocks > 0 ? blocks : 1;
+}
+
+int compare_block_numbers(const void* a, const void* b) {
+    int left = *(const int*)a;
+    int right = *(const int*)b;
+    return (left > right) - (left < right);
+}
+
+// List the unpinned dirty blocks due for writeback whose changes are logged, in block order.
+// Returns the count and sets *unlogged to the due blocks left out for their records.
+int writeback_candidates(int* candidates, int capacity, int all, int* unlogged) {
+    int64_t now = monotonic_ms();
+    int count = 0;
+    *unlogged = 0;
+    for (int i = 0; i < cache_shard_count && count < capacity; i++) {
+        CacheShard* shard = &cache_shards[i];
+        rwlock_read_lock(&shard->lock);
+        for (int list_id = CACHE_T1; list_id <= CACHE_T2; list_id++) {
+            for (int e = shard->lists[list_id].head; e != -1 && count < capacity; e = shard->entries[e].next) {
+                CacheBlock* entry = &shard->entries[e];
+                if (__atomic_load_n(&entry->dirty, __ATOMIC_RELAXED) && __atomic_load_n(&entry->pins, __ATOMIC_RELAXED) == 0 &&
+                    (all || now - __atomic_load_n(&entry->dirtied_at, __ATOMIC_RELAXED) >= writeback_expire_ms)) {
+                    if (cache_logged(entry)) {
+                        candidates[count++] = entry->block_num;
+                    } else {
+                        (*unlogged)++;
+                    }
+                }
+            }
+        }
+        rwlock_read_unlock(&shard->lock);
     }
+    qsort(candidates, count, sizeof(int), compare_block_numbers);
+    return count;
+}
 
-    int current_position = open_files[file_descriptor].current_position;
-    int bytes_written = 0;
+// Pin a block that is still resident, dirty, unused and logged, copy it to staging and clear
+// its dirty bit. pinned counts the blocks a batch holds in each shard; at most half of a shard is taken
+// so its other users still find frames. Returns 1 if the block was taken.
+int writeback_stage(int block_num, char* staging, int* pinned) {
+    CacheShard* shard = cache_shard(block_num);
+    int index = cache_shard_index(shard);
+    int taken = 0;
+    if (pinned[index] >= (shard->capacity + 1) / 2) {
+        return 0;  // Left dirty for the next pass
+    }
+    rwlock_read_lock(&shard->lock);
+    int e = cache_lookup(shard, block_num);
+    int unpinned = 0;
+    if (e != -1 && shard->entries[e].data != NULL) {
+        // Only an entry nobody has pinned is taken, and pinning it -1 holds writers off the
+        // frame while it is copied
+        CacheBlock* entry = &shard->entries[e];
+        if (__atomic_compare_exchange_n(&entry->pins, &unpinned, -1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            // A change is logged before its writer unpins, so the LSN seen now covers the copy
+            if (cache_logged(entry) && __atomic_exchange_n(&entry->dirty, 0, __ATOMIC_ACQ_REL)) {
+                memcpy(staging, entry->data, sb->block_size);
+                __atomic_fetch_sub(&cache_dirty_blocks, 1, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&shard->stats.writebacks, 1, __ATOMIC_RELAXED);
+                pinned[index]++;
+                taken = 1;
+            }
+            // Keep one ordinary pin until the write lands so the frame is not evicted and
+            // rewritten from an older copy
+            __atomic_store_n(&entry->pins, taken, __ATOMIC_RELEASE);
+        }
+    }
+    rwlock_read_unlock(&shard->lock);
+    return taken;
+}
 
-    while (bytes_written < size) {
-        int block_index = current_position / BLOCK_SIZE;
-        int block_offset = current_position % BLOCK_SIZE;
-        if (inodes[inode_number].data_blocks[block_index] == -1) {
-            int new_block = allocate_block();
-            if (new_block == -1) {
-                break;
+// Write back count blocks listed in block order, a batch at a time. Returns blocks written
+// and adds the backing-store writes it took to *writes.
+int writeback_blocks(const int* block_nums, int count, char* staging, long* writes) {
+    int staged_blocks[WRITEBACK_BATCH];
+    int pinned[CACHE_MAX_SHARDS];
+    int written = 0;
+    for (int first = 0; first < count; first += WRITEBACK_BATCH) {
+        int staged = 0;
+        memset(pinned, 0, sizeof(pinned));
+        for (int i = first; i < count && i < first + WRITEBACK_BATCH; i++) {
+            if (writeback_stage(block_nums[i], staging + (size_t)staged * sb->block_size, pinned)) {
+                staged_blocks[staged++] = block_nums[i];
             }
-            inodes[inode_number].data_blocks[block_index] = new_block;
         }
-        int block_number = inodes[inode_number].data_blocks[block_index];
-        int bytes_to_write = BLOCK_SIZE - block_offset;
-        if (bytes_to_write > size - bytes_written) {
-            bytes_to_write = size - bytes_written;
+        AsyncIo io;
+        io_future_init(&io, NULL, NULL);
+        io_future_hold(&io);
+        for (int run = 0; run < staged;) {
+            int length = 1;
+            while (run + length < staged && staged_blocks[run + length] == staged_blocks[run] + length) {
+                length++;
+            }
+            io_queue(&io, IO_WRITE, staging + (size_t)run * sb->block_size, (size_t)length * sb->block_size,
+                     sb->data_offset + (int64_t)staged_blocks[run] * sb->block_size);
+            (*writes)++;
+            run += length;
+        }
+        io_future_release(&io, 1, 0);
+        if (io_wait_result(&io) < 0) {
+            printf("Error: Failed to write cached blocks back to the volume\n");
+        }
+        // The writes have landed, the blocks may be evicted again
+        for (int i = 0; i < staged; i++) {
+            unpin_block(staged_blocks[i], 0);
         }
+        written += staged;
+    }
+    return written;
+}
 
-        // Use write_block to write data through cache
-        char* block_data = get_block(block_number);
-        memcpy(block_data + block_offset, buffer + bytes_written, bytes_to_write);
-        write_block(block_number, block_data);
+// One flusher pass. Returns the blocks written and adds the writes it took to *writes.
+int writeback_pass(int* candidates, char* staging, long* writes) {
+    mutex_lock(&writeback_lock);
+    int all = __atomic_load_n(&cache_dirty_blocks, __ATOMIC_RELAXED) > writeback_threshold(writeback_background_ratio);
+    int unlogged = 0;
+    int count = writeback_candidates(candidates, cache_capacity, all, &unlogged);
+    if (unlogged > 0) {
+        // Their records are still in the group buffer; journal_lock comes before writeback_lock
+        mutex_unlock(&writeback_lock);
+        journal_write_committed();
+        mutex_lock(&writeback_lock);
+        count = writeback_candidates(candidates, cache_capacity, all, &unlogged);
+    }
+    int written = writeback_blocks(candidates, count, staging, writes);
+    mutex_unlock(&writeback_lock);
+    return written;
+}
 
-        bytes_written += bytes_to_write;
-        current_position += bytes_to_write;
-        if (current_position > inodes[inode_number].file_size) {
-            inodes[inode_number].file_size = current_position;
+// The flusher: a pass every WRITEBACK_INTERVAL_MS, or sooner when a writer asks
+THREAD_FUNCTION writeback_main(void* arg) {
+    (void)arg;
+    int* candidates = malloc(cache_capacity * sizeof(int));
+    char* staging = malloc((size_t)WRITEBACK_BATCH * sb->block_size);
+    mutex_lock(&flusher_lock);
+    while (!writeback_stop) {
+        if (__atomic_load_n(&cache_dirty_blocks, __ATOMIC_RELAXED) <= writeback_threshold(writeback_background_ratio)) {
+            cond_wait_ms(&writeback_wake, &flusher_lock, WRITEBACK_INTERVAL_MS);
+            if (writeback_stop) {
+                break;
+            }
+        }
+        mutex_unlock(&flusher_lock);
+        long writes = 0;
+        int written = candidates && staging ? writeback_pass(candidates, staging, &writes) : 0;
+        mutex_lock(&flusher_lock);
+        writeback_stats.passes++;
+        writeback_stats.blocks_written += written;
+        writeback_stats.writes += writes;
+        writeback_passes++;
+        cond_broadcast(&writeback_progress);
+        if (written == 0 && __atomic_load_n(&cache_dirty_blocks, __ATOMIC_RELAXED) > writeback_threshold(writeback_background_ratio)) {
+            // What is dirty is pinned; wait for it to be released rather than spin
+            cond_wait_ms(&writeback_wake, &flusher_lock, WRITEBACK_INTERVAL_MS);
         }
     }
+    mutex_unlock(&flusher_lock);
+    free(candidates);
+    free(staging);
+    return THREAD_RESULT;
+}
 
-    open_files[file_descriptor].current_position = current_position;
-    inodes[inode_number].timestamps[1] = time(NULL);  // Update modification time
-    return bytes_written;
+// Start the flusher for the mounted volume
+void start_writeback() {
+    mutex_lock(&flusher_lock);
+    int running = writeback_running;
+    writeback_stop = 0;
+    mutex_unlock(&flusher_lock);
+    if (running) {
+        return;
+    }
+    if (thread_start(&writeback_thread, writeback_main, NULL) != 0) {
+        printf("Error: Failed to start the writeback thread, dirty blocks are written on eviction only\n");
+        return;
+    }
+    mutex_lock(&flusher_lock);
+    writeback_running = 1;
+    mutex_unlock(&flusher_lock);
 }
 
-// Rename a file
-int rename_file(const char *old_name, const char *new_name) {
-    int old_index = -1;
-    int new_index = -1;
+// Stop the flusher and wait for its pass in progress; dirty blocks stay in the cache
+void stop_writeback() {
+    mutex_lock(&flusher_lock);
+    int running = writeback_running;
+    writeback_stop = 1;
+    cond_signal(&writeback_wake);
+    mutex_unlock(&flusher_lock);
+    if (!running) {
+        return;
+    }
+    thread_join(writeback_thread);
+    mutex_lock(&flusher_lock);
+    writeback_running = 0;
+    cond_broadcast(&writeback_progress);
+    mutex_unlock(&flusher_lock);
+}
 
-    // Find the old file and an empty slot for the new name
-    for (int i = 0; i < MAX_INODES; i++) {
-        if (directory.entries[i].inode_number != -1 && strcmp(directory.entries[i].name, old_name) == 0) {
-            old_index = i;
+// Called by writers holding no locks: wake the flusher once the background share of the cache
+// is dirty, and wait for it to finish a pass while more than the dirty share is
+void writeback_throttle() {
+    int dirty = __atomic_load_n(&cache_dirty_blocks, __ATOMIC_RELAXED);
+    if (dirty <= writeback_threshold(writeback_background_ratio)) {
+        return;
+    }
+    mutex_lock(&flusher_lock);
+    if (writeback_running) {
+        cond_signal(&writeback_wake);
+        if (dirty > writeback_threshold(writeback_dirty_ratio)) {
+            writeback_stats.throttled++;
+            long pass = writeback_passes;
+            while (writeback_running && writeback_passes == pass &&
+                   __atomic_load_n(&cache_dirty_blocks, __ATOMIC_RELAXED) > writeback_threshold(writeback_dirty_ratio)) {
+                cond_wait_ms(&writeback_progress, &flusher_lock, WRITEBACK_INTERVAL_MS);
+            }
         }
-        if (directory.entries[i].inode_number == -1 && new_index == -1) {
-            new_index = i;
+    }
+    mutex_unlock(&flusher_lock);
+}
+
+// Change when the flusher writes back: background_ratio and dirty_ratio are percents of the
+// cache (see WRITEBACK_BACKGROUND_RATIO and WRITEBACK_DIRTY_RATIO), expire_ms the age at
+// which a dirty block is written regardless
+void set_writeback_thresholds(int background_ratio, int dirty_ratio, int expire_ms) {
+    mutex_lock(&flusher_lock);
+    writeback_background_ratio = background_ratio;
+    writeback_dirty_ratio = dirty_ratio > background_ratio ? dirty_ratio : background_ratio;
+    writeback_expire_ms = expire_ms;
+    cond_signal(&writeback_wake);
+    mutex_unlock(&flusher_lock);
+}
+
+// Read the writeback counters
+WritebackStats get_writeback_stats() {
+    mutex_lock(&flusher_lock);
+    WritebackStats stats = writeback_stats;
+    mutex_unlock(&flusher_lock);
+    stats.dirty_blocks = __atomic_load_n(&cache_dirty_blocks, __ATOMIC_RELAXED);
+    return stats;
+}
+
+// Bitmap Functions
+
+// Return the first word at or after word that has a clear bit
+int bitmap_skip_full(const uint64_t* map, int word, int word_count) {
+#ifdef __SSE2__
+    // Long allocated runs: test four words per step
+    const __m128i ones = _mm_set1_epi32(-1);
+    while (word + 4 <= word_count) {
+        __m128i low = _mm_loadu_si128((const __m128i*)&map[word]);
+        __m128i high = _mm_loadu_si128((const __m128i*)&map[word + 2]);
+        __m128i full = _mm_and_si128(_mm_cmpeq_epi32(low, ones), _mm_cmpeq_epi32(high, ones));
+        if (_mm_movemask_epi8(full) != 0xFFFF) {
+            break;
         }
-        if (directory.entries[i].inode_number != -1 && strcmp(directory.entries[i].name, new_name) == 0) {
-            printf("Error: File with name %s already exists\n", new_name);
+        word += 4;
+    }
+#endif
+    while (word < word_count && map[word] == UINT64_MAX) {
+        word++;
+    }
+    return word;
+}
+
+// Find the first clear bit in [start, bit_count), -1 if there is none
+int bitmap_find_clear(const uint64_t* map, int bit_count, int start) {
+    if (start >= bit_count) {
+        return -1;
+    }
+    int word_count = (bit_count + 63) / 64;
+    int word = start / 64;
+    uint64_t bits = map[word] | ((1ULL << (start % 64)) - 1);  // Ignore bits below start
+    while (bits == UINT64_MAX) {
+        word = bitmap_skip_full(map, word + 1, word_count);
+        if (word >= word_count) {
             return -1;
         }
+        bits = map[word];
     }
+    int bit = word * 64 + __builtin_ctzll(~bits);
+    return bit < bit_count ? bit : -1;
+}
 
-    if (old_index == -1) {
-        printf("Error: File %s not found\n", old_name);
-        return -1;
+// Count clear bits starting at start, stopping at the first set bit or after max bits
+int bitmap_clear_run(const uint64_t* map, int bit_count, int start, int max) {
+    int length = 0;
+    int bit = start;
+    while (length < max && bit < bit_count) {
+        uint64_t bits = map[bit / 64] >> (bit % 64);
+        int available = 64 - bit % 64;
+        if (bits != 0) {
+            int clear = __builtin_ctzll(bits);
+            if (clear < available) {
+                length += clear;
+                break;
+            }
+        }
+        length += available;
+        bit += available;
+    }
+    if (length > bit_count - start) {
+        length = bit_count - start;
     }
+    return length < max ? length : max;
+}
 
-    if (new_index == -1) {
-        printf("Error: No free directory entries for the new name\n");
-        return -1;
+// Set count bits starting at start
+void bitmap_set_range(uint64_t* map, int start, int count) {
+    while (count > 0) {
+        int offset = start % 64;
+        int span = 64 - offset < count ? 64 - offset : count;
+        uint64_t mask = (span == 64) ? UINT64_MAX : ((1ULL << span) - 1) << offset;
+        map[start / 64] |= mask;
+        start += span;
+        count -= span;
     }
+}
 
-    // Perform the rename
-    strncpy(directory.entries[new_index].name, new_name, FILE_NAME_LENGTH - 1);
-    directory.entries[new_index].name[FILE_NAME_LENGTH - 1] = '\0';
-    directory.entries[new_index].inode_number = directory.entries[old_index].inode_number;
+// Clear count bits starting at start
+void bitmap_clear_range(uint64_t* map, int start, int count) {
+    while (count > 0) {
+        int offset = start % 64;
+        int span = 64 - offset < count ? 64 - offset : count;
+        uint64_t mask = (span == 64) ? UINT64_MAX : ((1ULL << span) - 1) << offset;
+        map[start / 64] &= ~mask;
+        start += span;
+        count -= span;
+    }
+}
 
-    // Clear the old entry
-    directory.entries[old_index].inode_number = -1;
-    memset(directory.entries[old_index].name, 0, FILE_NAME_LENGTH);
+// Journal Functions
+//
+// Metadata (superblock counters, bitmaps, inodes, directory entries and extent tree nodes) is
+// changed in the working copy at meta_base or in pinned cache blocks, and journal_log copies
+// the new bytes of each change into the thread's open transaction. Block allocations and
+// frees are noted as runs rather than bitmap bytes, so a record never carries another
+// thread's uncommitted allocation, and deleted inodes as runs of inode numbers that replay
+// deletes again. When the outermost transaction ends it becomes one log record; records
+// are buffered and written to the log region in groups with a single sync.
+// An image's own metadata only changes when a checkpoint applies the records in the log
+// region to it, and a cache block changed by a record is not written back before that
+// record is in the log, so after a crash the image holds what the log says and replay
+// finishes the rest. Blocks a record frees are not reused until it is in the log, and bytes
+// logged for a block that a later record frees are never applied. File data is not logged.
 
-    printf("File renamed from %s to %s successfully\n", old_name, new_name);
-    return 0;
+// Extend a CRC-32C (Castagnoli) over length bytes
+uint32_t crc32c(uint32_t crc, const void* data, size_t length) {
+    if (crc32c_table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; bit++) {
+                value = (value & 1) ? (value >> 1) ^ 0x82F63B78u : value >> 1;
+            }
+            crc32c_table[i] = value;
+        }
+    }
+    const unsigned char* bytes = data;
+    crc = ~crc;
+    while (length-- > 0) {
+        crc = crc32c_table[(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
 }
 
-// Recovery from journal Function
-void recover_from_journal() {
-    int permissions = 7;
-    printf("Recovering file system state from journal...\n");
-    for (int i = 0; i < JOURNAL_SIZE; i++) {
-        if (journal[i].operation == 0) { // write operation
-            memcpy(&blocks[journal[i].block_num * BLOCK_SIZE], journal[i].data, BLOCK_SIZE);
-        }
-        else if (journal[i].operation == 1) { // create operation,
-            create_file(journal[i].filename, journal[i].file_size, 7);
-        }
-        else if (journal[i].operation == 2) { // delete operation
-            delete_file(journal[i].filename);
-        }
-        else if (journal[i].operation == 3) { // rename operation
-            rename_file(journal[i].old_filename, journal[i].new_filename);
+int compare_runs(const void* a, const void* b) {
+    int left = ((const Extent*)a)->physical;
+    int right = ((const Extent*)b)->physical;
+    return (left > right) - (left < right);
+}
+
+// Add a run of blocks to a batch, extending its last run when it continues it.
+// Returns -1 if out of memory.
+int batch_append(BlockBatch* batch, int start, int count) {
+    if (batch->count > 0 && batch->runs[batch->count - 1].physical + batch->runs[batch->count - 1].length == start) {
+        batch->runs[batch->count - 1].length += count;
+        return 0;
+    }
+    if (batch->count == batch->capacity) {
+        int capacity = batch->capacity ? batch->capacity * 2 : 64;
+        Extent* runs = realloc(batch->runs, capacity * sizeof(Extent));
+        if (runs == NULL) {
+            return -1;
         }
-        else
-        {
-            printf("Unknown operation in journal entry %d\n", i);
+        batch->runs = runs;
+        batch->capacity = capacity;
+    }
+    batch->runs[batch->count++] = (Extent){0, start, count};
+    return 0;
+}
+
+// Sort a batch's runs by block and merge neighbouring ones
+void batch_merge(BlockBatch* batch) {
+    if (batch->count < 2) {
+        return;
+    }
+    qsort(batch->runs, batch->count, sizeof(Extent), compare_runs);
+    int merged = 0;
+    for (int i = 1; i < batch->count; i++) {
+        Extent* last = &batch->runs[merged];
+        if (batch->runs[i].physical == last->physical + last->length) {
+            last->length += batch->runs[i].length;
+        } else {
+            batch->runs[++merged] = batch->runs[i];
         }
     }
-    printf("Recovery complete.\n");
+    batch->count = merged + 1;
 }
 
-int rename_directory(DirectoryStruct* root, const char* old_path, const char* new_name) {
-    // Find the directory to be renamed
-    DirectoryStruct* dir = navigate_path(root, old_path);
-    if (dir == NULL) {
-        printf("Error: Directory %s not found\n", old_path);
-        return -1;
+// Make room for size more bytes in the thread's copy of its changes
+void log_copy_reserve(size_t size) {
+    if (log_copy_used + size <= log_copy_capacity) {
+        return;
+    }
+    size_t capacity = log_copy_capacity ? log_copy_capacity : 4096;
+    while (capacity < log_copy_used + size) {
+        capacity *= 2;
+    }
+    unsigned char* copy = realloc(log_copy, capacity);
+    if (copy == NULL) {
+        printf("Error: Memory allocation failed for the journal\n");
+        exit(1);
     }
+    log_copy = copy;
+    log_copy_capacity = capacity;
+}
 
-    // Check if the directory is the root directory
-    if (dir->parent == NULL) {
-        printf("Error: Cannot rename root directory\n");
-        return -1;
+// Make room for one more range in the open transaction
+void log_ranges_reserve() {
+    if (log_range_count < log_range_capacity) {
+        return;
     }
+    int capacity = log_range_capacity ? log_range_capacity * 2 : 64;
+    LogRange* ranges = realloc(log_ranges, capacity * sizeof(LogRange));
+    if (ranges == NULL) {
+        printf("Error: Memory allocation failed for the journal\n");
+        exit(1);
+    }
+    log_ranges = ranges;
+    log_range_capacity = capacity;
+}
 
-    // Check if a directory or file with the new name already exists in the parent directory
-    DirectoryStruct* parent = dir->parent;
-    for (int i = 0; i < parent->child_count; i++) {
-        if (strcmp(parent->children[i]->name, new_name) == 0) {
-            printf("Error: A directory or file with name %s already exists\n", new_name);
-            return -1;
+// Note that the open transaction changed length bytes of the volume at offset to bytes
+void journal_log_range(int64_t offset, const void* bytes, int64_t length) {
+    // A change inside a recent range overwrites its copy, the usual case for repeated updates
+    // of a counter or table entry, and one running on from the newest range extends it, as a
+    // walk over neighbouring entries does. Any other overlap starts a new range; ranges are
+    // applied in the order they were logged, so the newer bytes win.
+    for (int i = log_range_count - 1; i >= 0 && i >= log_range_count - LOG_RECENT_RANGES; i--) {
+        LogRange* recent = &log_ranges[i];
+        if (recent->copy == LOG_COPY_UNLINK) {
+            break;  // Bytes changed after an unlink are applied after it
+        }
+        int64_t end = recent->offset + recent->length;
+        if (offset >= recent->offset && offset + length <= end) {
+            memcpy(log_copy + recent->copy + (offset - recent->offset), bytes, (size_t)length);
+            return;
+        }
+        if (i == log_range_count - 1 && offset == end) {
+            // The newest range's bytes are the last in log_copy
+            log_copy_reserve((size_t)length);
+            memcpy(log_copy + log_copy_used, bytes, (size_t)length);
+            log_copy_used += (size_t)length;
+            log_delta_bytes -= ((size_t)recent->length + 7) & ~(size_t)7;
+            recent->length += length;
+            log_delta_bytes += ((size_t)recent->length + 7) & ~(size_t)7;
+            return;
+        }
+        if (offset < end && offset + length > recent->offset) {
+            break;
         }
     }
+    log_ranges_reserve();
+    log_copy_reserve((size_t)length);
+    memcpy(log_copy + log_copy_used, bytes, (size_t)length);
+    log_ranges[log_range_count++] = (LogRange){offset, length, log_copy_used};
+    log_copy_used += (size_t)length;
+    log_delta_bytes += sizeof(LogDelta) + (((size_t)length + 7) & ~(size_t)7);
+}
 
-    // Rename the directory
-    strncpy(dir->name, new_name, sizeof(dir->name) - 1);
-    dir->name[sizeof(dir->name) - 1] = '\0';  // Ensure null-termination
-
-    // Update the journal
-    journal[journal_index].operation = 3; // rename operation
-    strncpy(journal[journal_index].old_filename, old_path, FILE_NAME_LENGTH - 1);
-    journal[journal_index].old_filename[FILE_NAME_LENGTH - 1] = '\0';
-    strncpy(journal[journal_index].new_filename, new_name, FILE_NAME_LENGTH - 1);
-    journal[journal_index].new_filename[FILE_NAME_LENGTH - 1] = '\0';
-    journal_index = (journal_index + 1) % JOURNAL_SIZE;
+// Note that the open transaction deleted an inode and its directory entry. Only the inode
+// number is logged; journal_apply repeats the deletion with unlink_inode_metadata, and
+// neighbouring numbers share one delta.
+void journal_log_unlink(int inode_number) {
+    LogRange* newest = log_range_count > 0 ? &log_ranges[log_range_count - 1] : NULL;
+    if (newest != NULL && newest->copy == LOG_COPY_UNLINK) {
+        if (inode_number == newest->offset + newest->length) {
+            newest->length++;
+            return;
+        }
+        if (inode_number == newest->offset - 1) {
+            newest->offset--;
+            newest->length++;
+            return;
+        }
+    }
+    log_ranges_reserve();
+    log_ranges[log_range_count++] = (LogRange){inode_number, 1, LOG_COPY_UNLINK};
+    log_delta_bytes += sizeof(LogDelta);
+}
 
-    printf("Directory renamed from %s to %s successfully\n", old_path, new_name);
-    return 0;
+// Bytes the open transaction's record would take, its frees not yet merged
+size_t journal_record_length() {
+    return sizeof(LogRecord) + (size_t)(log_allocs.count + log_frees.count) * sizeof(LogDelta) + log_delta_bytes;
 }
 
-// Delete Directory
-void delete_directory(DirectoryStruct *dir) {
-    if (dir == NULL) return;
+// Note a change to length bytes of metadata at address, after making it
+void journal_log(const void* address, size_t length) {
+    journal_log_range((const unsigned char*)address - meta_base, address, (int64_t)length);
+}
 
+// Note a change to length bytes at offset of a metadata block the caller has pinned at data.
+// The block stays in the cache until the change is in the log.
+void journal_log_block(int block_num, const char* data, int offset, int length) {
+    journal_log_range(sb->data_offset + (int64_t)block_num * sb->block_size + offset, data + offset, length);
+    cache_set_lsn(block_num, LOG_LSN_PENDING);
+}
 
-    for (int i = 0; i < dir->child_count; i++) {
-        if (dir->children[i]->is_directory) {
-            delete_directory(dir->children[i]);
-        } else {
-            delete_file(dir->children[i]->name);
-        }
-        free(dir->children[i]);
+// Note that the open transaction allocated count blocks from start; caller holds alloc_lock
+void journal_log_alloc(int start, int count) {
+    if (batch_append(&log_allocs, start, count) != 0) {
+        printf("Error: Memory allocation failed for the journal\n");
+        exit(1);
     }
+}
 
-    free(dir->children);
+// Note that the open transaction freed count blocks from start. They stay set in the bitmap
+// until its record is in the log.
+void journal_log_free(int start, int count) {
+    if (batch_append(&log_frees, start, count) != 0) {
+        printf("Error: Memory allocation failed for the journal\n");
+        exit(1);
+    }
+}
 
+// Make room for size more bytes in the group buffer; caller holds journal_lock
+int log_buffer_reserve(size_t size) {
+    if (log_buffer_used + size <= log_buffer_capacity) {
+        return 0;
+    }
+    size_t capacity = log_buffer_capacity ? log_buffer_capacity : GROUP_COMMIT_BYTES;
+    while (capacity < log_buffer_used + size) {
+        capacity *= 2;
+    }
+    unsigned char* buffer = realloc(log_buffer, capacity);
+    if (buffer == NULL) {
+        return -1;
+    }
+    log_buffer = buffer;
+    log_buffer_capacity = capacity;
+    return 0;
+}
 
-    if (dir->parent) {
-        for (int i = 0; i < dir->parent->child_count; i++) {
-            if (dir->parent->children[i] == dir) {
-                // Shift remaining children
-                for (int j = i; j < dir->parent->child_count - 1; j++) {
-                    dir->parent->children[j] = dir->parent->children[j + 1];
-                }
-                dir->parent->child_count--;
+// Check a record of at most size bytes that should carry LSN lsn, and each of its deltas
+int journal_record_valid(const LogRecord* record, int64_t size, uint64_t lsn) {
+    if (record->magic != LOG_MAGIC || record->lsn != lsn || record->length < sizeof(LogRecord) ||
+        record->length % 8 != 0 || (int64_t)record->length > size ||
+        crc32c(0, (const unsigned char*)record + 8, record->length - 8) != record->crc) {
+        return 0;
+    }
+    const unsigned char* end = (const unsigned char*)record + record->length;
+    const unsigned char* position = (const unsigned char*)record + sizeof(LogRecord);
+    uint32_t valid = 0;
+    while (valid < record->delta_count && position + sizeof(LogDelta) <= end) {
+        const LogDelta* delta = (const LogDelta*)position;
+        size_t padded = 0;
+        if (delta->kind == LOG_DELTA_BYTES) {
+            int64_t delta_end = delta->offset + delta->length;
+            padded = ((size_t)delta->length + 7) & ~(size_t)7;
+            if (delta->offset < 0 || delta_end > sb->volume_size || padded > (size_t)(end - position) - sizeof(LogDelta) ||
+                (delta->offset < sb->log_offset + sb->log_size && delta_end > sb->log_offset)) {
                 break;
             }
+        } else if (delta->kind == LOG_DELTA_UNLINK) {
+            if (delta->offset <= ROOT_INODE || delta->offset + delta->length > sb->inode_count) {
+                break;
+            }
+        } else if (delta->kind > LOG_DELTA_FREE || delta->offset < 0 || delta->offset + delta->length > sb->total_blocks) {
+            break;
         }
+        position += sizeof(LogDelta) + padded;
+        valid++;
+    }
+    if (valid != record->delta_count) {
+        printf("Error: Journal record %llu is malformed\n", (unsigned long long)lsn);
+        return 0;
     }
+    return 1;
+}
 
-    // Free the directory struct itself
-    free(dir);
+// Is block in one of the runs freed by record or a later one; runs hold the index of the
+// record freeing them in logical
+int journal_freed_later(const Extent* runs, int count, int record, int64_t block) {
+    for (int i = 0; i < count; i++) {
+        if (runs[i].logical >= record && block >= runs[i].physical && block < runs[i].physical + runs[i].length) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
-void delete_node(DirectoryStruct* node) {
-    if (node == NULL) {
+// Delete an inode and its directory entry in the metadata at base (meta_base, or the volume's
+// own copy when replaying): clear both and their bitmap bits, and count them off their
+// directory and the free inode total. The caller frees the inode's blocks.
+void unlink_inode_metadata(unsigned char* base, int inode_number) {
+    inode* node = (inode*)(base + sb->inode_offset) + inode_number;
+    if (inode_number == ROOT_INODE || node->inode_number == -1) {
         return;
     }
+    int entry_index = node->entry_index;
+    uint64_t* inode_map = (uint64_t*)(base + sb->inode_bitmap_offset);
+    inode_map[inode_number / 64] &= ~(1ULL << (inode_number % 64));
+    node->inode_number = -1;
+    node->file_size = 0;
+    node->extent_count = 0;
+    node->extent_depth = 0;
+    node->entry_index = -1;
+    ((superblock*)base)->free_inodes++;
+    if (entry_index >= 0) {
+        DirectoryEntry* entry = &((Directory*)(base + sb->directory_offset))->entries[entry_index];
+        inode* parent = (inode*)(base + sb->inode_offset) + entry->parent_inode;
+        if (parent->inode_number != -1) {
+            parent->file_size--;  // A replayed run goes by number, so its directory can come first
+        }
+        entry->inode_number = -1;
+        memset(entry->name, 0, FILE_NAME_LENGTH);
+        uint64_t* slot_map = (uint64_t*)(base + sb->slot_bitmap_offset);
+        slot_map[entry_index / 64] &= ~(1ULL << (entry_index % 64));
+    }
+}
 
-    // If it's a directory, recursively delete all children
-    if (node->is_directory) {
-        for (int i = 0; i < node->child_count; i++) {
-            delete_node(node->children[i]);
+// Apply the records in size bytes at log, the first carrying LSN lsn, to the volume's own
+// metadata, stopping at the first one that is missing, stale or torn. Bytes logged for a
+// block that the same or a later record frees are skipped, the block may hold other data by now.
+// Returns the number of records applied.
+int journal_apply(const unsigned char* log, int64_t size, uint64_t lsn) {
+    // Find the valid records and the runs they free first
+    Extent* freed = NULL;
+    int freed_count = 0;
+    int freed_capacity = 0;
+    int records = 0;
+    int64_t offset = 0;
+    while (offset + (int64_t)sizeof(LogRecord) <= size) {
+        const LogRecord* record = (const LogRecord*)(log + offset);
+        if (!journal_record_valid(record, size - offset, lsn + records)) {
+            break;
         }
-        free(node->children);
-    } else {
-        // If it's a file, delete the associated inode and free blocks
-        delete_file(node->name);
+        const unsigned char* position = (const unsigned char*)record + sizeof(LogRecord);
+        for (uint32_t i = 0; i < record->delta_count; i++) {
+            const LogDelta* delta = (const LogDelta*)position;
+            if (delta->kind == LOG_DELTA_FREE) {
+                if (freed_count == freed_capacity) {
+                    freed_capacity = freed_capacity ? freed_capacity * 2 : 64;
+                    freed = realloc(freed, freed_capacity * sizeof(Extent));
+                    if (freed == NULL) {
+                        printf("Error: Memory allocation failed for the journal\n");
+                        exit(1);
+                    }
+                }
+                freed[freed_count++] = (Extent){records, (int)delta->offset, (int)delta->length};
+            }
+            position += sizeof(LogDelta) + (delta->kind == LOG_DELTA_BYTES ? ((size_t)delta->length + 7) & ~(size_t)7 : 0);
+        }
+        offset += record->length;
+        records++;
     }
 
-    // Remove from parent's children list
-    if (node->parent) {
-        for (int i = 0; i < node->parent->child_count; i++) {
-            if (node->parent->children[i] == node) {
-                // Shift remaining children
-                for (int j = i; j < node->parent->child_count - 1; j++) {
-                    node->parent->children[j] = node->parent->children[j + 1];
+    uint64_t* bitmap = (uint64_t*)(volume_base + sb->bitmap_offset);
+    log_unlinks_applied = 0;
+    offset = 0;
+    for (int r = 0; r < records; r++) {
+        const LogRecord* record = (const LogRecord*)(log + offset);
+        const unsigned char* position = (const unsigned char*)record + sizeof(LogRecord);
+        for (uint32_t i = 0; i < record->delta_count; i++) {
+            const LogDelta* delta = (const LogDelta*)position;
+            position += sizeof(LogDelta);
+            if (delta->kind == LOG_DELTA_ALLOC) {
+                bitmap_set_range(bitmap, (int)delta->offset, (int)delta->length);
+                continue;
+            }
+            if (delta->kind == LOG_DELTA_FREE) {
+                bitmap_clear_range(bitmap, (int)delta->offset, (int)delta->length);
+                continue;
+            }
+            if (delta->kind == LOG_DELTA_UNLINK) {
+                for (int64_t n = delta->offset; n < delta->offset + delta->length; n++) {
+                    unlink_inode_metadata(volume_base, (int)n);
                 }
-                node->parent->child_count--;
-                break;
+                log_unlinks_applied = 1;
+                continue;
+            }
+            const unsigned char* bytes = position;
+            int64_t at = delta->offset;
+            int64_t left = delta->length;
+            while (left > 0) {
+                int64_t count = left;
+                int skip = 0;
+                if (at >= sb->data_offset) {
+                    int64_t block = (at - sb->data_offset) / sb->block_size;
+                    int64_t block_end = sb->data_offset + (block + 1) * sb->block_size;
+                    if (count > block_end - at) {
+                        count = block_end - at;
+                    }
+                    skip = journal_freed_later(freed, freed_count, r, block);
+                }
+                if (!skip) {
+                    memcpy(volume_base + at, bytes, (size_t)count);
+                }
+                at += count;
+                bytes += count;
+                left -= count;
             }
+            position += ((size_t)delta->length + 7) & ~(size_t)7;
         }
+        offset += record->length;
     }
+    free(freed);
+    return records;
+}
 
-    // Free the node itself
-    free(node);
+// Bring the volume itself up to date with everything in the log region and empty it;
+// caller holds journal_lock. Cache blocks whose changes are logged are written back and the
+// records applied with the cache locked, so no older copy of a block lands afterwards.
+// Records still in the group buffer wait for the emptied log.
+void checkpoint_volume() {
+    cache_lock_all();
+    cache_writeback_all();
+    if (meta_base != volume_base) {
+        journal_apply(volume_base + sb->log_offset, log_tail, sb->log_start_lsn);
+    }
+    cache_unlock_all();
+    sync_image();
+    uint64_t start = __atomic_load_n(&log_durable_lsn, __ATOMIC_RELAXED) + 1;
+    sb->log_start_lsn = start;
+    ((superblock*)volume_base)->log_start_lsn = start;
+    sync_volume_range(0, sizeof(superblock));
+    log_tail = 0;
+    journal_stats.checkpoints++;
 }
 
-// Wrapper function to delete by path
-int delete_by_path(DirectoryStruct* root, const char* path) {
-    DirectoryStruct* node = navigate_path(root, path);
-    if (node == NULL) {
-        printf("Error: Path %s not found\n", path);
-        return -1;
+// Give the blocks freed by records now in the log back to the bitmap; caller holds journal_lock
+void journal_reuse_frees() {
+    if (log_released.count == 0) {
+        return;
     }
+    mutex_lock(&alloc_lock);
+    for (int i = 0; i < log_released.count; i++) {
+        bitmap_clear_range(block_bitmap, log_released.runs[i].physical, log_released.runs[i].length);
+    }
+    mutex_unlock(&alloc_lock);
+    log_released.count = 0;
+    __atomic_store_n(&log_released_blocks, 0, __ATOMIC_RELAXED);
+}
 
-    delete_node(node);
-    printf("%s deleted successfully\n", path);
-    return 0;
+// Write the buffered records to the log region with one sync (group commit), checkpointing
+// whenever the region fills; caller holds journal_lock
+void journal_write_group() {
+    size_t written = 0;
+    while (written < log_buffer_used) {
+        // The whole records that fit in the rest of the region
+        size_t length = 0;
+        uint64_t last_lsn = 0;
+        while (written + length < log_buffer_used) {
+            LogRecord* record = (LogRecord*)(log_buffer + written + length);
+            if (log_tail + (int64_t)(length + record->length) > sb->log_size) {
+                break;
+            }
+            last_lsn = record->lsn;
+            length += record->length;
+        }
+        if (length == 0) {
+            checkpoint_volume();  // Every record fits an empty log, see journal_commit
+            continue;
+        }
+        memcpy(volume_base + sb->log_offset + log_tail, log_buffer + written, length);
+        sync_volume_range(sb->log_offset + log_tail, (int64_t)length);
+        log_tail += (int64_t)length;
+        written += length;
+        __atomic_store_n(&log_durable_lsn, last_lsn, __ATOMIC_RELEASE);
+        journal_stats.group_writes++;
+    }
+    log_buffer_used = 0;
+    log_buffer_records = 0;
+    journal_reuse_frees();
 }
 
-// File System Initialization
+// Write the committed records to the log, so the cache blocks they changed can be evicted
+// and the blocks they freed reused. Returns 1 if any were waiting. Caller holds no lock.
+int journal_write_committed() {
+    mutex_lock(&journal_lock);
+    int waiting = log_buffer_used > 0 || log_released.count > 0;
+    journal_write_group();
+    mutex_unlock(&journal_lock);
+    return waiting;
+}
 
-void initialize_filesystem() {
-    sb.total_blocks = MAX_BLOCKS;
-    sb.free_blocks = MAX_BLOCKS;
-    sb.block_size = BLOCK_SIZE;
-    sb.inode_count = MAX_INODES;
-    sb.free_inodes = MAX_INODES;
-    memset(block_bitmap, 0, sizeof(block_bitmap));
-    memset(blocks, 0, sizeof(blocks));
-    init_cache();
-    recover_from_journal();
-    for (int i = 0; i < MAX_INODES; i++) {
-        inodes[i].inode_number = -1;
-        memset(inodes[i].data_blocks, -1, sizeof(inodes[i].data_blocks));
+// Apply a record too big for the log region straight to the volume, after writing back
+// everything logged before it; caller holds journal_lock. A crash part way through can leave
+// part of it applied.
+void journal_write_oversize(const unsigned char* record, uint64_t lsn) {
+    journal_write_group();
+    checkpoint_volume();
+    if (meta_base != volume_base) {
+        journal_apply(record, ((const LogRecord*)record)->length, lsn);
+        sync_image();
     }
-    for (int i = 0; i < MAX_INODES; i++) {
-        directory.entries[i].inode_number = -1;
+    __atomic_store_n(&log_durable_lsn, lsn, __ATOMIC_RELEASE);
+    checkpoint_volume();  // Moves the start of the log past it
+    journal_reuse_frees();
+}
+
+// Write the open transaction as a record of length bytes with LSN lsn at start: its
+// allocations, then its byte ranges and unlinks in the order they were logged, then its frees
+void journal_build_record(unsigned char* start, size_t length, uint64_t lsn) {
+    memset(start, 0, length);
+    LogRecord* record = (LogRecord*)start;
+    record->magic = LOG_MAGIC;
+    record->lsn = lsn;
+    record->length = (uint32_t)length;
+    record->delta_count = (uint32_t)(log_allocs.count + log_range_count + log_frees.count);
+    unsigned char* position = start + sizeof(LogRecord);
+    for (int i = 0; i < log_allocs.count; i++) {
+        *(LogDelta*)position = (LogDelta){log_allocs.runs[i].physical, (uint32_t)log_allocs.runs[i].length, LOG_DELTA_ALLOC};
+        position += sizeof(LogDelta);
+    }
+    for (int i = 0; i < log_range_count; i++) {
+        LogRange* range = &log_ranges[i];
+        if (range->copy == LOG_COPY_UNLINK) {
+            *(LogDelta*)position = (LogDelta){range->offset, (uint32_t)range->length, LOG_DELTA_UNLINK};
+            position += sizeof(LogDelta);
+            continue;
+        }
+        *(LogDelta*)position = (LogDelta){range->offset, (uint32_t)range->length, LOG_DELTA_BYTES};
+        memcpy(position + sizeof(LogDelta), log_copy + range->copy, (size_t)range->length);
+        position += sizeof(LogDelta) + (((size_t)range->length + 7) & ~(size_t)7);
     }
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        open_files[i].inode_number = -1;
-        open_files[i].current_position = 0;
+    for (int i = 0; i < log_frees.count; i++) {
+        *(LogDelta*)position = (LogDelta){log_frees.runs[i].physical, (uint32_t)log_frees.runs[i].length, LOG_DELTA_FREE};
+        position += sizeof(LogDelta);
+    }
+    record->crc = crc32c(0, start + 8, length - 8);
+}
+
+// Turn the open transaction into a log record in the group buffer
+void journal_commit() {
+    if (log_range_count == 0 && log_allocs.count == 0 && log_frees.count == 0) {
+        return;
     }
+    batch_merge(&log_frees);
+    size_t length = journal_record_length();
+    mutex_lock(&journal_lock);
+    // A bulk change bigger than the whole log region cannot be logged and is applied in place
+    int oversize = length > (size_t)sb->log_size;
+    unsigned char* record_start = NULL;
+    if (oversize) {
+        record_start = malloc(length);
+    } else if (log_buffer_reserve(length) == 0) {
+        record_start = log_buffer + log_buffer_used;
+    }
+    if (record_start == NULL) {
+        printf("Error: Memory allocation failed for the journal\n");
+        exit(1);
+    }
+    uint64_t lsn = log_next_lsn++;
+    journal_build_record(record_start, length, lsn);
+
+    // The metadata blocks it changed stay in the cache, and the blocks it freed stay taken,
+    // until the record is in the log
+    for (int i = 0; i < log_range_count; i++) {
+        if (log_ranges[i].copy != LOG_COPY_UNLINK && log_ranges[i].offset >= sb->data_offset) {
+            int64_t first = (log_ranges[i].offset - sb->data_offset) / sb->block_size;
+            int64_t last = (log_ranges[i].offset + log_ranges[i].length - 1 - sb->data_offset) / sb->block_size;
+            for (int64_t block = first; block <= last; block++) {
+                cache_set_lsn((int)block, lsn);
+            }
+        }
+    }
+    for (int i = 0; i < log_frees.count; i++) {
+        if (batch_append(&log_released, log_frees.runs[i].physical, log_frees.runs[i].length) != 0) {
+            printf("Error: Memory allocation failed for the journal\n");
+            exit(1);
+        }
+        __atomic_fetch_add(&log_released_blocks, log_frees.runs[i].length, __ATOMIC_RELAXED);
+    }
+    log_range_count = 0;
+    log_copy_used = 0;
+    log_delta_bytes = 0;
+    log_allocs.count = 0;
+    log_frees.count = 0;
+    journal_stats.transactions++;
+    journal_stats.bytes_logged += (long)length;
+
+    if (oversize) {
+        journal_write_oversize(record_start, lsn);
+        free(record_start);
+    } else {
+        log_buffer_used += length;
+        log_buffer_records++;
+        if (log_buffer_records >= GROUP_COMMIT_TXNS || log_buffer_used >= GROUP_COMMIT_BYTES) {
+            journal_write_group();
+        }
+    }
+    mutex_unlock(&journal_lock);
+}
+
+// Commit this thread's open transaction if it is outside journal_begin, then write the group.
+// Every transaction committed so far is durable when this returns.
+void journal_flush() {
+    if (journal_depth == 0) {
+        journal_commit();
+    }
+    mutex_lock(&journal_lock);
+    journal_write_group();
+    mutex_unlock(&journal_lock);
+}
+
+// Start a transaction; nested calls join the outermost one
+void journal_begin() {
+    journal_depth++;
+}
+
+// End a transaction, committing it when the outermost one ends.
+// It is durable after the next group write, see journal_flush.
+void journal_end() {
+    if (journal_depth > 0 && --journal_depth == 0) {
+        journal_commit();
+    }
+}
+
+// Read the journal counters
+JournalStats get_journal_stats() {
+    mutex_lock(&journal_lock);
+    JournalStats stats = journal_stats;
+    mutex_unlock(&journal_lock);
+    return stats;
+}
+
+// Function to flush cache to disk
+void flush_cache() {
+    if (journal_depth == 0) {
+        journal_commit();
+    }
+    mutex_lock(&journal_lock);
+    journal_write_group();
+    checkpoint_volume();
+    mutex_unlock(&journal_lock);
+}
+
+// Change the cache capacity, writing dirty blocks back first (no other thread may be using the cache)
+void set_cache_capacity(int capacity) {
+    int flusher = writeback_running;
+    stop_writeback();
+    flush_cache();
+    init_cache(capacity);
+    if (flusher) {
+        start_writeback();
+    }
+}
+
+// Read one shard's counters, including hits this thread has not handed in yet.
+// Other threads' hits can lag by up to CACHE_HIT_BATCH per shard.
+CacheStats get_cache_shard_stats(int shard_index) {
+    CacheShard* shard = &cache_shards[shard_index];
+    CacheStats stats;
+    rwlock_read_lock(&shard->lock);
+    stats.hits = __atomic_load_n(&shard->stats.hits, __ATOMIC_RELAXED) + cache_pending_hits[shard_index];
+    stats.misses = shard->stats.misses;
+    stats.evictions = shard->stats.evictions;
+    stats.writebacks = shard->stats.writebacks;
+    stats.prefetched = shard->stats.prefetched;
+    rwlock_read_unlock(&shard->lock);
+    return stats;
+}
+
+// Read the cache counters summed over all shards
+CacheStats get_cache_stats() {
+    CacheStats total = {0, 0, 0, 0, 0};
+    for (int i = 0; i < cache_shard_count; i++) {
+        CacheStats stats = get_cache_shard_stats(i);
+        total.hits += stats.hits;
+        total.misses += stats.misses;
+        total.evictions += stats.evictions;
+        total.writebacks += stats.writebacks;
+        total.prefetched += stats.prefetched;
+    }
+    return total;
+}
+
+// Name Index Functions
+
+// Hash the first len bytes of a name (FNV-1a)
+unsigned int name_hash_n(const char *name, size_t len) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Hash a name in a directory into a name index bucket
+unsigned int name_hash(int parent_inode, const char *name) {
+    return (name_hash_n(name, strlen(name)) ^ ((unsigned int)parent_inode * 2654435761u)) & (sb->name_hash_size - 1);
+}
+
+// Reset the name index to empty
+void init_name_index() {
+    for (int i = 0; i < sb->name_hash_size; i++) {
+        name_hash_heads[i] = -1;
+    }
+    for (int i = 0; i < sb->inode_count; i++) {
+        name_hash_next[i] = -1;
+    }
+}
+
+// Link a used directory entry into its bucket
+void name_index_link(int entry_index) {
+    DirectoryEntry* entry = &directory->entries[entry_index];
+    unsigned int bucket = name_hash(entry->parent_inode, entry->name);
+    name_hash_next[entry_index] = name_hash_heads[bucket];
+    name_hash_heads[bucket] = entry_index;
+}
+
+// Rebuild the name index from the used directory entries
+void rebuild_name_index() {
+    init_name_index();
+    for (int word = 0; word < (sb->inode_count + 63) / 64; word++) {
+        for (uint64_t bits = slot_bitmap[word]; bits != 0; bits &= bits - 1) {
+            name_index_link(word * 64 + __builtin_ctzll(bits));
+        }
+    }
+}
+
+// The name index is not logged, so a mount leaves it stale and it is rebuilt here the first
+// time it is used. Caller holds namespace_lock; readers holding it shared may all arrive
+// together, and name_index_lock lets one of them rebuild while the others wait.
+void name_index_ensure() {
+    if (__atomic_load_n(&name_index_ready, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    mutex_lock(&name_index_lock);
+    if (!name_index_ready) {
+        rebuild_name_index();
+        __atomic_store_n(&name_index_ready, 1, __ATOMIC_RELEASE);
+    }
+    mutex_unlock(&name_index_lock);
+}
+
+// Add a used directory entry to the name index
+void name_index_insert(int entry_index) {
+    name_index_ensure();
+    name_index_link(entry_index);
+}
+
+// Remove a directory entry from the name index (call before clearing its name)
+void name_index_remove(int entry_index) {
+    name_index_ensure();
+    DirectoryEntry* entry = &directory->entries[entry_index];
+    int *link = &name_hash_heads[name_hash(entry->parent_inode, entry->name)];
+    while (*link != -1) {
+        if (*link == entry_index) {
+            *link = name_hash_next[entry_index];
+            name_hash_next[entry_index] = -1;
+            return;
+        }
+        link = &name_hash_next[*link];
+    }
+}
+
+// Find the directory entry for a name in a directory, -1 if not found
+int name_index_lookup_in(int parent_inode, const char *name) {
+    name_index_ensure();
+    int i = name_hash_heads[name_hash(parent_inode, name)];
+    while (i != -1) {
+        DirectoryEntry* entry = &directory->entries[i];
+        if (entry->inode_number != -1 && entry->parent_inode == parent_inode && strcmp(entry->name, name) == 0) {
+            return i;
+        }
+        i = name_hash_next[i];
+    }
+    return -1;
+}
+
+// Find the directory entry for a file name in the root directory, -1 if not found
+int name_index_lookup(const char *filename) {
+    return name_index_lookup_in(ROOT_INODE, filename);
+}
+
+// Node Allocation Functions
+
+// The cold fields of a tree node
+NodeCold* node_cold(const DirectoryStruct* node) {
+    NodeSlab* slab = (NodeSlab*)((uintptr_t)node & ~(uintptr_t)(NODE_SLAB_BYTES - 1));
+    return &slab->cold[node - slab->nodes];
+}
+
+// Reserve a slab aligned to its size
+NodeSlab* node_slab_new() {
+    void* memory = NULL;
+#ifdef _WIN32
+    memory = _aligned_malloc(NODE_SLAB_BYTES, NODE_SLAB_BYTES);
+#else
+    if (posix_memalign(&memory, NODE_SLAB_BYTES, NODE_SLAB_BYTES) != 0) {
+        memory = NULL;
+    }
+#endif
+    return (NodeSlab*)memory;
+}
+
+// Take a node from the free list, or the next one in the newest slab. Its fields are left
+// for the caller to fill in.
+DirectoryStruct* node_alloc() {
+    mutex_lock(&node_lock);
+    DirectoryStruct* node = free_nodes;
+    if (node != NULL) {
+        free_nodes = node->parent;
+    } else {
+        if (node_slab_used == NODE_SLAB_NODES) {
+            NodeSlab* slab = node_slab_new();
+            if (slab == NULL) {
+                mutex_unlock(&node_lock);
+                return NULL;
+            }
+            slab->next = node_slabs;
+            node_slabs = slab;
+            node_slab_used = 0;
+        }
+        node = &node_slabs->nodes[node_slab_used++];
+    }
+    mutex_unlock(&node_lock);
+    return node;
+}
+
+// Size class of an interned name of length bytes
+int name_class(int length) {
+    return (int)((sizeof(InternedName) + length + 1 + NAME_CLASS_BYTES - 1) / NAME_CLASS_BYTES);
+}
+
+// Rehash the intern table into size buckets; caller holds node_lock
+void name_table_resize(int size) {
+    InternedName** table = calloc(size, sizeof(InternedName*));
+    if (table == NULL) {
+        return;  // Chains just grow longer
+    }
+    for (int i = 0; i < name_table_size; i++) {
+        InternedName* entry = name_table[i];
+        while (entry != NULL) {
+            InternedName* next = entry->next;
+            entry->next = table[entry->hash & (size - 1)];
+            table[entry->hash & (size - 1)] = entry;
+            entry = next;
+        }
+    }
+    free(name_table);
+    name_table = table;
+    name_table_size = size;
+}
+
+// Storage for a name of a size class, reusing a freed one if there is; caller holds node_lock
+InternedName* name_storage(int size_class) {
+    InternedName* entry = free_names[size_class];
+    if (entry != NULL) {
+        free_names[size_class] = entry->next;
+        return entry;
+    }
+    size_t bytes = (size_t)size_class * NAME_CLASS_BYTES;
+    if (name_arena_left < bytes) {
+        char* chunk = malloc(NAME_ARENA_BYTES);  // The rest of the old chunk is given up
+        if (chunk == NULL) {
+            return NULL;
+        }
+        name_arena = chunk;
+        name_arena_left = NAME_ARENA_BYTES;
+    }
+    entry = (InternedName*)name_arena;
+    name_arena += bytes;
+    name_arena_left -= bytes;
+    return entry;
+}
+
+// The shared copy of the first length bytes of name (cut to FILE_NAME_LENGTH - 1), NULL if
+// out of memory. Each call takes a reference that release_name gives back.
+const char* intern_name(const char* name, size_t length) {
+    if (length > FILE_NAME_LENGTH - 1) {
+        length = FILE_NAME_LENGTH - 1;
+    }
+    unsigned int hash = name_hash_n(name, length);
+    mutex_lock(&node_lock);
+    if (name_table_size > 0) {
+        for (InternedName* entry = name_table[hash & (name_table_size - 1)]; entry != NULL; entry = entry->next) {
+            if (entry->hash == hash && entry->length == (int)length && memcmp(entry->text, name, length) == 0) {
+                entry->refs++;
+                mutex_unlock(&node_lock);
+                return entry->text;
+            }
+        }
+    }
+    if (name_count >= name_table_size) {
+        name_table_resize(name_table_size ? name_table_size * 2 : 1024);
+    }
+    InternedName* entry = name_table_size > 0 ? name_storage(name_class((int)length)) : NULL;
+    if (entry == NULL) {
+        mutex_unlock(&node_lock);
+        return NULL;
+    }
+    entry->hash = hash;
+    entry->refs = 1;
+    entry->length = (int)length;
+    memcpy(entry->text, name, length);
+    entry->text[length] = '\0';
+    entry->next = name_table[hash & (name_table_size - 1)];
+    name_table[hash & (name_table_size - 1)] = entry;
+    name_count++;
+    mutex_unlock(&node_lock);
+    return entry->text;
+}
+
+// Drop a reference taken by intern_name, freeing the name with the last one
+void release_name(const char* name) {
+    if (name == NULL) {
+        return;
+    }
+    InternedName* entry = (InternedName*)(name - offsetof(InternedName, text));
+    mutex_lock(&node_lock);
+    if (--entry->refs == 0) {
+        InternedName** link = &name_table[entry->hash & (name_table_size - 1)];
+        while (*link != entry) {
+            link = &(*link)->next;
+        }
+        *link = entry->next;
+        name_count--;
+        int size_class = name_class(entry->length);
+        entry->next = free_names[size_class];
+        free_names[size_class] = entry;
+    }
+    mutex_unlock(&node_lock);
+}
+
+// Name Matching Functions
+
+// Lower-case ASCII letters, leave every other byte alone
+static inline unsigned char fold_byte(unsigned char c) {
+    return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+}
+
+// Do len bytes of text equal needle (already folded if fold is set)
+static inline int name_bytes_equal(const char* text, const char* needle, int len, int fold) {
+    if (!fold) {
+        return memcmp(text, needle, len) == 0;
+    }
+    for (int i = 0; i < len; i++) {
+        if (fold_byte(text[i]) != (unsigned char)needle[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// First position at or after start where needle occurs in text[0, length), -1 if none.
+// With fold set, ASCII case is ignored and needle must already be lower case.
+int name_scan_scalar(const char* text, int length, int start, const char* needle, int needle_len, int fold) {
+    unsigned char first = needle[0];
+    for (int i = start; i <= length - needle_len; i++) {
+        unsigned char c = fold ? fold_byte(text[i]) : (unsigned char)text[i];
+        if (c == first && name_bytes_equal(text + i + 1, needle + 1, needle_len - 1, fold)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+#ifdef HAVE_NAME_SIMD
+// name_scan comparing the first and last needle byte at 16 positions per step; text must
+// have NAME_SCAN_PADDING readable bytes past length
+__attribute__((target("sse2")))
+int name_scan_sse2(const char* text, int length, int start, const char* needle, int needle_len, int fold) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    const __m128i below_a = _mm_set1_epi8('A' - 1), above_z = _mm_set1_epi8('Z' + 1), case_bit = _mm_set1_epi8(0x20);
+    for (int i = start; i <= length - needle_len; i += 16) {
+        __m128i head = _mm_loadu_si128((const __m128i*)(text + i));
+        __m128i tail = _mm_loadu_si128((const __m128i*)(text + i + needle_len - 1));
+        if (fold) {
+            head = _mm_or_si128(head, _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi8(head, below_a), _mm_cmpgt_epi8(above_z, head)), case_bit));
+            tail = _mm_or_si128(tail, _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi8(tail, below_a), _mm_cmpgt_epi8(above_z, tail)), case_bit));
+        }
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+        while (mask != 0) {
+            int position = i + __builtin_ctz(mask);
+            if (position > length - needle_len) {
+                return -1;
+            }
+            if (name_bytes_equal(text + position + 1, needle + 1, needle_len - 2 > 0 ? needle_len - 2 : 0, fold)) {
+                return position;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return -1;
+}
+
+// name_scan_sse2 at 32 positions per step
+__attribute__((target("avx2")))
+int name_scan_avx2(const char* text, int length, int start, const char* needle, int needle_len, int fold) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+    const __m256i below_a = _mm256_set1_epi8('A' - 1), above_z = _mm256_set1_epi8('Z' + 1), case_bit = _mm256_set1_epi8(0x20);
+    for (int i = start; i <= length - needle_len; i += 32) {
+        __m256i head = _mm256_loadu_si256((const __m256i*)(text + i));
+        __m256i tail = _mm256_loadu_si256((const __m256i*)(text + i + needle_len - 1));
+        if (fold) {
+            head = _mm256_or_si256(head, _mm256_and_si256(_mm256_and_si256(_mm256_cmpgt_epi8(head, below_a), _mm256_cmpgt_epi8(above_z, head)), case_bit));
+            tail = _mm256_or_si256(tail, _mm256_and_si256(_mm256_and_si256(_mm256_cmpgt_epi8(tail, below_a), _mm256_cmpgt_epi8(above_z, tail)), case_bit));
+        }
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last)));
+        while (mask != 0) {
+            int position = i + __builtin_ctz(mask);
+            if (position > length - needle_len) {
+                return -1;
+            }
+            if (name_bytes_equal(text + position + 1, needle + 1, needle_len - 2 > 0 ? needle_len - 2 : 0, fold)) {
+                return position;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return -1;
+}
+#endif
+
+typedef int (*NameScanFunction)(const char*, int, int, const char*, int, int);
+NameScanFunction name_scan_kernel = NULL;  // Picked by select_name_kernel on first use
+const char* name_kernel = "none";
+
+// Use the named kernel ("avx2", "sse2" or "scalar"), or the fastest the CPU runs if name is
+// NULL. Returns -1 if the kernel is unknown or unsupported here.
+int select_name_kernel(const char* name) {
+    NameScanFunction kernel = name_scan_scalar;
+    const char* chosen = "scalar";
+#ifdef HAVE_NAME_SIMD
+    __builtin_cpu_init();
+    if ((name == NULL || strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2")) {
+        kernel = name_scan_avx2;
+        chosen = "avx2";
+    } else if ((name == NULL || strcmp(name, "sse2") == 0) && __builtin_cpu_supports("sse2")) {
+        kernel = name_scan_sse2;
+        chosen = "sse2";
+    }
+#endif
+    if (name != NULL && strcmp(name, chosen) != 0) {
+        return -1;
+    }
+    name_kernel = chosen;
+    __atomic_store_n(&name_scan_kernel, kernel, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Find needle in text from start, through the selected kernel. Vector kernels read up to
+// NAME_SCAN_PADDING bytes past length.
+int name_scan(const char* text, int length, int start, const char* needle, int needle_len, int fold) {
+    NameScanFunction kernel = __atomic_load_n(&name_scan_kernel, __ATOMIC_ACQUIRE);
+    if (kernel == NULL) {
+        select_name_kernel(NULL);
+        kernel = name_scan_kernel;
+    }
+    if (needle_len == 0) {
+        return start <= length ? start : -1;
+    }
+    return kernel(text, length, start, needle, needle_len, fold);
+}
+
+// Name Search Functions
+
+// Trigram starting at name, offset by one so no key is 0
+uint32_t trigram_key(const char* name) {
+    return ((uint32_t)(unsigned char)name[0] << 16 | (uint32_t)(unsigned char)name[1] << 8 | (unsigned char)name[2]) + 1;
+}
+
+// Find the posting list of a trigram, adding an empty one if create is set; caller holds search_lock
+TrigramPosting* trigram_find(uint32_t key, int create) {
+    if (trigram_table_size == 0 || (create && (trigram_count + 1) * 2 > trigram_table_size)) {
+        if (!create) {
+            return NULL;
+        }
+        int old_size = trigram_table_size;
+        TrigramPosting* old_table = trigram_table;
+        trigram_table_size = old_size ? old_size * 2 : 1024;
+        trigram_table = calloc(trigram_table_size, sizeof(TrigramPosting));
+        for (int i = 0; i < old_size; i++) {
+            if (old_table[i].key != 0) {
+                unsigned int slot = (old_table[i].key * 2654435761u) & (trigram_table_size - 1);
+                while (trigram_table[slot].key != 0) {
+                    slot = (slot + 1) & (trigram_table_size - 1);
+                }
+                trigram_table[slot] = old_table[i];
+            }
+        }
+        free(old_table);
+    }
+    unsigned int slot = (key * 2654435761u) & (trigram_table_size - 1);
+    while (trigram_table[slot].key != 0) {
+        if (trigram_table[slot].key == key) {
+            return &trigram_table[slot];
+        }
+        slot = (slot + 1) & (trigram_table_size - 1);
+    }
+    if (!create) {
+        return NULL;
+    }
+    trigram_table[slot].key = key;
+    trigram_count++;
+    return &trigram_table[slot];
+}
+
+// Add an id's name to the packed text and to the posting list of each of its trigrams; caller
+// holds search_lock for writing
+void search_index_postings(int id, const char* name, int length) {
+    if (search_text_length + length + 1 + NAME_SCAN_PADDING > search_text_capacity) {
+        int capacity = search_text_capacity ? search_text_capacity : 4096;
+        while (search_text_length + length + 1 + NAME_SCAN_PADDING > capacity) {
+            capacity *= 2;
+        }
+        search_text = realloc(search_text, capacity);
+        memset(search_text + search_text_capacity, 0, capacity - search_text_capacity);
+        search_text_capacity = capacity;
+    }
+    memcpy(search_text + search_text_length, name, length + 1);
+    search_offsets[id] = search_text_length;
+    search_text_length += length + 1;
+    search_offsets[id + 1] = search_text_length;
+
+    for (int i = 0; i + 3 <= length; i++) {
+        TrigramPosting* posting = trigram_find(trigram_key(name + i), 1);
+        if (posting->count > 0 && posting->ids[posting->count - 1] == id) {
+            continue;  // Trigram repeats within the name
+        }
+        if (posting->count == posting->capacity) {
+            posting->capacity = posting->capacity ? posting->capacity * 2 : 4;
+            posting->ids = realloc(posting->ids, posting->capacity * sizeof(int));
+        }
+        posting->ids[posting->count++] = id;
+    }
+}
+
+// Give every node still indexed a new, dense id and rebuild the posting lists from them
+void search_index_compact() {
+    for (int i = 0; i < trigram_table_size; i++) {
+        free(trigram_table[i].ids);
+    }
+    free(trigram_table);
+    trigram_table = NULL;
+    trigram_table_size = 0;
+    trigram_count = 0;
+    memset(search_text, 0, search_text_length);
+    search_text_length = 0;
+    int live = 0;
+    for (int id = 0; id < search_node_count; id++) {
+        DirectoryStruct* node = search_nodes[id];
+        if (node != NULL) {
+            node_cold(node)->search_id = live;
+            search_nodes[live] = node;
+            search_index_postings(live, node->name, node->name_len);
+            live++;
+        }
+    }
+    search_node_count = live;
+    search_generation++;
+}
+
+// Hook a node under parent and index its name for search_names. Searches follow parent
+// links with search_lock held, so the link is set under the same write hold.
+void search_index_add(DirectoryStruct* node, DirectoryStruct* parent) {
+    NodeCold* cold = node_cold(node);
+    rwlock_write_lock(&search_lock);
+    node->parent = parent;
+    if (cold->search_id != -1) {
+        rwlock_write_unlock(&search_lock);
+        return;
+    }
+    if (search_node_count == search_node_capacity) {
+        search_node_capacity = search_node_capacity ? search_node_capacity * 2 : 1024;
+        search_nodes = realloc(search_nodes, search_node_capacity * sizeof(DirectoryStruct*));
+        search_offsets = realloc(search_offsets, (search_node_capacity + 1) * sizeof(int));
+    }
+    int id = search_node_count++;
+    search_nodes[id] = node;
+    cold->search_id = id;
+    search_live_count++;
+    search_index_postings(id, node->name, node->name_len);
+    rwlock_write_unlock(&search_lock);
+}
+
+// Drop nodes from the search index; caller holds search_lock for writing. Their postings
+// stay behind until enough names are gone to make rebuilding the index cheaper than
+// skipping them.
+void search_index_remove_locked(DirectoryStruct** nodes, int count) {
+    for (int i = 0; i < count; i++) {
+        NodeCold* cold = node_cold(nodes[i]);
+        if (cold->search_id != -1) {
+            search_nodes[cold->search_id] = NULL;
+            cold->search_id = -1;
+            search_live_count--;
+        }
+    }
+    int removed = search_node_count - search_live_count;
+    if (removed >= SEARCH_COMPACT_MIN && removed > search_live_count) {
+        search_index_compact();
+    }
+}
+
+// Drop nodes from the search index
+void search_index_remove_many(DirectoryStruct** nodes, int count) {
+    rwlock_write_lock(&search_lock);
+    search_index_remove_locked(nodes, count);
+    rwlock_write_unlock(&search_lock);
+}
+
+// Drop a node from the search index
+void search_index_remove(DirectoryStruct* node) {
+    if (node_cold(node)->search_id != -1) {
+        search_index_remove_many(&node, 1);
+    }
+}
+
+// Position of the first id at or after from that is not below id, galloping then bisecting
+int posting_seek(const TrigramPosting* posting, int from, int id) {
+    int step = 1;
+    int high = from;
+    while (high < posting->count && posting->ids[high] < id) {
+        from = high + 1;
+        high += step;
+        step *= 2;
+    }
+    if (high > posting->count) {
+        high = posting->count;
+    }
+    while (from < high) {
+        int middle = from + (high - from) / 2;
+        if (posting->ids[middle] < id) {
+            from = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return from;
+}
+
+// Add a node holding the fragment to the results if it lies below scope and passes the filter
+void search_collect(SearchResults* found, DirectoryStruct* node) {
+    if (node == NULL) {
+        return;
+    }
+    DirectoryStruct* ancestor = node->parent;
+    while (ancestor != NULL && ancestor != found->scope) {
+        ancestor = ancestor->parent;
+    }
+    if (ancestor == NULL || (found->filter != NULL && !found->filter(node, found->context))) {
+        return;
+    }
+    if (found->count == found->capacity) {
+        found->capacity = found->capacity ? found->capacity * 2 : 64;
+        found->nodes = realloc(found->nodes, found->capacity * sizeof(DirectoryStruct*));
+    }
+    found->nodes[found->count++] = node;
+}
+
+// Check the names of ids [first, last) for fragment in one pass over the packed text; caller
+// holds search_lock. Needs fragment folded if fold is set.
+void search_scan(SearchResults* found, const char* fragment, int length, int fold, int first, int last) {
+    if (first >= last) {
+        return;
+    }
+    int id = first;
+    int position = search_offsets[first];
+    int end = search_offsets[last];
+    while ((position = name_scan(search_text, end, position, fragment, length, fold)) != -1) {
+        while (search_offsets[id + 1] <= position) {
+            id++;
+        }
+        search_collect(found, search_nodes[id]);
+        position = search_offsets[id + 1];  // One hit per name
+        if (position >= end) {
+            break;
+        }
+    }
+}
+
+// Find the names of ids [first, last) holding fragment, by intersecting the posting lists of
+// its trigrams. Fragments shorter than a trigram are scanned for. Caller holds search_lock.
+void search_slice(SearchResults* found, const char* fragment, int first, int last) {
+    int length = (int)strlen(fragment);
+    if (length < 3) {
+        search_scan(found, fragment, length, 0, first, last);
+        return;
+    }
+
+    // Every trigram must be present; walk the shortest list and seek in the others
+    int list_count = 0;
+    TrigramPosting** lists = malloc((length - 2) * sizeof(TrigramPosting*));
+    int* cursors = calloc(length - 2, sizeof(int));
+    for (int i = 0; i + 3 <= length; i++) {
+        TrigramPosting* posting = trigram_find(trigram_key(fragment + i), 0);
+        if (posting == NULL || posting->count == 0) {
+            list_count = 0;
+            break;
+        }
+        int duplicate = 0;
+        for (int j = 0; j < list_count; j++) {
+            duplicate |= lists[j] == posting;
+        }
+        if (duplicate) {
+            continue;
+        }
+        // Keep the lists ordered by length, shortest first
+        int j = list_count++;
+        while (j > 0 && lists[j - 1]->count > posting->count) {
+            lists[j] = lists[j - 1];
+            j--;
+        }
+        lists[j] = posting;
+    }
+    for (int k = list_count > 0 ? posting_seek(lists[0], 0, first) : 0; list_count > 0 && k < lists[0]->count; k++) {
+        int id = lists[0]->ids[k];
+        if (id >= last) {
+            break;
+        }
+        int present = search_nodes[id] != NULL;
+        for (int j = 1; j < list_count && present; j++) {
+            cursors[j] = posting_seek(lists[j], cursors[j], id);
+            present = cursors[j] < lists[j]->count && lists[j]->ids[cursors[j]] == id;
+        }
+        // Holding every trigram does not mean holding them in order
+        int start = search_offsets[id];
+        if (present && name_scan(search_text + start, search_offsets[id + 1] - start - 1, 0, fragment, length, 0) != -1) {
+            search_collect(found, search_nodes[id]);
+        }
+    }
+    free(lists);
+    free(cursors);
+}
+
+// Find the nodes below scope whose names contain fragment. Returns the number found;
+// *results is malloc'd (NULL if none) and the caller frees it.
+int search_names(DirectoryStruct* scope, const char* fragment, DirectoryStruct*** results) {
+    SearchResults found = {scope, NULL, NULL, NULL, 0, 0};
+    rwlock_read_lock(&search_lock);
+    search_slice(&found, fragment, 0, search_node_count);
+    rwlock_read_unlock(&search_lock);
+    *results = found.nodes;
+    return found.count;
+}
+
+// search_names ignoring ASCII case. The trigram index is case sensitive, so this scans
+// every indexed name with the vector kernel.
+int search_names_folded(DirectoryStruct* scope, const char* fragment, DirectoryStruct*** results) {
+    SearchResults found = {scope, NULL, NULL, NULL, 0, 0};
+    char folded[FILE_NAME_LENGTH];
+    int length = 0;
+    while (fragment[length] != '\0' && length < FILE_NAME_LENGTH - 1) {
+        folded[length] = fold_byte(fragment[length]);
+        length++;
+    }
+    folded[length] = '\0';
+    rwlock_read_lock(&search_lock);
+    search_scan(&found, folded, length, 1, 0, search_node_count);
+    rwlock_read_unlock(&search_lock);
+    *results = found.nodes;
+    return found.count;
+}
+
+// Start a search with search_names_next from the first id
+void search_cursor_start(SearchCursor* cursor) {
+    rwlock_read_lock(&search_lock);
+    cursor->next_id = 0;
+    cursor->id_count = search_node_count;
+    cursor->generation = search_generation;
+    rwlock_read_unlock(&search_lock);
+}
+
+// Has the cursor passed every id
+int search_cursor_done(const SearchCursor* cursor) {
+    return cursor->next_id >= cursor->id_count;
+}
+
+// search_names over the next slice ids of a cursor, keeping only nodes the filter accepts
+// (filter may be NULL). Returns the matches in the slice, or -1 if the index was rebuilt
+// since the last slice: the cursor then starts over and earlier matches should be dropped.
+int search_names_next(SearchCursor* cursor, DirectoryStruct* scope, const char* fragment, int slice,
+                      SearchFilter filter, void* context, DirectoryStruct*** results) {
+    SearchResults found = {scope, filter, context, NULL, 0, 0};
+    rwlock_read_lock(&search_lock);
+    if (cursor->generation != search_generation) {
+        cursor->next_id = 0;
+        cursor->id_count = search_node_count;
+        cursor->generation = search_generation;
+        rwlock_read_unlock(&search_lock);
+        *results = NULL;
+        return -1;
+    }
+    cursor->id_count = search_node_count;  // Names added meanwhile are searched too
+    int last = cursor->next_id + slice < cursor->id_count ? cursor->next_id + slice : cursor->id_count;
+    search_slice(&found, fragment, cursor->next_id, last);
+    cursor->next_id = last;
+    rwlock_read_unlock(&search_lock);
+    *results = found.nodes;
+    return found.count;
+}
+
+// Child Index Functions
+
+// Does the child's name equal the first len bytes of name
+int child_name_matches(const DirectoryStruct* child, const char* name, size_t len) {
+    return child->name_len == (int)len && memcmp(child->name, name, len) == 0;
+}
+
+// Insert a child into the parent's table (the table must have a free slot)
+void child_table_insert(DirectoryStruct* parent, DirectoryStruct* child) {
+    unsigned int mask = node_cold(parent)->child_table_size - 1;
+    unsigned int slot = name_hash_n(child->name, child->name_len) & mask;
+    while (parent->child_table[slot] != NULL) {
+        slot = (slot + 1) & mask;
+    }
+    parent->child_table[slot] = child;
+}
+
+// Rebuild the parent's table so it stays at most half full
+void child_table_rebuild(DirectoryStruct* parent, int size) {
+    DirectoryStruct** table = calloc(size, sizeof(DirectoryStruct*));
+    if (table == NULL) {
+        printf("Error: Memory allocation failed for child index of %s\n", parent->name);
+        return;  // Keep the old table, lookups still work
+    }
+    free(parent->child_table);
+    parent->child_table = table;
+    node_cold(parent)->child_table_size = size;
+    for (int i = 0; i < parent->child_count; i++) {
+        child_table_insert(parent, parent->children[i]);
+    }
+}
+
+// Remove a child from the parent's table, shifting back later entries of its probe run
+void child_table_remove(DirectoryStruct* parent, DirectoryStruct* child) {
+    unsigned int mask = node_cold(parent)->child_table_size - 1;
+    unsigned int slot = name_hash_n(child->name, child->name_len) & mask;
+    while (parent->child_table[slot] != child) {
+        if (parent->child_table[slot] == NULL) {
+            return;
+        }
+        slot = (slot + 1) & mask;
+    }
+    parent->child_table[slot] = NULL;
+
+    unsigned int next = (slot + 1) & mask;
+    while (parent->child_table[next] != NULL) {
+        DirectoryStruct* moved = parent->child_table[next];
+        unsigned int home = name_hash_n(moved->name, moved->name_len) & mask;
+        // Move the entry into the hole unless its home lies cyclically in (slot, next]
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            parent->child_table[slot] = moved;
+            parent->child_table[next] = NULL;
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+}
+
+// Add to the subtree totals of node and every directory above it. Atomic, because file
+// writes on different threads account their growth here.
+void tree_adjust(DirectoryStruct* node, int64_t bytes, int files, int dirs) {
+    for (; node != NULL; node = node->parent) {
+        __atomic_fetch_add(&node->subtree_bytes, bytes, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&node->subtree_files, files, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&node->subtree_dirs, dirs, __ATOMIC_RELAXED);
+    }
+}
+
+// Account a file inode's change in size in the tree node it belongs to, if any
+void tree_account_size(int inode_number, int64_t delta) {
+    DirectoryStruct* node = inode_nodes ? __atomic_load_n(&inode_nodes[inode_number], __ATOMIC_ACQUIRE) : NULL;
+    if (node != NULL && delta != 0) {
+        tree_adjust(node, delta, 0, 0);
+    }
+}
+
+// Add a child to a directory's children list and name index
+void add_child(DirectoryStruct* parent, DirectoryStruct* child) {
+    NodeCold* cold = node_cold(parent);
+    if (parent->child_count >= cold->max_children) {
+        cold->max_children = cold->max_children ? cold->max_children * 2 : 1;
+        parent->children = realloc(parent->children, cold->max_children * sizeof(DirectoryStruct*));
+    }
+    node_cold(child)->child_index = parent->child_count;
+    parent->children[parent->child_count++] = child;
+
+    if (parent->child_table != NULL && parent->child_count * 2 <= cold->child_table_size) {
+        child_table_insert(parent, child);
+    } else if (parent->child_count > CHILD_HASH_THRESHOLD) {
+        int size = cold->child_table_size ? cold->child_table_size : CHILD_HASH_THRESHOLD;
+        while (size < parent->child_count * 2) {
+            size *= 2;
+        }
+        child_table_rebuild(parent, size);
+    }
+    tree_adjust(parent, child->subtree_bytes, child->subtree_files, child->subtree_dirs);
+    search_index_add(child, parent);
+}
+
+// Remove a child from a directory's children list and name index. The last child takes
+// its place, so children do not keep the order they were added in.
+void remove_child(DirectoryStruct* parent, DirectoryStruct* child) {
+    int index = node_cold(child)->child_index;
+    DirectoryStruct* last = parent->children[--parent->child_count];
+    parent->children[index] = last;
+    node_cold(last)->child_index = index;
+    if (parent->child_table != NULL) {
+        child_table_remove(parent, child);
+    }
+    tree_adjust(parent, -child->subtree_bytes, -child->subtree_files, -child->subtree_dirs);
+    search_index_remove(child);
+}
+
+// Find a child whose name is the first len bytes of name
+DirectoryStruct* find_child_n(DirectoryStruct* parent, const char* name, size_t len) {
+    if (parent->child_table != NULL) {
+        unsigned int mask = node_cold(parent)->child_table_size - 1;
+        unsigned int slot = name_hash_n(name, len) & mask;
+        while (parent->child_table[slot] != NULL) {
+            if (child_name_matches(parent->child_table[slot], name, len)) {
+                return parent->child_table[slot];
+            }
+            slot = (slot + 1) & mask;
+        }
+        return NULL;
+    }
+
+    for (int i = 0; i < parent->child_count; i++) {
+        if (child_name_matches(parent->children[i], name, len)) {
+            return parent->children[i];
+        }
+    }
+    return NULL;
+}
+
+// Path Cache Functions
+
+// Forget every cached path (call whenever a node is renamed, moved or freed)
+void dentry_cache_invalidate() {
+    if (__atomic_add_fetch(&dentry_generation, 1, __ATOMIC_RELEASE) == 0) {
+        // Counter wrapped, old entries could look valid again
+        memset(dentry_cache, 0, sizeof(dentry_cache));
+        dentry_generation = 1;
+    }
+}
+
+// Hash a path together with the root it is resolved from
+unsigned int dentry_hash(DirectoryStruct* root, const char* path, size_t len) {
+    return name_hash_n(path, len) ^ (unsigned int)((uintptr_t)root >> 4);
+}
+
+// Give a node back once it is out of its tree; its name and child arrays go with it
+void node_free(DirectoryStruct* node) {
+    release_name(node->name);
+    free(node->children);
+    free(node->child_table);
+    mutex_lock(&node_lock);
+    node->parent = free_nodes;
+    free_nodes = node;
+    mutex_unlock(&node_lock);
+}
+
+// Directory Functions
+
+// Find directory by name
+DirectoryStruct* find_directory(DirectoryStruct* parent, const char* dir_name) {
+    if (parent == NULL || dir_name == NULL) {
+        return NULL;
+    }
+
+    return find_child_n(parent, dir_name, strlen(dir_name));
+}
+
+// Get the file size
+int get_file_size(const char *filename) {
+    rwlock_read_lock(&namespace_lock);
+    int i = name_index_lookup(filename);
+    if (i != -1) {
+        int inode_number = directory->entries[i].inode_number;
+        if (inode_number >= 0 && inode_number < sb->inode_count) {
+            int file_size = __atomic_load_n(&inodes[inode_number].file_size, __ATOMIC_RELAXED);
+            rwlock_read_unlock(&namespace_lock);
+            return file_size;
+        } else {
+            rwlock_read_unlock(&namespace_lock);
+            printf("Error: Invalid inode number %d for file %s\n", inode_number, filename);
+            return -1;
+        }
+    }
+    rwlock_read_unlock(&namespace_lock);
+    printf("Error: File %s not found\n", filename);
+    return -1; // Or handle error as appropriate in your context
+}
+
+// List all directories and subdirectories
+void list_directory(DirectoryStruct* dir, int depth) {
+    for (int i = 0; i < dir->child_count; i++) {
+        for (int j = 0; j < depth; j++) {
+            printf("  ");
+        }
+        printf("[DIR] %s\n", dir->children[i]->name);
+        list_directory(dir->children[i], depth + 1);
+    }
+}
+
+
+// Navigate directory path
+DirectoryStruct* navigate_path(DirectoryStruct* root, const char* path) {
+    size_t path_length = strlen(path);
+    unsigned int hash = dentry_hash(root, path, path_length);
+    DentryCacheEntry* entry = &dentry_cache[hash & (DENTRY_CACHE_SIZE - 1)];
+    unsigned int generation = __atomic_load_n(&dentry_generation, __ATOMIC_ACQUIRE);
+    unsigned int sequence = __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE);
+    if ((sequence & 1) == 0 && path_length < DENTRY_PATH_LENGTH && entry->generation == generation &&
+        entry->root == root && entry->hash == hash && strncmp(entry->path, path, DENTRY_PATH_LENGTH) == 0) {
+        DirectoryStruct* node = entry->node;
+        // Trust what was read only if no thread rewrote the entry meanwhile
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&entry->sequence, __ATOMIC_RELAXED) == sequence) {
+            return node;
+        }
+    }
+
+    // Walk the path one component at a time, without copying it
+    DirectoryStruct* current = root;
+    const char* component = path;
+    while (*component != '\0') {
+        if (*component == '/') {
+            component++;
+            continue;
+        }
+        const char* end = strchr(component, '/');
+        size_t len = end ? (size_t)(end - component) : strlen(component);
+        current = find_child_n(current, component, len);
+        if (current == NULL) {
+            return NULL;
+        }
+        component += len;
+    }
+
+    // Claim the entry by making its sequence odd; skip caching if another thread has it
+    sequence = __atomic_load_n(&entry->sequence, __ATOMIC_RELAXED);
+    if (path_length < DENTRY_PATH_LENGTH && (sequence & 1) == 0 &&
+        __atomic_compare_exchange_n(&entry->sequence, &sequence, sequence + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        entry->hash = hash;
+        entry->generation = generation;
+        entry->root = root;
+        entry->node = current;
+        memcpy(entry->path, path, path_length + 1);
+        __atomic_store_n(&entry->sequence, sequence + 2, __ATOMIC_RELEASE);
+    }
+    return current;
+}
+
+
+// Set directory permissions
+void set_directory_permissions(DirectoryStruct* dir, unsigned char read, unsigned char write, unsigned char execute) {
+    node_cold(dir)->permissions = (Permissions){read, write, execute};
+}
+
+// Block Functions
+//
+// Allocations set their bits straight away. Frees only count the blocks as free: their bits
+// are cleared once the record freeing them is in the log (see journal_reuse_frees), so when
+// the bitmap looks full the committed frees are written out and the search is tried again.
+
+// Allocate a block
+int allocate_block() {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        mutex_lock(&alloc_lock);
+        int block_num = bitmap_find_clear(block_bitmap, sb->total_blocks, alloc_hint);
+        if (block_num == -1) {
+            block_num = bitmap_find_clear(block_bitmap, sb->total_blocks, 0);
+        }
+        if (block_num != -1) {
+            block_bitmap[block_num / 64] |= 1ULL << (block_num % 64);
+            __atomic_fetch_sub(&sb->free_blocks, 1, __ATOMIC_RELAXED);
+            journal_log_alloc(block_num, 1);
+            alloc_hint = (block_num + 1) % sb->total_blocks;
+            mutex_unlock(&alloc_lock);
+            return block_num;
+        }
+        mutex_unlock(&alloc_lock);
+        if (__atomic_load_n(&log_released_blocks, __ATOMIC_RELAXED) == 0 || !journal_write_committed()) {
+            break;
+        }
+    }
+    return -1;
+}
+
+// Search [from, to) for count free blocks in a row, -1 if there is no such run; caller holds alloc_lock
+int find_free_extent(int from, int to, int count) {
+    int block_num = from;
+    while (block_num < to) {
+        block_num = bitmap_find_clear(block_bitmap, to, block_num);
+        if (block_num == -1) {
+            return -1;
+        }
+        // The run may continue past to, which only matters on the wrapped pass
+        int run = bitmap_clear_run(block_bitmap, sb->total_blocks, block_num, count);
+        if (run == count) {
+            return block_num;
+        }
+        block_num += run;
+    }
+    return -1;
+}
+
+// Allocate count contiguous blocks, returning the first one or -1 if no run is long enough
+int allocate_contiguous(int count) {
+    mutex_lock(&alloc_lock);
+    int start = -1;
+    if (count > 0 && count <= sb->free_blocks) {
+        start = find_free_extent(alloc_hint, sb->total_blocks, count);
+        if (start == -1) {
+            start = find_free_extent(0, alloc_hint, count);
+        }
+    }
+    if (start != -1) {
+        bitmap_set_range(block_bitmap, start, count);
+        __atomic_fetch_sub(&sb->free_blocks, count, __ATOMIC_RELAXED);
+        journal_log_alloc(start, count);
+        alloc_hint = (start + count) % sb->total_blocks;
+    }
+    mutex_unlock(&alloc_lock);
+    return start;
+}
+
+// Free count contiguous blocks starting at start
+void free_contiguous(int start, int count) {
+    journal_log_free(start, count);
+    mutex_lock(&alloc_lock);
+    __atomic_fetch_add(&sb->free_blocks, count, __ATOMIC_RELAXED);
+    mutex_unlock(&alloc_lock);
+}
+
+// Free a block
+void free_block(int block_num) {
+    free_contiguous(block_num, 1);
+}
+
+// Free count blocks from start now, or queue them on batch for free_block_batch if it is set
+void batch_free_run(BlockBatch* batch, int start, int count) {
+    if (batch == NULL || batch_append(batch, start, count) != 0) {
+        free_contiguous(start, count);
+    }
+}
+
+// Free every run queued on a batch, counting them under one hold of alloc_lock, then empty
+// the batch. The open transaction merges neighbouring runs when it commits.
+void free_block_batch(BlockBatch* batch) {
+    int count = 0;
+    for (int i = 0; i < batch->count; i++) {
+        journal_log_free(batch->runs[i].physical, batch->runs[i].length);
+        count += batch->runs[i].length;
+    }
+    if (count > 0) {
+        mutex_lock(&alloc_lock);
+        __atomic_fetch_add(&sb->free_blocks, count, __ATOMIC_RELAXED);
+        mutex_unlock(&alloc_lock);
+    }
+    free(batch->runs);
+    *batch = (BlockBatch){NULL, 0, 0};
+}
+
+// Allocate the first free run at or after the next-fit cursor, taking up to max_count blocks of it.
+// Returns the first block and stores the run length in *count, or -1 if the volume is full.
+int allocate_extent(int max_count, int* count) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        mutex_lock(&alloc_lock);
+        int start = bitmap_find_clear(block_bitmap, sb->total_blocks, alloc_hint);
+        if (start == -1) {
+            start = bitmap_find_clear(block_bitmap, sb->total_blocks, 0);
+        }
+        if (start != -1) {
+            *count = bitmap_clear_run(block_bitmap, sb->total_blocks, start, max_count);
+            bitmap_set_range(block_bitmap, start, *count);
+            __atomic_fetch_sub(&sb->free_blocks, *count, __ATOMIC_RELAXED);
+            journal_log_alloc(start, *count);
+            alloc_hint = (start + *count) % sb->total_blocks;
+            mutex_unlock(&alloc_lock);
+            return start;
+        }
+        mutex_unlock(&alloc_lock);
+        if (__atomic_load_n(&log_released_blocks, __ATOMIC_RELAXED) == 0 || !journal_write_committed()) {
+            break;
+        }
+    }
+    return -1;
+}
+
+// Extent Functions
+
+// Index of the last extent in list whose logical start is <= logical, -1 if none
+int extent_search(const Extent* list, int count, int logical) {
+    int low = 0;
+    int high = count - 1;
+    int found = -1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (list[mid].logical <= logical) {
+            found = mid;
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return found;
+}
+
+// Find the extent holding a file block. Returns 0 and fills *extent, or -1 if the block is unmapped.
+int inode_find_extent(int inode_number, int logical, Extent* extent) {
+    inode* node = &inodes[inode_number];
+    int i = extent_search(node->extents, node->extent_count, logical);
+    if (i == -1) {
+        return -1;
+    }
+    *extent = node->extents[i];
+    // Walk down the index levels to the leaf
+    for (int level = node->extent_depth; level > 0; level--) {
+        int block_num = extent->physical;
+        ExtentNode* tree_node = (ExtentNode*)pin_block(block_num);
+        if (tree_node == NULL) {
+            return -1;
+        }
+        int j = extent_search(tree_node->extents, tree_node->count, logical);
+        if (j != -1) {
+            *extent = tree_node->extents[j];
+        }
+        unpin_block(block_num, 0);
+        if (j == -1) {
+            return -1;
+        }
+    }
+    return logical < extent->logical + extent->length ? 0 : -1;
+}
+
+// Map a file block to its disk block, -1 if unmapped
+int inode_map_block(int inode_number, int logical) {
+    Extent extent;
+    if (inode_find_extent(inode_number, logical, &extent) != 0) {
+        return -1;
+    }
+    return extent.physical + (logical - extent.logical);
+}
+
+// Number of file blocks mapped (files are mapped from block 0 without holes)
+int inode_mapped_blocks(int inode_number) {
+    inode* node = &inodes[inode_number];
+    if (node->extent_count == 0) {
+        return 0;
+    }
+    Extent* last = &node->extents[node->extent_count - 1];
+    return last->logical + last->length;
+}
+
+// Start an empty tree node of a level in a newly allocated block, returned pinned (unpin it as dirty)
+ExtentNode* init_extent_node(int block_num, int level) {
+    ExtentNode* tree_node = (ExtentNode*)pin_block(block_num);
+    if (tree_node != NULL) {
+        tree_node->count = 0;
+        tree_node->level = level;
+        journal_log_block(block_num, (const char*)tree_node, 0, sizeof(ExtentNode));
+    }
+    return tree_node;
+}
+
+// Follow the last extent of each level from the inode down to the rightmost leaf: path[level]
+// is the node of that level and counts[level] its extent count. Fills *last with the last
+// extent mapping data (zero length if none). Returns -1 if a node cannot be read.
+int extent_rightmost_path(inode* node, int* path, int* counts, Extent* last) {
+    *last = node->extent_count ? node->extents[node->extent_count - 1] : (Extent){0, 0, 0};
+    for (int level = node->extent_depth - 1; level >= 0; level--) {
+        path[level] = last->physical;
+        ExtentNode* tree_node = (ExtentNode*)pin_block(path[level]);
+        if (tree_node == NULL) {
+            return -1;
+        }
+        counts[level] = tree_node->count;
+        *last = tree_node->count ? tree_node->extents[tree_node->count - 1] : (Extent){0, 0, 0};
+        unpin_block(path[level], 0);
+    }
+    return 0;
+}
+
+// Add length blocks to the last extent of every level of the rightmost path from level from
+// up to and including the inode
+int extent_path_extend(inode* node, const int* path, const int* counts, int from, int length) {
+    for (int level = from; level < node->extent_depth; level++) {
+        ExtentNode* tree_node = (ExtentNode*)pin_block(path[level]);
+        if (tree_node == NULL) {
+            return -1;
+        }
+        tree_node->extents[counts[level] - 1].length += length;
+        journal_log_block(path[level], (const char*)tree_node, sizeof(ExtentNode) + (counts[level] - 1) * sizeof(Extent), sizeof(Extent));
+        unpin_block(path[level], 1);
+    }
+    node->extents[node->extent_count - 1].length += length;
+    journal_log(node, sizeof(inode));
+    return 0;
+}
+
+// Move the inode's extents into a new tree node and make it the only one the inode points at,
+// adding a level to the tree. Returns the node's block, or -1.
+int extent_push_down(inode* node) {
+    if (node->extent_depth + 1 >= EXTENT_MAX_DEPTH || EXTENTS_PER_NODE < INODE_EXTENTS) {
+        return -1;
+    }
+    int block_num = allocate_block();
+    if (block_num == -1) {
+        return -1;
+    }
+    ExtentNode* tree_node = init_extent_node(block_num, node->extent_depth);
+    if (tree_node == NULL) {
+        free_block(block_num);
+        return -1;
+    }
+    memcpy(tree_node->extents, node->extents, node->extent_count * sizeof(Extent));
+    tree_node->count = node->extent_count;
+    journal_log_block(block_num, (const char*)tree_node, 0, sizeof(ExtentNode) + tree_node->count * sizeof(Extent));
+    unpin_block(block_num, 1);
+    Extent* last = &node->extents[node->extent_count - 1];
+    node->extents[0] = (Extent){0, block_num, last->logical + last->length};
+    node->extent_count = 1;
+    node->extent_depth++;
+    journal_log(node, sizeof(inode));
+    return block_num;
+}
+
+// Map physical..physical+length-1 after the last mapped file block.
+// Merges with the last extent when it continues on disk. Otherwise the extent goes into the
+// rightmost leaf; when that is full, new nodes are started below the lowest level of the
+// rightmost path with room, and a level is added once the inode itself is full.
+// Returns -1 if the tree cannot take it.
+int inode_append_extent(int inode_number, int physical, int length) {
+    inode* node = &inodes[inode_number];
+    int logical = inode_mapped_blocks(inode_number);
+    int path[EXTENT_MAX_DEPTH];
+    int counts[EXTENT_MAX_DEPTH];
+    Extent last;
+    if (extent_rightmost_path(node, path, counts, &last) != 0) {
+        return -1;
+    }
+    if (last.length > 0 && last.physical + last.length == physical) {
+        return extent_path_extend(node, path, counts, 0, length);
+    }
+
+    // The lowest level with room; extent_depth stands for the inode
+    int room = 0;
+    while (room < node->extent_depth && counts[room] >= EXTENTS_PER_NODE) {
+        room++;
+    }
+    if (room == node->extent_depth && node->extent_count == INODE_EXTENTS) {
+        int block_num = extent_push_down(node);
+        if (block_num == -1) {
+            return -1;
+        }
+        path[node->extent_depth - 1] = block_num;
+        counts[node->extent_depth - 1] = INODE_EXTENTS;
+        if (INODE_EXTENTS >= EXTENTS_PER_NODE) {
+            room++;  // The node is full too, the inode has room now
+        }
+    }
+
+    // A new node for each level below room, each holding the one extent pointing down
+    int chain[EXTENT_MAX_DEPTH];
+    for (int level = 0; level < room; level++) {
+        chain[level] = allocate_block();
+        if (chain[level] == -1) {
+            for (int i = 0; i < level; i++) {
+                free_block(chain[i]);
+            }
+            return -1;
+        }
+    }
+    Extent entry = {logical, physical, length};
+    for (int level = 0; level < room; level++) {
+        ExtentNode* tree_node = init_extent_node(chain[level], level);
+        if (tree_node == NULL) {
+            for (int i = 0; i < room; i++) {
+                free_block(chain[i]);
+            }
+            return -1;
+        }
+        tree_node->extents[tree_node->count++] = entry;
+        journal_log_block(chain[level], (const char*)tree_node, 0, sizeof(ExtentNode) + sizeof(Extent));
+        unpin_block(chain[level], 1);
+        entry = (Extent){logical, chain[level], length};
+    }
+
+    if (room == node->extent_depth) {
+        node->extents[node->extent_count++] = entry;
+        journal_log(node, sizeof(inode));
+        return 0;
+    }
+    ExtentNode* tree_node = (ExtentNode*)pin_block(path[room]);
+    if (tree_node == NULL) {
+        for (int i = 0; i < room; i++) {
+            free_block(chain[i]);
+        }
+        return -1;
+    }
+    tree_node->extents[tree_node->count++] = entry;
+    journal_log_block(path[room], (const char*)tree_node, 0, sizeof(ExtentNode));
+    journal_log_block(path[room], (const char*)tree_node, sizeof(ExtentNode) + (tree_node->count - 1) * sizeof(Extent), sizeof(Extent));
+    unpin_block(path[room], 1);
+    return extent_path_extend(node, path, counts, room + 1, length);
+}
+
+// Map up to blocks more disk blocks onto the end of a file, preferring one contiguous run.
+// Returns the number of blocks added.
+int inode_grow(int inode_number, int blocks) {
+    int added = 0;
+    while (added < blocks) {
+        int wanted = blocks - added;
+        int count = wanted;
+        int start = allocate_contiguous(wanted);
+        if (start == -1) {
+            start = allocate_extent(wanted, &count);
+            if (start == -1) {
+                break;
+            }
+        }
+        if (inode_append_extent(inode_number, start, count) != 0) {
+            free_contiguous(start, count);
+            printf("Error: File is too fragmented to map more blocks\n");
+            break;
+        }
+        added += count;
+    }
+    return added;
+}
+
+// The lock shard guarding an inode
+RwLock* inode_lock(int inode_number) {
+    return &inode_locks[inode_number & (INODE_LOCK_SHARDS - 1)].lock;
+}
+
+// Count a change to an inode's data, so windows read ahead of it are dropped; caller holds
+// its lock for writing
+void inode_data_changed(int inode_number) {
+    inode_locks[inode_number & (INODE_LOCK_SHARDS - 1)].writes++;
+}
+
+// Free an extent tree node, the nodes below it and the data blocks they map, straight away
+// or onto batch if it is set
+void extent_node_free(int block_num, BlockBatch* batch) {
+    ExtentNode* tree_node = (ExtentNode*)pin_block(block_num);
+    if (tree_node != NULL) {
+        int count = tree_node->count;
+        if (tree_node->level == 0) {
+            for (int i = 0; i < count; i++) {
+                batch_free_run(batch, tree_node->extents[i].physical, tree_node->extents[i].length);
+            }
+            unpin_block(block_num, 0);
+        } else {
+            unpin_block(block_num, 0);
+            // Re-pin for each child rather than hold one frame per level
+            for (int i = 0; i < count; i++) {
+                tree_node = (ExtentNode*)pin_block(block_num);
+                if (tree_node == NULL) {
+                    break;
+                }
+                int child = tree_node->extents[i].physical;
+                unpin_block(block_num, 0);
+                extent_node_free(child, batch);
+            }
+        }
+    }
+    batch_free_run(batch, block_num, 1);
+}
+
+// Free every data block and extent tree node of an inode, straight away or onto batch if it
+// is set, leaving its extent map to the caller
+void inode_release_blocks(int inode_number, BlockBatch* batch) {
+    inode* node = &inodes[inode_number];
+    inode_data_changed(inode_number);
+    for (int i = 0; i < node->extent_count; i++) {
+        if (node->extent_depth == 0) {
+            batch_free_run(batch, node->extents[i].physical, node->extents[i].length);
+        } else {
+            extent_node_free(node->extents[i].physical, batch);
+        }
+    }
+}
+
+// Free every data block and extent tree node of an inode, straight away or onto batch if it is set
+void inode_free_extents(int inode_number, BlockBatch* batch) {
+    inode* node = &inodes[inode_number];
+    inode_release_blocks(inode_number, batch);
+    node->extent_count = 0;
+    node->extent_depth = 0;
+    journal_log(node, sizeof(inode));
+}
+
+// Inode and Directory Slot Functions
+//
+// Free inodes and directory entries are found in their bitmaps, starting at a hint below
+// which nothing is free, so the lowest free one is still taken without scanning the tables.
+// Callers hold namespace_lock for writing and an open transaction.
+
+// Take the lowest clear bit of map at or above *hint, -1 if every bit is set
+int bitmap_take_lowest(uint64_t* map, int* hint) {
+    int bit = bitmap_find_clear(map, sb->inode_count, *hint);
+    if (bit == -1) {
+        *hint = sb->inode_count;
+        return -1;
+    }
+    map[bit / 64] |= 1ULL << (bit % 64);
+    journal_log(&map[bit / 64], sizeof(uint64_t));
+    *hint = bit + 1;
+    return bit;
+}
+
+// Clear bit of map and lower *hint to it if needed
+void bitmap_release(uint64_t* map, int* hint, int bit) {
+    map[bit / 64] &= ~(1ULL << (bit % 64));
+    journal_log(&map[bit / 64], sizeof(uint64_t));
+    if (bit < *hint) {
+        *hint = bit;
+    }
+}
+
+// Allocate the lowest free inode, -1 if there is none
+int allocate_inode() {
+    return bitmap_take_lowest(inode_bitmap, &inode_hint);
+}
+
+void free_inode(int inode_number) {
+    bitmap_release(inode_bitmap, &inode_hint, inode_number);
+}
+
+// Allocate the lowest free directory entry, -1 if there is none
+int allocate_dir_slot() {
+    return bitmap_take_lowest(slot_bitmap, &slot_hint);
+}
+
+// Set an inode's access time, which is not logged, and mark it for writing back at unmount.
+// Needs namespace_lock only for reading.
+void inode_touch_access(int inode_number) {
+    __atomic_store_n(&inodes[inode_number].timestamps[2], (int)time(NULL), __ATOMIC_RELAXED);
+    uint64_t bit = 1ULL << (inode_number % 64);
+    if ((__atomic_load_n(&atime_dirty[inode_number / 64], __ATOMIC_RELAXED) & bit) == 0) {
+        __atomic_fetch_or(&atime_dirty[inode_number / 64], bit, __ATOMIC_RELAXED);
+    }
+}
+
+// Descriptor Functions
+//
+// Descriptors index a table of FD_CHUNK_SIZE-entry chunks that is grown a chunk at a time,
+// so an entry never moves and lookups need no lock. Free descriptors sit on a stack under
+// fd_lock; each thread keeps up to FD_THREAD_CACHE of them in a private cache and only takes
+// fd_lock to refill or spill it half at a time. The first time a thread uses its cache it
+// sets fd_exit_key, whose destructor puts the cache back on the stack when the thread ends.
+
+// The table entry of a descriptor, open or not; NULL if it is out of range
+OpenFile* fd_slot(int file_descriptor) {
+    if (file_descriptor < 0 || file_descriptor >= MAX_OPEN_FILES) {
+        return NULL;
+    }
+    OpenFile* chunk = __atomic_load_n(&fd_chunks[file_descriptor / FD_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+    return chunk != NULL ? &chunk[file_descriptor % FD_CHUNK_SIZE] : NULL;
+}
+
+// The entry of an open descriptor, NULL if it is not open
+OpenFile* get_open_file(int file_descriptor) {
+    OpenFile* file = fd_slot(file_descriptor);
+    if (file == NULL || __atomic_load_n(&file->inode_number, __ATOMIC_ACQUIRE) == -1) {
+        return NULL;
+    }
+    return file;
+}
+
+// Add a chunk of free descriptors to the table; caller holds fd_lock
+int fd_grow() {
+    if (fd_chunk_count == FD_MAX_CHUNKS) {
+        return -1;
+    }
+    OpenFile* chunk = malloc(FD_CHUNK_SIZE * sizeof(OpenFile));
+    int* stack = realloc(fd_free_stack, (size_t)(fd_chunk_count + 1) * FD_CHUNK_SIZE * sizeof(int));  // Room for every descriptor
+    if (stack != NULL) {
+        fd_free_stack = stack;
+    }
+    if (chunk == NULL || stack == NULL) {
+        free(chunk);
+        return -1;
+    }
+    int first = fd_chunk_count * FD_CHUNK_SIZE;
+    for (int i = 0; i < FD_CHUNK_SIZE; i++) {
+        chunk[i].inode_number = -1;
+        chunk[i].current_position = 0;
+        chunk[i].readahead = NULL;
+        chunk[i].readahead_claimed = 0;
+        fd_free_stack[fd_free_count++] = first + FD_CHUNK_SIZE - 1 - i;  // Lowest on top
+    }
+    __atomic_store_n(&fd_chunks[fd_chunk_count], chunk, __ATOMIC_RELEASE);
+    fd_chunk_count++;
+    return 0;
+}
+
+// Drop this thread's cached descriptors if the table was reset since they were taken
+void fd_check_generation() {
+    unsigned int generation = __atomic_load_n(&fd_generation, __ATOMIC_ACQUIRE);
+    if (fd_local_generation != generation) {
+        fd_local_count = 0;
+        fd_local_generation = generation;
+    }
+}
+
+// Return an exiting thread's cached descriptors to the free stack, keeping the lowest on top
+THREAD_KEY_DESTRUCTOR fd_thread_exit(void* unused) {
+    (void)unused;
+    mutex_lock(&fd_lock);
+    if (fd_local_generation == fd_generation) {  // Dropped instead if the table was reset
+        for (int i = 0; i < fd_local_count; i++) {
+            fd_free_stack[fd_free_count++] = fd_local[i];
+        }
+    }
+    fd_local_count = 0;
+    mutex_unlock(&fd_lock);
+}
+
+// Have fd_thread_exit run when this thread ends (once per thread)
+void fd_watch_thread() {
+    if (fd_local_watched) {
+        return;
+    }
+    mutex_lock(&fd_lock);
+    if (!fd_exit_key_ready) {
+        fd_exit_key_ready = thread_key_create(&fd_exit_key, fd_thread_exit) == 0;
+    }
+    if (fd_exit_key_ready) {
+        thread_key_set(fd_exit_key, &fd_exit_key);  // Any non-NULL value runs the destructor
+        fd_local_watched = 1;
+    }
+    mutex_unlock(&fd_lock);
+}
+
+// Take a free descriptor, -1 if the table is full
+int fd_alloc() {
+    fd_check_generation();
+    fd_watch_thread();
+    if (fd_local_count == 0) {
+        mutex_lock(&fd_lock);
+        if (fd_free_count == 0) {
+            fd_grow();
+        }
+        // Refill with the lowest free descriptors, keeping the lowest on top
+        int take = fd_free_count < FD_THREAD_CACHE / 2 ? fd_free_count : FD_THREAD_CACHE / 2;
+        for (int i = 0; i < take; i++) {
+            fd_local[take - 1 - i] = fd_free_stack[--fd_free_count];
+        }
+        fd_local_count = take;
+        mutex_unlock(&fd_lock);
+        if (fd_local_count == 0) {
+            return -1;
+        }
+    }
+    return fd_local[--fd_local_count];
+}
+
+// Return a closed descriptor to this thread's cache, spilling half of a full one
+void fd_release(int file_descriptor) {
+    fd_check_generation();
+    fd_watch_thread();
+    if (fd_local_count == FD_THREAD_CACHE) {
+        mutex_lock(&fd_lock);
+        while (fd_local_count > FD_THREAD_CACHE / 2) {
+            fd_free_stack[fd_free_count++] = fd_local[--fd_local_count];
+        }
+        mutex_unlock(&fd_lock);
+    }
+    fd_local[fd_local_count++] = file_descriptor;
+}
+
+// Readahead Functions
+//
+// read_file and readv_file follow each descriptor's reads. One starting where the last ended
+// continues a sequential stream, and on an image the descriptor then reads a window of the
+// following blocks into its staging buffer through the io engine while the caller copies
+// what it asked for. Once the reader reaches the window its blocks are put in the cache and
+// the next window, twice as large up to READAHEAD_MAX blocks, is issued, so a stream misses
+// about once per window instead of once per block. Resident blocks are not read again, and
+// a window is dropped if the inode was written meanwhile, as the copy could then be older.
+// One thread at a time claims a descriptor's state; a read on the same descriptor from
+// another thread meanwhile goes without readahead.
+
+// Blocks a window may span with the cache at its current size
+int readahead_limit() {
+    int limit = cache_capacity / 4;
+    return limit < READAHEAD_MAX ? limit : READAHEAD_MAX;
+}
+
+// Wait for the window in flight, then put its blocks in the cache if install is set and the
+// inode was not written since it was issued; caller holds the inode's lock to install
+void readahead_finish(Readahead* ra, int inode_number, int install) {
+    long result = io_wait_result(&ra->io);
+    if (install && result >= 0 && ra->generation == inode_locks[inode_number & (INODE_LOCK_SHARDS - 1)].writes) {
+        for (int i = 0; i < ra->pending; i++) {
+            if (ra->block_nums[i] != -1) {
+                cache_install(ra->block_nums[i], ra->staging + (size_t)i * sb->block_size);
+            }
+        }
+    }
+    ra->pending = 0;
+}
+
+// Start reading count blocks of an inode from logical block start into the staging buffer,
+// one request per run of blocks contiguous on disk; caller holds the inode's lock
+void readahead_issue(Readahead* ra, int inode_number, int start, int count) {
+    int run_block = 0;  // Physical blocks waiting to be queued as one request
+    int run_start = 0;
+    int run_length = 0;
+    int issued = 0;
+    Extent extent = {0, 0, 0};
+    io_future_init(&ra->io, NULL, NULL);
+    io_future_hold(&ra->io);
+    for (int i = 0; i <= count; i++) {
+        int block_number = -1;
+        if (i < count) {
+            int block_index = start + i;
+            if (block_index >= extent.logical + extent.length || block_index < extent.logical) {
+                if (inode_find_extent(inode_number, block_index, &extent) != 0) {
+                    count = i;  // Unmapped, the window ends here
+                }
+            }
+            if (i < count) {
+                block_number = extent.physical + (block_index - extent.logical);
+                if (cache_resident(block_number)) {
+                    block_number = -1;
+                }
+                ra->block_nums[i] = block_number;
+                issued = i + 1;
+            }
+        }
+        if (run_length > 0 && run_block + run_length != block_number) {
+            io_queue(&ra->io, IO_READ, ra->staging + (size_t)run_start * sb->block_size, (size_t)run_length * sb->block_size,
+                     sb->data_offset + (int64_t)run_block * sb->block_size);
+            run_length = 0;
+        }
+        if (block_number != -1) {
+            if (run_length == 0) {
+                run_block = block_number;
+                run_start = i;
+            }
+            run_length++;
+        }
+    }
+    io_future_release(&ra->io, 1, 0);
+    ra->pending = issued;
+    ra->pending_start = start;
+    ra->generation = inode_locks[inode_number & (INODE_LOCK_SHARDS - 1)].writes;
+}
+
+// Follow a read of size bytes at position with a descriptor's claimed state; see readahead_track
+int readahead_advance(OpenFile* file, int inode_number, int position, int size) {
+    int file_size = inodes[inode_number].file_size;
+    if (size <= 0 || position >= file_size) {
+        return -1;
+    }
+    int end = position + size < file_size ? position + size : file_size;
+    int last = (end - 1) / sb->block_size;
+    int last_block = (file_size - 1) / sb->block_size;
+    Readahead* ra = file->readahead;
+    if (ra == NULL) {
+        if (last == last_block) {
+            return -1;  // Nothing past this read to stream
+        }
+        ra = calloc(1, sizeof(Readahead));
+        if (ra == NULL) {
+            return -1;
+        }
+        file->readahead = ra;
+    }
+
+    int sequential = position == ra->next_position;
+    ra->next_position = end;
+    if (!sequential) {
+        if (ra->pending > 0) {
+            readahead_finish(ra, inode_number, 0);
+        }
+        ra->window = 0;
+        ra->ahead = 0;
+        return -1;
+    }
+    int seen = position % sb->block_size != 0 ? position / sb->block_size : -1;
+    if (!volume_is_image) {
+        return seen;  // An in-memory volume has no load to hide
+    }
+    if (ra->pending > 0) {
+        if (last < ra->pending_start) {
+            return seen;  // Still reading blocks from before the window
+        }
+        readahead_finish(ra, inode_number, 1);
+    }
+
+    // Keep about a window of blocks ahead of the reader
+    int limit = readahead_limit();
+    if (ra->ahead <= last) {
+        ra->ahead = last + 1;
+    }
+    if (limit < 1 || ra->ahead > last_block || (ra->window > 0 && ra->ahead - last > ra->window)) {
+        return seen;
+    }
+    int window = ra->window > 0 ? ra->window * 2 : READAHEAD_MIN;
+    if (window > limit) {
+        window = limit;
+    }
+    if (ra->staging == NULL) {
+        ra->staging = malloc((size_t)READAHEAD_MAX * sb->block_size);
+        ra->block_nums = malloc(READAHEAD_MAX * sizeof(int));
+        if (ra->staging == NULL || ra->block_nums == NULL) {
+            free(ra->staging);
+            free(ra->block_nums);
+            ra->staging = NULL;
+            ra->block_nums = NULL;
+            return seen;
+        }
+    }
+    int count = last_block + 1 - ra->ahead < window ? last_block + 1 - ra->ahead : window;
+    readahead_issue(ra, inode_number, ra->ahead, count);
+    ra->ahead += count;
+    ra->window = window;
+    return seen;
+}
+
+// Follow a descriptor's read of size bytes at position, reading ahead of a sequential
+// stream on an image; caller holds the inode's lock for reading. Returns the logical block
+// the last read ended in if this one carries on from inside it, else -1.
+int readahead_track(OpenFile* file, int inode_number, int position, int size) {
+    if (__atomic_exchange_n(&file->readahead_claimed, 1, __ATOMIC_ACQUIRE)) {
+        return -1;  // Another thread is reading through this descriptor
+    }
+    int seen = readahead_advance(file, inode_number, position, size);
+    __atomic_store_n(&file->readahead_claimed, 0, __ATOMIC_RELEASE);
+    return seen;
+}
+
+// Drop a descriptor's readahead state, waiting for a reader using it and a window in flight
+void readahead_release(OpenFile* file) {
+    while (__atomic_exchange_n(&file->readahead_claimed, 1, __ATOMIC_ACQUIRE)) {
+        thread_yield();
+    }
+    Readahead* ra = file->readahead;
+    if (ra != NULL) {
+        if (ra->pending > 0) {
+            readahead_finish(ra, -1, 0);
+        }
+        free(ra->staging);
+        free(ra->block_nums);
+        free(ra);
+        file->readahead = NULL;
+    }
+    __atomic_store_n(&file->readahead_claimed, 0, __ATOMIC_RELEASE);
+}
+
+// File operations
+
+// Is inode_number an allocated directory; caller holds namespace_lock
+int is_directory_inode(int inode_number) {
+    return inode_number >= 0 && inode_number < sb->inode_count &&
+           inodes[inode_number].inode_number != -1 && inodes[inode_number].file_type == 'd';
+}
+
+// Change a directory's entry count; caller holds namespace_lock for writing and a transaction
+void adjust_directory_size(int parent_inode, int delta) {
+    inodes[parent_inode].file_size += delta;
+    journal_log(&inodes[parent_inode].file_size, sizeof(int));
+}
+
+// Create a file ('f') or directory ('d') named name in a directory. Returns its inode or -1.
+int create_inode(int parent_inode, const char *name, int size, int permissions, char file_type) {
+    int blocks_needed = (size + sb->block_size - 1) / sb->block_size;
+    rwlock_write_lock(&namespace_lock);
+    if (!is_directory_inode(parent_inode)) {
+        rwlock_write_unlock(&namespace_lock);
+        printf("Error: Inode %d is not a directory\n", parent_inode);
+        return -1;
+    }
+    if (name_index_lookup_in(parent_inode, name) != -1) {
+        rwlock_write_unlock(&namespace_lock);
+        printf("Error: File with name %s already exists\n", name);
+        return -1;
+    }
+    if (__atomic_load_n(&sb->free_blocks, __ATOMIC_RELAXED) < blocks_needed || sb->free_inodes == 0) {
+        rwlock_write_unlock(&namespace_lock);
+        printf("Error: Not enough free space or inodes to create file %s\n", name);
+        return -1;
+    }
+    journal_begin();
+    int inode_number = allocate_inode();
+    if (inode_number == -1) {
+        journal_end();
+        rwlock_write_unlock(&namespace_lock);
+        printf("Error: No free inodes available\n");
+        return -1;
+    }
+    RwLock* lock = inode_lock(inode_number);
+    rwlock_write_lock(lock);
+    inodes[inode_number].extent_count = 0;
+    inodes[inode_number].extent_depth = 0;
+    // Take the whole file as one extent if possible
+    if (inode_grow(inode_number, blocks_needed) < blocks_needed) {
+        inode_free_extents(inode_number, NULL);
+        free_inode(inode_number);
+        journal_end();
+        rwlock_write_unlock(lock);
+        rwlock_write_unlock(&namespace_lock);
+        printf("Error: Failed to allocate blocks for file %s\n", name);
+        return -1;
+    }
+    inodes[inode_number].inode_number = inode_number;
+    inodes[inode_number].file_type = file_type;
+    inodes[inode_number].file_size = size;
+    inodes[inode_number].permissions = permissions;
+    // There is one directory entry per inode, so a free inode means a free entry
+    int slot = allocate_dir_slot();
+    strncpy(directory->entries[slot].name, name, FILE_NAME_LENGTH - 1);
+    directory->entries[slot].name[FILE_NAME_LENGTH - 1] = '\0';
+    directory->entries[slot].inode_number = inode_number;
+    directory->entries[slot].parent_inode = parent_inode;
+    name_index_insert(slot);
+    inodes[inode_number].entry_index = slot;
+    adjust_directory_size(parent_inode, 1);
+    journal_log(&directory->entries[slot], sizeof(DirectoryEntry));
+    sb->free_inodes--;
+    journal_log(&inodes[inode_number], sizeof(inode));
+    journal_log(&sb->free_inodes, sizeof(int));
+    journal_end();
+    rwlock_write_unlock(lock);
+    rwlock_write_unlock(&namespace_lock);
+    return inode_number;
+}
+
+// Create a file in the root directory
+int create_file(const char *filename, int size, int permissions) {
+    return create_inode(ROOT_INODE, filename, size, permissions, 'f');
+}
+
+// Create a file in the directory parent_inode
+int create_file_in(int parent_inode, const char *name, int size, int permissions) {
+    return create_inode(parent_inode, name, size, permissions, 'f');
+}
+
+// Create an empty directory in the directory parent_inode
+int make_directory(int parent_inode, const char *name) {
+    return create_inode(parent_inode, name, 0, 7, 'd');
+}
+
+// Free an inode and its directory entry; caller holds namespace_lock for writing.
+// A directory must be empty. Its blocks are freed now, or queued on batch if it is set.
+// The record carries the inode number rather than the bytes it changes.
+int remove_inode(int inode_number, BlockBatch* batch) {
+    if (inodes[inode_number].file_type == 'd' && inodes[inode_number].file_size > 0) {
+        printf("Error: Directory with inode %d is not empty\n", inode_number);
+        return -1;
+    }
+    int i = inodes[inode_number].entry_index;
+    // Wait for reads and writes in flight on the inode
+    RwLock* lock = inode_lock(inode_number);
+    rwlock_write_lock(lock);
+    journal_begin();
+    inode_release_blocks(inode_number, batch);
+    __atomic_store_n(&inode_nodes[inode_number], NULL, __ATOMIC_RELEASE);
+    name_index_remove(i);
+    unlink_inode_metadata(meta_base, inode_number);
+    if (inode_number < inode_hint) {
+        inode_hint = inode_number;
+    }
+    if (i < slot_hint) {
+        slot_hint = i;
+    }
+    journal_log_unlink(inode_number);
+    journal_end();
+    rwlock_write_unlock(lock);
+    return 0;
+}
+
+// Delete a file
+int delete_file(const char *filename) {
+    rwlock_write_lock(&namespace_lock);
+    int i = name_index_lookup(filename);
+    if (i == -1) {
+        rwlock_write_unlock(&namespace_lock);
+        printf("Error: File %s not found\n", filename);
+        return -1;
+    }
+    int inode_number = directory->entries[i].inode_number;
+    if (inode_number < 0 || inode_number >= sb->inode_count) {
+        rwlock_write_unlock(&namespace_lock);
+        printf("Error: Invalid inode number %d for file %s\n", inode_number, filename);
+        return -1;
+    }
+    int result = remove_inode(inode_number, NULL);
+    rwlock_write_unlock(&namespace_lock);
+    return result;
+}
+
+// Delete the file or empty directory an inode belongs to, without looking up its name
+int unlink_inode(int inode_number) {
+    rwlock_write_lock(&namespace_lock);
+    if (inode_number == ROOT_INODE || inode_number < 0 || inode_number >= sb->inode_count ||
+        inodes[inode_number].inode_number == -1) {
+        rwlock_write_unlock(&namespace_lock);
+        printf("Error: Invalid inode number %d\n", inode_number);
+        return -1;
+    }
+    int result = remove_inode(inode_number, NULL);
+    rwlock_write_unlock(&namespace_lock);
+    return result;
+}
+
+// Delete many files and directories, each directory listed after everything in it, in one
+// transaction whose blocks are freed together at its end. Each inode adds a 16-byte unlink
+// delta at most, and neighbouring inode numbers and block runs share one, so a record holds
+// thousands of inodes. Only a list whose record would pass half the log region is split,
+// where it passes: everything deleted by then was listed before its directory, so a crash
+// between the records leaves part of the subtree, still a valid tree. If removed is set,
+// removed[i] says whether inode_numbers[i] was deleted. Returns how many were deleted.
+int unlink_inodes(const int* inode_numbers, int count, char* removed) {
+    BlockBatch batch = {NULL, 0, 0};
+    int removed_count = 0;
+    rwlock_write_lock(&namespace_lock);
+    journal_begin();
+    for (int i = 0; i < count; i++) {
+        if (journal_depth == 1 &&
+            journal_record_length() + (size_t)batch.count * sizeof(LogDelta) > (size_t)sb->log_size / 2) {
+            free_block_batch(&batch);
+            journal_end();
+            journal_begin();
+        }
+        int inode_number = inode_numbers[i];
+        int deleted = 0;
+        if (inode_number == ROOT_INODE || inode_number < 0 || inode_number >= sb->inode_count ||
+            inodes[inode_number].inode_number == -1) {
+            printf("Error: Invalid inode number %d\n", inode_number);
+        } else {
+            deleted = remove_inode(inode_number, &batch) == 0;
+        }
+        if (removed != NULL) {
+            removed[i] = (char)deleted;
+        }
+        removed_count += deleted;
+    }
+    free_block_batch(&batch);
+    journal_end();
+    rwlock_write_unlock(&namespace_lock);
+    return removed_count;
+}
+
+// Take the directory entries of the inodes behind nodes out of the name index, or put them
+// back, so a subtree waiting to be deleted cannot be found or collide by name
+void index_subtree_entries(DirectoryStruct** nodes, int count, int insert) {
+    rwlock_write_lock(&namespace_lock);
+    for (int i = 0; i < count; i++) {
+        int inode_number = nodes[i]->inode_number;
+        if (inode_number < 0 || inode_number == ROOT_INODE || inode_number >= sb->inode_count ||
+            inodes[inode_number].inode_number == -1 || inodes[inode_number].entry_index == -1) {
+            continue;
+        }
+        int entry_index = inodes[inode_number].entry_index;
+        DirectoryEntry* entry = &directory->entries[entry_index];
+        if (!insert) {
+            name_index_remove(entry_index);
+        } else if (name_index_lookup_in(entry->parent_inode, entry->name) == -1) {
+            name_index_insert(entry_index);
+        }
+    }
+    rwlock_write_unlock(&namespace_lock);
+}
+
+// Find the inode of name in the directory parent_inode, -1 if there is none
+int lookup_inode(int parent_inode, const char *name) {
+    rwlock_read_lock(&namespace_lock);
+    int i = name_index_lookup_in(parent_inode, name);
+    int inode_number = i == -1 ? -1 : directory->entries[i].inode_number;
+    rwlock_read_unlock(&namespace_lock);
+    return inode_number;
+}
+
+// Report an inode's type, size, permissions and times. Returns 0, or -1 if it is not in use.
+int stat_inode(int inode_number, FileStat *stat) {
+    if (inode_number < 0 || inode_number >= sb->inode_count) {
+        return -1;
+    }
+    rwlock_read_lock(&namespace_lock);  // Keeps a directory's entry count and the parent stable
+    RwLock* lock = inode_lock(inode_number);
+    rwlock_read_lock(lock);
+    inode* node = &inodes[inode_number];
+    int in_use = node->inode_number != -1;
+    if (in_use) {
+        stat->inode_number = inode_number;
+        stat->file_type = node->file_type;
+        stat->size = node->file_size;
+        stat->blocks = inode_mapped_blocks(inode_number);
+        stat->permissions = node->permissions;
+        stat->parent_inode = node->entry_index == -1 ? -1 : directory->entries[node->entry_index].parent_inode;
+        for (int i = 0; i < 3; i++) {
+            stat->timestamps[i] = __atomic_load_n(&node->timestamps[i], __ATOMIC_RELAXED);
+        }
+    }
+    rwlock_read_unlock(lock);
+    rwlock_read_unlock(&namespace_lock);
+    return in_use ? 0 : -1;
+}
+
+// Give an inode's entry a new name and directory. A directory cannot move below itself.
+int rename_inode(int inode_number, int new_parent, const char *new_name) {
+    rwlock_write_lock(&namespace_lock);
+    if (inode_number == ROOT_INODE || inode_number < 0 || inode_number >= sb->inode_count ||
+        inodes[inode_number].inode_number == -1 || !is_directory_inode(new_parent)) {
+        rwlock_write_unlock(&namespace_lock);
+        printf("Error: Invalid inode number %d or directory %d\n", inode_number, new_parent);
+        return -1;
+    }
+    if (name_index_lookup_in(new_parent, new_name) != -1) {
+        rwlock_write_unlock(&namespace_lock);
+        printf("Error: File with name %s already exists\n", new_name);
+        return -1;
+    }
+    for (int ancestor = new_parent; ancestor != ROOT_INODE; ancestor = directory->entries[inodes[ancestor].entry_index].parent_inode) {
+        if (ancestor == inode_number) {
+            rwlock_write_unlock(&namespace_lock);
+            printf("Error: Cannot move a directory into itself\n");
+            return -1;
+        }
+    }
+
+    int i = inodes[inode_number].entry_index;
+    journal_begin();
+    name_index_remove(i);
+    adjust_directory_size(directory->entries[i].parent_inode, -1);
+    adjust_directory_size(new_parent, 1);
+    directory->entries[i].parent_inode = new_parent;
+    strncpy(directory->entries[i].name, new_name, FILE_NAME_LENGTH - 1);
+    directory->entries[i].name[FILE_NAME_LENGTH - 1] = '\0';
+    name_index_insert(i);
+    journal_log(&directory->entries[i], sizeof(DirectoryEntry));
+    journal_end();
+    rwlock_write_unlock(&namespace_lock);
+    return 0;
+}
+
+// Give an in-use inode a descriptor; caller holds namespace_lock. -1 for directories
+// and when there are too many open files.
+int open_inode_locked(int inode_number) {
+    if (inodes[inode_number].file_type == 'd') {
+        printf("Error: Inode %d is a directory\n", inode_number);
+        return -1;
+    }
+    int file_descriptor = fd_alloc();
+    if (file_descriptor != -1) {
+        OpenFile* file = fd_slot(file_descriptor);
+        file->current_position = 0;
+        __atomic_store_n(&file->inode_number, inode_number, __ATOMIC_RELEASE);
+        inode_touch_access(inode_number);
+    }
+    return file_descriptor;
+}
+
+// Open a file
+int open_file(const char *filename) {
+    rwlock_read_lock(&namespace_lock);
+    int i = name_index_lookup(filename);
+    if (i == -1) {
+        rwlock_read_unlock(&namespace_lock);
+        return -1;  // File not found
+    }
+    int file_descriptor = open_inode_locked(directory->entries[i].inode_number);
+    rwlock_read_unlock(&namespace_lock);
+    return file_descriptor;
+}
+
+// Open a file by inode, without looking up its name
+int open_inode(int inode_number) {
+    rwlock_read_lock(&namespace_lock);
+    int file_descriptor = -1;
+    if (inode_number < 0 || inode_number >= sb->inode_count || inodes[inode_number].inode_number == -1) {
+        printf("Error: Invalid inode number %d\n", inode_number);
+    } else {
+        file_descriptor = open_inode_locked(inode_number);
+    }
+    rwlock_read_unlock(&namespace_lock);
+    return file_descriptor;
+}
+
+// Close a file
+void close_file(int file_descriptor) {
+    OpenFile* file = fd_slot(file_descriptor);
+    if (file != NULL) {
+        int was_open = __atomic_exchange_n(&file->inode_number, -1, __ATOMIC_ACQ_REL) != -1;
+        if (was_open) {
+            readahead_release(file);
+            fd_release(file_descriptor);
+            printf("File descriptor %d closed successfully\n", file_descriptor);
+        } else {
+            printf("Error: File descriptor %d is not open\n", file_descriptor);
+        }
+    } else {
+        printf("Error: Invalid file descriptor %d\n", file_descriptor);
+    }
+}
+
+// Move a descriptor's position for the next read_file or write_file
+int set_file_position(int file_descriptor, int position) {
+    OpenFile* file = get_open_file(file_descriptor);
+    if (file == NULL || position < 0) {
+        return -1;
+    }
+    file->current_position = position;
+    return 0;
+}
+
+// Function to set file permissions
+void set_permissions(int inode_num, int permissions) {
+    if (inode_num >= 0 && inode_num < sb->inode_count) {
+        rwlock_write_lock(inode_lock(inode_num));
+        journal_begin();
+        inodes[inode_num].permissions = permissions;
+        journal_log(&inodes[inode_num], sizeof(inode));
+        journal_end();
+        rwlock_write_unlock(inode_lock(inode_num));
+    }
+}
+
+// Function to check file permissions
+int check_permissions(int inode_num, int requested_permission) {
+    if (inode_num >= 0 && inode_num < sb->inode_count) {
+        return (inodes[inode_num].permissions & requested_permission) != 0;
+    }
+    return 0;
+}
+
+// Is the descriptor open
+int valid_descriptor(int file_descriptor) {
+    return get_open_file(file_descriptor) != NULL;
+}
+
+// Copy size bytes at position of an inode's data into buffer, straight from the cache frames.
+// seen_block is a logical block the reader has just read, not counted again by the cache, or
+// -1. Caller holds the inode's lock.
+int read_inode_data(int inode_number, int position, char *buffer, int size, int seen_block) {
+    int file_size = inodes[inode_number].file_size;
+    int bytes_to_read = (position + size > file_size) ? (file_size - position) : size;
+    int bytes_read = 0;
+    Extent extent = {0, 0, 0};
+
+    while (bytes_read < bytes_to_read) {
+        int block_index = position / sb->block_size;
+        int block_offset = position % sb->block_size;
+        // Look the mapping up once per extent, not once per block
+        if (block_index >= extent.logical + extent.length || block_index < extent.logical) {
+            if (inode_find_extent(inode_number, block_index, &extent) != 0) {
+                break;
+            }
+        }
+        int block_number = extent.physical + (block_index - extent.logical);
+        int bytes_from_block = sb->block_size - block_offset;
+        if (bytes_from_block > bytes_to_read - bytes_read) {
+            bytes_from_block = bytes_to_read - bytes_read;
+        }
+
+        // Pin the frame so no other thread evicts it during the copy
+        char* block_data = cache_access(block_number, 1, block_index != seen_block);
+        if (block_data == NULL) {
+            break;
+        }
+        memcpy(buffer + bytes_read, block_data + block_offset, bytes_from_block);
+        unpin_block(block_number, 0);
+
+        bytes_read += bytes_from_block;
+        position += bytes_from_block;
+    }
+    return bytes_read;
+}
+
+// Copy size bytes from buffer into an inode's data at position, or zeros if buffer is NULL,
+// mapping blocks as needed. Caller holds the inode's lock for writing.
+int write_inode_range(int inode_number, int position, const char *buffer, int size) {
+    int bytes_written = 0;
+    Extent extent = {0, 0, 0};
+
+    while (bytes_written < size) {
+        int block_index = position / sb->block_size;
+        int block_offset = position % sb->block_size;
+        if (block_index >= extent.logical + extent.length || block_index < extent.logical) {
+            if (block_index >= inode_mapped_blocks(inode_number)) {
+                // Map every block up to the end of this write, as one extent when possible
+                int last_index = (position + (size - bytes_written) - 1) / sb->block_size;
+                if (inode_grow(inode_number, last_index + 1 - inode_mapped_blocks(inode_number)) == 0) {
+                    break;
+                }
+            }
+            if (inode_find_extent(inode_number, block_index, &extent) != 0) {
+                break;
+            }
+        }
+        int block_number = extent.physical + (block_index - extent.logical);
+        int bytes_to_write = sb->block_size - block_offset;
+        if (bytes_to_write > size - bytes_written) {
+            bytes_to_write = size - bytes_written;
+        }
+
+        // Copy straight into the pinned cache frame and mark it dirty
+        char* block_data = pin_block(block_number);
+        if (block_data == NULL) {
+            break;
+        }
+        if (buffer != NULL) {
+            memcpy(block_data + block_offset, buffer + bytes_written, bytes_to_write);
+        } else {
+            memset(block_data + block_offset, 0, bytes_to_write);
+        }
+        unpin_block(block_number, 1);
+
+        bytes_written += bytes_to_write;
+        position += bytes_to_write;
+        if (position > inodes[inode_number].file_size) {
+            tree_account_size(inode_number, position - inodes[inode_number].file_size);
+            inodes[inode_number].file_size = position;
+        }
+    }
+    journal_log(&inodes[inode_number], sizeof(inode));
+    return bytes_written;
+}
+
+// Fill an inode's data with zeros from its end of file up to position, so the gap left by a
+// write past the end reads back as zeros. Caller holds the inode's lock for writing.
+// Returns -1 if the volume ran out of space.
+int zero_inode_gap(int inode_number, int position) {
+    int gap = position - inodes[inode_number].file_size;
+    if (gap <= 0) {
+        return 0;
+    }
+    return write_inode_range(inode_number, inodes[inode_number].file_size, NULL, gap) == gap ? 0 : -1;
+}
+
+// Copy size bytes from buffer into an inode's data at position, allocating blocks as needed
+// and zeroing any gap after the old end of file. Caller holds the inode's lock for writing.
+int write_inode_data(int inode_number, int position, const char *buffer, int size) {
+    inode_data_changed(inode_number);
+    if (size > 0 && zero_inode_gap(inode_number, position) != 0) {
+        return 0;  // Out of space
+    }
+    return write_inode_range(inode_number, position, buffer, size);
+}
+
+// Read from a file at offset, leaving the descriptor's position alone
+int pread_file(int file_descriptor, char *buffer, int size, int offset) {
+    OpenFile* file = get_open_file(file_descriptor);
+    if (file == NULL || offset < 0) {
+        return -1;
+    }
+    int inode_number = file->inode_number;
+    RwLock* lock = inode_lock(inode_number);
+    rwlock_read_lock(lock);
+
+    // Check read permissions
+    if (!check_permissions(inode_number, 4)) { // 4 is read permission
+        rwlock_read_unlock(lock);
+        printf("Error: No read permission for file\n");
+        return -1;
+    }
+
+    int bytes_read = read_inode_data(inode_number, offset, buffer, size, -1);
+    inode_touch_access(inode_number);
+    rwlock_read_unlock(lock);
+    return bytes_read;
+}
+
+// Write to a file at offset, leaving the descriptor's position alone
+int pwrite_file(int file_descriptor, const char *buffer, int size, int offset) {
+    OpenFile* file = get_open_file(file_descriptor);
+    if (file == NULL || offset < 0) {
+        return -1;
+    }
+    int inode_number = file->inode_number;
+    RwLock* lock = inode_lock(inode_number);
+    rwlock_write_lock(lock);
+
+    // Check write permissions
+    if (!check_permissions(inode_number, 2)) { // 2 is write permission
+        rwlock_write_unlock(lock);
+        printf("Error: No write permission for file\n");
+        return -1;
+    }
+
+    journal_begin();
+    int bytes_written = write_inode_data(inode_number, offset, buffer, size);
+    inodes[inode_number].timestamps[1] = time(NULL);  // Update modification time
+    journal_end();
+    rwlock_write_unlock(lock);
+    writeback_throttle();
+    return bytes_written;
+}
+
+// Read from a file at the descriptor's position, reading ahead of sequential streams
+int read_file(int file_descriptor, char *buffer, int size) {
+    OpenFile* file = get_open_file(file_descriptor);
+    if (file == NULL) {
+        return -1;
+    }
+    int inode_number = file->inode_number;
+    RwLock* lock = inode_lock(inode_number);
+    rwlock_read_lock(lock);
+    if (!check_permissions(inode_number, 4)) {
+        rwlock_read_unlock(lock);
+        printf("Error: No read permission for file\n");
+        return -1;
+    }
+
+    int seen_block = readahead_track(file, inode_number, file->current_position, size);
+    int bytes_read = read_inode_data(inode_number, file->current_position, buffer, size, seen_block);
+    file->current_position += bytes_read;
+    inode_touch_access(inode_number);
+    rwlock_read_unlock(lock);
+    return bytes_read;
+}
+
+// Write to a file at the descriptor's position
+int write_file(int file_descriptor, const char *buffer, int size) {
+    OpenFile* file = get_open_file(file_descriptor);
+    if (file == NULL) {
+        return -1;
+    }
+    int bytes_written = pwrite_file(file_descriptor, buffer, size, file->current_position);
+    if (bytes_written > 0) {
+        file->current_position += bytes_written;
+    }
+    return bytes_written;
+}
+
+// Read into a list of buffers, filling each before moving to the next
+int readv_file(int file_descriptor, const FileIoVec *iov, int iov_count) {
+    OpenFile* file = get_open_file(file_descriptor);
+    if (file == NULL) {
+        return -1;
+    }
+    int inode_number = file->inode_number;
+    RwLock* lock = inode_lock(inode_number);
+    rwlock_read_lock(lock);
+    if (!check_permissions(inode_number, 4)) {
+        rwlock_read_unlock(lock);
+        printf("Error: No read permission for file\n");
+        return -1;
+    }
+
+    int length = 0;
+    for (int i = 0; i < iov_count; i++) {
+        length += iov[i].length;
+    }
+    int seen_block = readahead_track(file, inode_number, file->current_position, length);
+    int total = 0;
+    for (int i = 0; i < iov_count; i++) {
+        int bytes_read = read_inode_data(inode_number, file->current_position, iov[i].base, iov[i].length, seen_block);
+        file->current_position += bytes_read;
+        total += bytes_read;
+        if (bytes_read < iov[i].length) {
+            break;  // End of file
+        }
+    }
+    inode_touch_access(inode_number);
+    rwlock_read_unlock(lock);
+    return total;
+}
+
+// Write a list of buffers as one contiguous run of the file
+int writev_file(int file_descriptor, const FileIoVec *iov, int iov_count) {
+    OpenFile* file = get_open_file(file_descriptor);
+    if (file == NULL) {
+        return -1;
+    }
+    int inode_number = file->inode_number;
+    RwLock* lock = inode_lock(inode_number);
+    rwlock_write_lock(lock);
+    if (!check_permissions(inode_number, 2)) {
+        rwlock_write_unlock(lock);
+        printf("Error: No write permission for file\n");
+        return -1;
+    }
+
+    journal_begin();
+    int total = 0;
+    for (int i = 0; i < iov_count; i++) {
+        int bytes_written = write_inode_data(inode_number, file->current_position, iov[i].base, iov[i].length);
+        file->current_position += bytes_written;
+        total += bytes_written;
+        if (bytes_written < iov[i].length) {
+            break;  // Out of space
+        }
+    }
+    inodes[inode_number].timestamps[1] = time(NULL);
+    journal_end();
+    rwlock_write_unlock(lock);
+    writeback_throttle();
+    return total;
+}
+
+// Move size bytes between buffer and an inode's data at position without waiting for the
+// backing store. Blocks resident in the cache are copied now (*copied counts those bytes);
+// runs of other blocks that are contiguous on disk become one request of io each.
+// Caller holds the inode's lock. Returns the bytes covered, short if a block is unmapped.
+int inode_data_async(int inode_number, int opcode, int position, char *buffer, int size, AsyncIo *io, long *copied) {
+    int done = 0;
+    int64_t run_offset = 0;  // Uncached bytes waiting to be queued as one request
+    int run_start = 0;
+    int run_length = 0;
+    Extent extent = {0, 0, 0};
+
+    while (done < size) {
+        int block_index = position / sb->block_size;
+        int block_offset = position % sb->block_size;
+        if (block_index >= extent.logical + extent.length || block_index < extent.logical) {
+            if (inode_find_extent(inode_number, block_index, &extent) != 0) {
+                break;
+            }
+        }
+        int block_number = extent.physical + (block_index - extent.logical);
+        int count = sb->block_size - block_offset;
+        if (count > size - done) {
+            count = size - done;
+        }
+
+        char* block_data = pin_resident_block(block_number);
+        if (block_data != NULL) {
+            if (opcode == IO_READ) {
+                memcpy(buffer + done, block_data + block_offset, count);
+            } else {
+                memcpy(block_data + block_offset, buffer + done, count);
+            }
+            unpin_block(block_number, opcode == IO_WRITE);
+            *copied += count;
+        } else {
+            int64_t offset = sb->data_offset + (int64_t)block_number * sb->block_size + block_offset;
+            if (run_length > 0 && run_offset + run_length != offset) {
+                io_queue(io, opcode, buffer + run_start, run_length, run_offset);
+                run_length = 0;
+            }
+            if (run_length == 0) {
+                run_offset = offset;
+                run_start = done;
+            }
+            run_length += count;
+        }
+        done += count;
+        position += count;
+    }
+    if (run_length > 0) {
+        io_queue(io, opcode, buffer + run_start, run_length, run_offset);
+    }
+    return done;
+}
+
+// Start reading from a file into buffer; io completes once the data is there. The position
+// moves on at once. Returns the bytes requested (short at end of file), or -1 without
+// starting io. buffer must stay valid and the file must not shrink until io completes.
+int read_file_async(int file_descriptor, char *buffer, int size, AsyncIo *io) {
+    OpenFile* file = get_open_file(file_descriptor);
+    if (file == NULL) {
+        return -1;
+    }
+    int inode_number = file->inode_number;
+    RwLock* lock = inode_lock(inode_number);
+    rwlock_read_lock(lock);
+    if (!check_permissions(inode_number, 4)) {
+        rwlock_read_unlock(lock);
+        printf("Error: No read permission for file\n");
+        return -1;
+    }
+
+    int position = file->current_position;
+    int file_size = inodes[inode_number].file_size;
+    int length = position + size > file_size ? file_size - position : size;
+    if (length < 0) {
+        length = 0;
+    }
+    long copied = 0;
+    io_future_hold(io);
+    int covered = inode_data_async(inode_number, IO_READ, position, buffer, length, io, &copied);
+    file->current_position += covered;
+    inode_touch_access(inode_number);
+    rwlock_read_unlock(lock);
+    io_future_release(io, 1, copied);
+    return covered;
+}
+
+// Start writing buffer to a file; io completes once the data has reached the volume or
+// the buffer cache. Blocks are mapped and the new size journaled before this returns.
+// Returns the bytes accepted (short if the volume is full), or -1 without starting io.
+// Overlapping requests, and cached access to blocks being written, may see either version.
+int write_file_async(int file_descriptor, const char *buffer, int size, AsyncIo *io) {
+    OpenFile* file = get_open_file(file_descriptor);
+    if (file == NULL) {
+        return -1;
+    }
+    int inode_number = file->inode_number;
+    RwLock* lock = inode_lock(inode_number);
+    rwlock_write_lock(lock);
+    if (!check_permissions(inode_number, 2)) {
+        rwlock_write_unlock(lock);
+        printf("Error: No write permission for file\n");
+        return -1;
+    }
+
+    journal_begin();
+    inode_data_changed(inode_number);
+    int position = file->current_position;
+    if (size > 0 && zero_inode_gap(inode_number, position) != 0) {
+        journal_end();
+        rwlock_write_unlock(lock);
+        printf("Error: No space to extend the file\n");
+        return -1;
+    }
+    int last_index = size > 0 ? (position + size - 1) / sb->block_size : -1;
+    int mapped = inode_mapped_blocks(inode_number);
+    if (last_index >= mapped) {
+        inode_grow(inode_number, last_index + 1 - mapped);
+    }
+    long copied = 0;
+    io_future_hold(io);
+    int covered = inode_data_async(inode_number, IO_WRITE, position, (char*)buffer, size, io, &copied);
+    file->current_position += covered;
+    if (position + covered > inodes[inode_number].file_size) {
+        tree_account_size(inode_number, position + covered - inodes[inode_number].file_size);
+        inodes[inode_number].file_size = position + covered;
+    }
+    inodes[inode_number].timestamps[1] = time(NULL);
+    journal_log(&inodes[inode_number], sizeof(inode));
+    journal_end();
+    rwlock_write_unlock(lock);
+    io_future_release(io, 1, copied);
+    return covered;
+}
+
+// Lend out the cache block holding the file data at the current position without copying it.
+// Advances the position past the bytes returned. Returns the byte count, 0 at end of file, -1 on error.
+// The block stays pinned in the cache until release_block, so keep few borrows outstanding.
+int borrow_block(int file_descriptor, BlockRef *ref) {
+    ref->data = NULL;
+    ref->length = 0;
+    ref->block_num = -1;
+    OpenFile* file = get_open_file(file_descriptor);
+    if (file == NULL) {
+        return -1;
+    }
+    int inode_number = file->inode_number;
+    RwLock* lock = inode_lock(inode_number);
+    rwlock_read_lock(lock);
+    if (!check_permissions(inode_number, 4)) {
+        rwlock_read_unlock(lock);
+        printf("Error: No read permission for file\n");
+        return -1;
+    }
+
+    int position = file->current_position;
+    if (position >= inodes[inode_number].file_size) {
+        rwlock_read_unlock(lock);
+        return 0;
+    }
+    int block_offset = position % sb->block_size;
+    int block_number = inode_map_block(inode_number, position / sb->block_size);
+    char* block_data = block_number == -1 ? NULL : pin_block(block_number);
+    if (block_data == NULL) {
+        rwlock_read_unlock(lock);
+        return -1;
+    }
+
+    int length = sb->block_size - block_offset;
+    if (length > inodes[inode_number].file_size - position) {
+        length = inodes[inode_number].file_size - position;
+    }
+    ref->data = block_data + block_offset;
+    ref->length = length;
+    ref->block_num = block_number;
+    file->current_position += length;
+    inode_touch_access(inode_number);
+    rwlock_read_unlock(lock);
+    return length;
+}
+
+// Return a block lent out by borrow_block
+void release_block(BlockRef *ref) {
+    if (ref->block_num == -1) {
+        return;
+    }
+    unpin_block(ref->block_num, 0);
+    ref->data = NULL;
+    ref->block_num = -1;
+}
+
+// Rename a file
+int rename_file(const char *old_name, const char *new_name) {
+    rwlock_write_lock(&namespace_lock);
+    int old_index = name_index_lookup(old_name);
+    if (old_index == -1) {
+        rwlock_write_unlock(&namespace_lock);
+        printf("Error: File %s not found\n", old_name);
+        return -1;
+    }
+
+    if (name_index_lookup(new_name) != -1) {
+        rwlock_write_unlock(&namespace_lock);
+        printf("Error: File with name %s already exists\n", new_name);
+        return -1;
+    }
+
+    // Rename the entry in place, moving it to the bucket of its new name
+    journal_begin();
+    name_index_remove(old_index);
+    strncpy(directory->entries[old_index].name, new_name, FILE_NAME_LENGTH - 1);
+    directory->entries[old_index].name[FILE_NAME_LENGTH - 1] = '\0';
+    name_index_insert(old_index);
+    journal_log(&directory->entries[old_index], sizeof(DirectoryEntry));
+    journal_end();
+    rwlock_write_unlock(&namespace_lock);
+
+    printf("File renamed from %s to %s successfully\n", old_name, new_name);
+    return 0;
+}
+
+// Finish the unlinks of a replay over a checkpoint that a crash cut short. Byte ranges and
+// block runs can be applied twice, but part of an unlink may already be on the image: an
+// inode cleared while its entry or bitmap bit is not, or a directory size already lowered.
+// Clear the entries and bits left behind and recount what unlinks change by one.
+void repair_replayed_unlinks() {
+    int used = 0;
+    for (int word = 0; word < (sb->inode_count + 63) / 64; word++) {
+        for (uint64_t bits = inode_bitmap[word]; bits != 0; bits &= bits - 1) {
+            int i = word * 64 + __builtin_ctzll(bits);
+            if (inodes[i].inode_number == -1) {
+                inode_bitmap[word] &= ~(1ULL << (i % 64));
+            } else if (inodes[i].file_type == 'd') {
+                inodes[i].file_size = 0;
+            }
+        }
+        used += __builtin_popcountll(inode_bitmap[word]);
+    }
+    for (int e = 0; e < sb->inode_count; e++) {
+        DirectoryEntry* entry = &directory->entries[e];
+        int n = entry->inode_number;
+        if (n != -1 && (n <= ROOT_INODE || n >= sb->inode_count || inodes[n].inode_number != n || inodes[n].entry_index != e)) {
+            entry->inode_number = -1;
+            memset(entry->name, 0, FILE_NAME_LENGTH);
+            n = -1;
+        }
+        if (n == -1) {
+            slot_bitmap[e / 64] &= ~(1ULL << (e % 64));
+            continue;
+        }
+        slot_bitmap[e / 64] |= 1ULL << (e % 64);
+        inodes[entry->parent_inode].file_size++;
+    }
+    sb->free_inodes = sb->inode_count - used;
+}
+
+// Apply every committed transaction in the log to the image, in LSN order, and move the start
+// of the log past them; runs at mount, before the working copy of the metadata is taken.
+// Stops at the first record that is missing, stale or torn. Returns the number replayed.
+int replay_journal() {
+    int replayed = journal_apply(volume_base + sb->log_offset, sb->log_size, sb->log_start_lsn);
+    if (replayed > 0) {
+        printf("Replayed %d committed transactions from the journal\n", replayed);
+        if (log_unlinks_applied) {
+            repair_replayed_unlinks();
+        }
+        sync_image();
+        sb->log_start_lsn += replayed;
+        sync_volume_range(0, sizeof(superblock));
+    }
+    return replayed;
+}
+
+// Allocate a tree node under parent (if any) for an inode
+DirectoryStruct* new_tree_node(const char* name, DirectoryStruct* parent, int is_directory, int inode_number) {
+    DirectoryStruct* node = node_alloc();
+    const char* interned = node ? intern_name(name, strlen(name)) : NULL;
+    if (interned == NULL) {
+        printf("Error: Memory allocation failed for %s\n", name);
+        if (node != NULL) {
+            node->name = NULL;
+            node->children = NULL;
+            node->child_table = NULL;
+            node_free(node);
+        }
+        return NULL;
+    }
+    NodeCold* cold = node_cold(node);
+    node->name = interned;
+    node->name_len = (int)strlen(interned);
+    node->parent = parent;
+    node->children = NULL;
+    node->child_count = 0;
+    node->child_table = NULL;
+    cold->max_children = 0;
+    cold->child_table_size = 0;
+    cold->permissions = (Permissions){1, 1, 1}; // Default permissions
+    node->is_directory = is_directory;
+    node->inode_number = inode_number;
+    node->subtree_bytes = 0;
+    node->subtree_files = !is_directory;
+    node->subtree_dirs = is_directory;
+    cold->search_id = -1;
+    if (!is_directory && inode_number >= 0) {
+        // Size and map are read and set under the inode lock so no write is accounted twice or lost
+        RwLock* lock = inode_lock(inode_number);
+        rwlock_write_lock(lock);
+        node->subtree_bytes = inodes[inode_number].file_size;
+        __atomic_store_n(&inode_nodes[inode_number], node, __ATOMIC_RELEASE);
+        rwlock_write_unlock(lock);
+    }
+
+    if (parent) {
+        add_child(parent, node);
+    }
+
+    return node;
+}
+
+// Create the root directory
+DirectoryStruct* create_root_dir() {
+    // Every tree made here maps onto the volume's root directory. Only nodes below a root
+    // are searched, so it is never added to the search index.
+    DirectoryStruct* root = new_tree_node("root", NULL, 1, ROOT_INODE);
+    if (root == NULL) {
+        printf("Error: Memory allocation failed for root directory\n");
+    }
+    return root;
+}
+
+// Create the root directory with a tree node for every entry below it on the volume, as
+// after mounting an image. Entries are grouped by directory and the tree built level by level.
+DirectoryStruct* load_root_dir() {
+    DirectoryStruct* root = create_root_dir();
+    int* first = malloc(sb->inode_count * sizeof(int));
+    int* next = malloc(sb->inode_count * sizeof(int));
+    DirectoryStruct** queue = malloc(sb->inode_count * sizeof(DirectoryStruct*));
+    if (root == NULL || first == NULL || next == NULL || queue == NULL) {
+        printf("Error: Memory allocation failed loading the directory tree\n");
+        free(first);
+        free(next);
+        free(queue);
+        if (root != NULL) {
+            node_free(root);
+        }
+        return NULL;
+    }
+    for (int i = 0; i < sb->inode_count; i++) {
+        first[i] = -1;
+    }
+    // Walk backwards so every directory lists its entries in slot order
+    for (int i = sb->inode_count - 1; i >= 0; i--) {
+        int parent_inode = directory->entries[i].parent_inode;
+        if (directory->entries[i].inode_number != -1 && parent_inode >= 0 && parent_inode < sb->inode_count) {
+            next[i] = first[parent_inode];
+            first[parent_inode] = i;
+        }
+    }
+    int head = 0, tail = 0;
+    queue[tail++] = root;
+    while (head < tail) {
+        DirectoryStruct* dir = queue[head++];
+        for (int i = first[dir->inode_number]; i != -1; i = next[i]) {
+            DirectoryEntry* entry = &directory->entries[i];
+            int is_directory = inodes[entry->inode_number].file_type == 'd';
+            DirectoryStruct* node = new_tree_node(entry->name, dir, is_directory, entry->inode_number);
+            if (node != NULL && is_directory && tail < sb->inode_count) {
+                queue[tail++] = node;
+            }
+        }
+    }
+    free(first);
+    free(next);
+    free(queue);
+    return root;
+}
+
+// Create a new directory. Under a parent backed by a directory inode it gets its own
+// inode in the volume; NULL if the volume refuses (name taken, no free inodes).
+DirectoryStruct* create_dir(const char* dir_name, DirectoryStruct* parent) {
+    int inode_number = -1;
+    if (parent != NULL && parent->inode_number >= 0) {
+        inode_number = make_directory(parent->inode_number, dir_name);
+        if (inode_number == -1) {
+            return NULL;
+        }
+    }
+    DirectoryStruct* dir = new_tree_node(dir_name, parent, 1, inode_number);
+    if (dir == NULL && inode_number != -1) {
+        unlink_inode(inode_number);
+    }
+    return dir;
+}
+
+// Create a file in the volume directory behind parent and its node in the tree
+DirectoryStruct* create_file_at(DirectoryStruct* parent, const char* name, int size, int permissions) {
+    if (parent == NULL || parent->inode_number < 0) {
+        printf("Error: %s is not backed by a directory inode\n", parent ? parent->name : "(null)");
+        return NULL;
+    }
+    int inode_number = create_file_in(parent->inode_number, name, size, permissions);
+    if (inode_number == -1) {
+        return NULL;
+    }
+    DirectoryStruct* file = new_tree_node(name, parent, 0, inode_number);
+    if (file == NULL) {
+        unlink_inode(inode_number);
+    }
+    return file;
+}
+
+// Calculate directory size, the bytes of every file below it
+int64_t calculate_directory_size(DirectoryStruct* dir) {
+    return __atomic_load_n(&dir->subtree_bytes, __ATOMIC_RELAXED);
+}
+
+// Move a node and its inode's directory entry under new_parent, keeping its name
+int move_node(DirectoryStruct* node, DirectoryStruct* new_parent) {
+    if (node->parent == NULL) {
+        printf("Error: Cannot move root directory\n");
+        return -1;
+    }
+    if (!new_parent->is_directory) {
+        printf("Error: %s is not a directory\n", new_parent->name);
+        return -1;
+    }
+    for (DirectoryStruct* ancestor = new_parent; ancestor != NULL; ancestor = ancestor->parent) {
+        if (ancestor == node) {
+            printf("Error: Cannot move a directory into itself\n");
+            return -1;
+        }
+    }
+    if (find_directory(new_parent, node->name) != NULL) {
+        printf("Error: A directory or file with name %s already exists\n", node->name);
+        return -1;
+    }
+    if (node->inode_number >= 0 && rename_inode(node->inode_number, new_parent->inode_number, node->name) != 0) {
+        return -1;
+    }
+
+    // Taking the subtree out and adding it back moves its totals along the two paths
+    remove_child(node->parent, node);
+    add_child(new_parent, node);
+    dentry_cache_invalidate();
+    return 0;
+}
+
+// Rename a tree node and the directory entry of its inode, keeping it in the same parent
+int rename_node(DirectoryStruct* node, const char* new_name) {
+    // Check if the node is the root directory
+    if (node->parent == NULL) {
+        printf("Error: Cannot rename root directory\n");
+        return -1;
+    }
+
+    // Check if a directory or file with the new name already exists in the parent directory
+    DirectoryStruct* parent = node->parent;
+    if (find_directory(parent, new_name) != NULL) {
+        printf("Error: A directory or file with name %s already exists\n", new_name);
+        return -1;
+    }
+    const char* interned = intern_name(new_name, strlen(new_name));
+    if (interned == NULL) {
+        printf("Error: Memory allocation failed for %s\n", new_name);
+        return -1;
+    }
+    if (node->inode_number >= 0 && rename_inode(node->inode_number, parent->inode_number, new_name) != 0) {
+        release_name(interned);
+        return -1;
+    }
+
+    // Rename the node, re-hashing it in its parent's index and the search index
+    if (parent->child_table != NULL) {
+        child_table_remove(parent, node);
+    }
+    search_index_remove(node);
+    release_name(node->name);
+    node->name = interned;
+    node->name_len = (int)strlen(interned);
+    search_index_add(node, parent);
+    if (parent->child_table != NULL) {
+        child_table_insert(parent, node);
+    }
+    dentry_cache_invalidate();
+    return 0;
+}
+
+int rename_directory(DirectoryStruct* root, const char* old_path, const char* new_name) {
+    // Find the directory to be renamed
+    DirectoryStruct* dir = navigate_path(root, old_path);
+    if (dir == NULL) {
+        printf("Error: Directory %s not found\n", old_path);
+        return -1;
+    }
+    if (rename_node(dir, new_name) != 0) {
+        return -1;
+    }
+
+    printf("Directory renamed from %s to %s successfully\n", old_path, new_name);
+    return 0;
+}
+
+// Take a node and everything below it out of its tree and list them, each node before its
+// children. The totals above it, the search index and the volume's name index no longer
+// count the subtree; its nodes and inodes stay until reclaim_subtree. Returns the node
+// count, -1 if out of memory.
+int detach_subtree(DirectoryStruct* node, DirectoryStruct*** nodes) {
+    int count = node->subtree_files + node->subtree_dirs;
+    DirectoryStruct** list = malloc(count * sizeof(DirectoryStruct*));
+    if (list == NULL) {
+        printf("Error: Memory allocation failed for deleting %s\n", node->name);
+        return -1;
+    }
+    // Breadth first, the list is its own queue
+    int listed = 0;
+    list[listed++] = node;
+    for (int i = 0; i < listed; i++) {
+        int children = list[i]->child_count;
+        if (children == 0) {
+            continue;
+        }
+        if (listed + children > count) {
+            // The totals lag a tree that changed under them; grow rather than trust them
+            count = (listed + children) * 2;
+            DirectoryStruct** grown = realloc(list, count * sizeof(DirectoryStruct*));
+            if (grown == NULL) {
+                free(list);
+                printf("Error: Memory allocation failed for deleting %s\n", node->name);
+                return -1;
+            }
+            list = grown;
+        }
+        memcpy(list + listed, list[i]->children, children * sizeof(DirectoryStruct*));
+        listed += children;
+    }
+    if (node->parent) {
+        remove_child(node->parent, node);
+    }
+    // Searches walk parent links up from indexed names, so the subtree leaves the index in
+    // the same write hold that cuts its link
+    rwlock_write_lock(&search_lock);
+    node->parent = NULL;  // Writes still landing in the subtree stop at its top
+    search_index_remove_locked(list, listed);
+    rwlock_write_unlock(&search_lock);
+    index_subtree_entries(list, listed, 0);
+    dentry_cache_invalidate();
+    *nodes = list;
+    return listed;
+}
+
+// Delete the inodes behind a list from detach_subtree in one transaction and free the
+// nodes and the list. A node whose inode could not be deleted is kept, since writes to the
+// inode still account through it, and its name goes back in the index. May run on another
+// thread than the one that detached them.
+void reclaim_subtree(DirectoryStruct** nodes, int count) {
+    int* inode_numbers = malloc(count * sizeof(int));
+    char* removed = malloc(count);
+    // Backwards, so every directory comes after what it held. A node whose inode is deleted
+    // is marked with inode number -1.
+    if (inode_numbers != NULL && removed != NULL) {
+        int inode_count = 0;
+        for (int i = count - 1; i >= 0; i--) {
+            if (nodes[i]->inode_number >= 0 && nodes[i]->inode_number != ROOT_INODE) {
+                inode_numbers[inode_count++] = nodes[i]->inode_number;
+            }
+        }
+        if (inode_count > 0) {
+            unlink_inodes(inode_numbers, inode_count, removed);
+        }
+        int next = 0;
+        for (int i = count - 1; i >= 0; i--) {
+            if (nodes[i]->inode_number >= 0 && nodes[i]->inode_number != ROOT_INODE && removed[next++]) {
+                nodes[i]->inode_number = -1;
+            }
+        }
+    } else {
+        for (int i = count - 1; i >= 0; i--) {
+            if (nodes[i]->inode_number >= 0 && nodes[i]->inode_number != ROOT_INODE &&
+                unlink_inode(nodes[i]->inode_number) == 0) {
+                nodes[i]->inode_number = -1;
+            }
+        }
+    }
+    free(inode_numbers);
+    free(removed);
+
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        if (nodes[i]->inode_number >= 0 && nodes[i]->inode_number != ROOT_INODE) {
+            nodes[kept++] = nodes[i];
+        } else {
+            node_free(nodes[i]);
+        }
+    }
+    if (kept > 0) {
+        index_subtree_entries(nodes, kept, 1);
+    }
+    free(nodes);
+}
+
+// Delete a node, everything below it and the inodes behind them, without recursing
+void delete_subtree(DirectoryStruct* node) {
+    DirectoryStruct** nodes;
+    int count = detach_subtree(node, &nodes);
+    if (count > 0) {
+        reclaim_subtree(nodes, count);
+    }
+}
+
+// Delete Directory
+void delete_directory(DirectoryStruct *dir) {
+    if (dir == NULL) return;
+    delete_subtree(dir);
+}
+
+void delete_node(DirectoryStruct* node) {
+    if (node == NULL) {
+        return;
+    }
+    delete_subtree(node);
+}
+
+// Wrapper function to delete by path
+int delete_by_path(DirectoryStruct* root, const char* path) {
+    DirectoryStruct* node = navigate_path(root, path);
+    if (node == NULL) {
+        printf("Error: Path %s not found\n", path);
+        return -1;
+    }
+
+    delete_node(node);
+    printf("%s deleted successfully\n", path);
+    return 0;
+}
+
+// Volume Functions
+
+size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// Check a volume geometry, printing what is wrong with it
+int valid_geometry(int block_size, int block_count, int inode_count) {
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0) {
+        printf("Error: Block size %d is not a power of two from %d to %d\n", block_size, MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        return 0;
+    }
+    if (block_count < 1 || inode_count < 2 || inode_count > (1 << 28)) {  // Inode 0 is the root directory
+        printf("Error: Invalid block count %d or inode count %d\n", block_count, inode_count);
+        return 0;
+    }
+    return 1;
+}
+
+// Fill in the geometry and region offsets of an empty volume
+void volume_layout(superblock* layout, int block_size, int block_count, int inode_count) {
+    memset(layout, 0, sizeof(superblock));
+    layout->magic = FS_MAGIC;
+    layout->version = FS_VERSION;
+    layout->total_blocks = block_count;
+    layout->free_blocks = block_count;
+    layout->block_size = block_size;
+    layout->inode_count = inode_count;
+    layout->free_inodes = inode_count;
+    layout->name_hash_size = 1;
+    while (layout->name_hash_size < inode_count * 2) {
+        layout->name_hash_size *= 2;
+    }
+
+    size_t offset = align_up(sizeof(superblock), 64);
+    layout->bitmap_offset = offset;
+    offset = align_up(offset + (size_t)(block_count + 63) / 64 * sizeof(uint64_t), 64);
+    layout->inode_bitmap_offset = offset;
+    offset = align_up(offset + (size_t)(inode_count + 63) / 64 * sizeof(uint64_t), 64);
+    layout->slot_bitmap_offset = offset;
+    offset = align_up(offset + (size_t)(inode_count + 63) / 64 * sizeof(uint64_t), 64);
+    layout->inode_offset = offset;
+    offset = align_up(offset + (size_t)inode_count * sizeof(inode), 64);
+    layout->directory_offset = offset;
+    offset = align_up(offset + sizeof(Directory) + (size_t)inode_count * sizeof(DirectoryEntry), 64);
+    layout->name_index_offset = offset;
+    offset = offset + (size_t)(layout->name_hash_size + inode_count) * sizeof(int);
+    layout->log_offset = align_up(offset, PAGE_ALIGNMENT);
+    layout->log_size = LOG_SIZE;
+    layout->log_start_lsn = 1;
+    layout->data_offset = layout->log_offset + layout->log_size;
+    layout->volume_size = layout->data_offset + (int64_t)block_count * block_size;
+}
+
+// Point the global tables at the volume at base, its metadata at meta (base itself or a copy)
+void attach_volume(unsigned char* base, unsigned char* meta) {
+    volume_base = base;
+    meta_base = meta;
+    sb = (superblock*)meta;
+    block_bitmap = (uint64_t*)(meta + sb->bitmap_offset);
+    inode_bitmap = (uint64_t*)(meta + sb->inode_bitmap_offset);
+    slot_bitmap = (uint64_t*)(meta + sb->slot_bitmap_offset);
+    inodes = (inode*)(meta + sb->inode_offset);
+    directory = (Directory*)(meta + sb->directory_offset);
+    name_hash_heads = (int*)(meta + sb->name_index_offset);
+    name_hash_next = name_hash_heads + sb->name_hash_size;
+    blocks = base + sb->data_offset;
+}
+
+// Work on a private copy of an image's metadata from now on, so it changes only through the
+// log. The copy is a copy-on-write mapping of the image: a page is copied when it is first
+// written and read from the image until then. A checkpoint only writes bytes the copy has
+// already changed, so the image never changes under a page the copy still shares.
+// Returns -1 if it cannot be mapped.
+int attach_metadata_copy() {
+#ifdef _WIN32
+    void* copy = MapViewOfFile(image_mapping, FILE_MAP_COPY, 0, 0, (SIZE_T)sb->log_offset);
+    if (copy == NULL) {
+#else
+    void* copy = mmap(NULL, (size_t)sb->log_offset, PROT_READ | PROT_WRITE, MAP_PRIVATE, image_fd, 0);
+    if (copy == MAP_FAILED) {
+#endif
+        printf("Error: Cannot map the volume metadata\n");
+        return -1;
+    }
+    attach_volume(volume_base, (unsigned char*)copy);
+    return 0;
+}
+
+// Drop the working copy taken by attach_metadata_copy
+void release_metadata_copy() {
+#ifdef _WIN32
+    UnmapViewOfFile(meta_base);
+#else
+    munmap(meta_base, (size_t)sb->log_offset);
+#endif
+}
+
+// Write what the log does not carry to the image once it is checkpointed at a clean unmount:
+// the access times that changed, and sb->free_blocks marked valid so the next mount can skip
+// the recount. The name index is left stale and rebuilt on first use.
+void write_unlogged_metadata() {
+    inode* image_inodes = (inode*)(volume_base + sb->inode_offset);
+    int first = sb->inode_count;
+    int last = -1;
+    for (int word = 0; word < (sb->inode_count + 63) / 64; word++) {
+        for (uint64_t bits = atime_dirty[word]; bits != 0; bits &= bits - 1) {
+            int i = word * 64 + __builtin_ctzll(bits);
+            image_inodes[i].timestamps[2] = inodes[i].timestamps[2];
+            if (last == -1) {
+                first = i;
+            }
+            last = i;
+        }
+    }
+    if (last != -1) {
+        sync_volume_range(sb->inode_offset + (int64_t)first * sizeof(inode), (int64_t)(last - first + 1) * sizeof(inode));
+    }
+    superblock* header = (superblock*)volume_base;
+    header->free_blocks = sb->free_blocks;
+    header->free_blocks_valid = 1;
+    sync_volume_range(0, sizeof(superblock));
+}
+
+// Count the clear bits of the block bitmap into sb->free_blocks, which is not logged
+void recount_free_blocks() {
+    int used = 0;
+    for (int word = 0; word < (sb->total_blocks + 63) / 64; word++) {
+        used += __builtin_popcountll(block_bitmap[word]);
+    }
+    sb->free_blocks = sb->total_blocks - used;
+}
+
+// Mark every inode and directory entry of the volume free
+void reset_volume_tables() {
+    for (int i = 0; i < sb->inode_count; i++) {
+        inodes[i].inode_number = -1;
+        inodes[i].extent_depth = 0;
+        inodes[i].extent_count = 0;
+    }
+    directory->entry_count = sb->inode_count;
+    for (int i = 0; i < sb->inode_count; i++) {
+        directory->entries[i].inode_number = -1;
+    }
+    memset(inode_bitmap, 0, (size_t)(sb->inode_count + 63) / 64 * sizeof(uint64_t));
+    memset(slot_bitmap, 0, (size_t)(sb->inode_count + 63) / 64 * sizeof(uint64_t));
+    init_name_index();
+    name_index_ready = 1;
+
+    // The root directory is inode ROOT_INODE and has no entry of its own
+    memset(&inodes[ROOT_INODE], 0, sizeof(inode));
+    inodes[ROOT_INODE].inode_number = ROOT_INODE;
+    inodes[ROOT_INODE].file_type = 'd';
+    inodes[ROOT_INODE].permissions = 7;
+    inodes[ROOT_INODE].entry_index = -1;
+    inode_bitmap[ROOT_INODE / 64] |= 1ULL << (ROOT_INODE % 64);
+    sb->free_inodes = sb->inode_count - 1;
+}
+
+// Reset the journal state for the mounted volume (the log region itself is read by replay_journal)
+void init_journal() {
+    log_range_count = 0;
+    log_copy_used = 0;
+    log_delta_bytes = 0;
+    log_allocs.count = 0;
+    log_frees.count = 0;
+    journal_depth = 0;
+    log_buffer_used = 0;
+    log_buffer_records = 0;
+    log_released.count = 0;
+    log_released_blocks = 0;
+    log_tail = 0;
+    log_next_lsn = sb->log_start_lsn;
+    log_durable_lsn = sb->log_start_lsn - 1;
+    memset(&journal_stats, 0, sizeof(journal_stats));
+}
+
+// Allocate zeroed memory for an in-memory volume, backed by huge pages when it is large
+unsigned char* allocate_volume_memory(size_t size) {
+    volume_mapped_size = 0;
+#if defined(__linux__)
+    if (size >= HUGE_PAGE_SIZE) {
+        size_t length = align_up(size, HUGE_PAGE_SIZE);
+        void* base = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if (base == MAP_FAILED) {
+            // No reserved huge pages, fall back to transparent huge pages
+            base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (base == MAP_FAILED) {
+                return NULL;
+            }
+#ifdef MADV_HUGEPAGE
+            madvise(base, length, MADV_HUGEPAGE);
+#endif
+        }
+        volume_mapped_size = length;
+        return (unsigned char*)base;
+    }
+#endif
+    return calloc(1, size);
+}
+
+// Close every open file
+void reset_open_files() {
+    mutex_lock(&fd_lock);
+    for (int i = 0; i < fd_chunk_count; i++) {
+        for (int j = 0; j < FD_CHUNK_SIZE; j++) {
+            readahead_release(&fd_chunks[i][j]);
+        }
+        free(fd_chunks[i]);
+        fd_chunks[i] = NULL;
+    }
+    fd_chunk_count = 0;
+    fd_free_count = 0;
+    __atomic_fetch_add(&fd_generation, 1, __ATOMIC_RELEASE);  // Invalidate every thread's cache
+    mutex_unlock(&fd_lock);
+}
+
+// Map an image file of *size bytes (creating or truncating it) or of its current size
+unsigned char* map_image_file(const char* path, int64_t* size, int create) {
+#ifdef _WIN32
+    image_file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                             create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (image_file == INVALID_HANDLE_VALUE) {
+        printf("Error: Cannot open image %s\n", path);
+        return NULL;
+    }
+    LARGE_INTEGER length;
+    if (create) {
+        length.QuadPart = *size;
+        if (!SetFilePointerEx(image_file, length, NULL, FILE_BEGIN) || !SetEndOfFile(image_file)) {
+            printf("Error: Cannot size image %s\n", path);
+            CloseHandle(image_file);
+            image_file = INVALID_HANDLE_VALUE;
+            return NULL;
+        }
+    } else {
+        GetFileSizeEx(image_file, &length);
+        *size = length.QuadPart;
+    }
+    if (*size < (int64_t)sizeof(superblock)) {
+        printf("Error: %s is too small to be a volume image\n", path);
+        CloseHandle(image_file);
+        image_file = INVALID_HANDLE_VALUE;
+        return NULL;
+    }
+    image_mapping = CreateFileMappingA(image_file, NULL, PAGE_READWRITE, 0, 0, NULL);
+    void* base = image_mapping ? MapViewOfFile(image_mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0) : NULL;
+    if (base == NULL) {
+        printf("Error: Cannot map image %s\n", path);
+        if (image_mapping) CloseHandle(image_mapping);
+        CloseHandle(image_file);
+        image_mapping = NULL;
+        image_file = INVALID_HANDLE_VALUE;
+        return NULL;
+    }
+    return (unsigned char*)base;
+#else
+    image_fd = open(path, create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0644);
+    if (image_fd < 0) {
+        printf("Error: Cannot open image %s\n", path);
+        return NULL;
+    }
+    if (create) {
+        if (ftruncate(image_fd, (off_t)*size) != 0) {
+            printf("Error: Cannot size image %s\n", path);
+            close(image_fd);
+            image_fd = -1;
+            return NULL;
+        }
+    } else {
+        struct stat st;
+        fstat(image_fd, &st);
+        *size = st.st_size;
+    }
+    if (*size < (int64_t)sizeof(superblock)) {
+        printf("Error: %s is too small to be a volume image\n", path);
+        close(image_fd);
+        image_fd = -1;
+        return NULL;
+    }
+    void* base = mmap(NULL, (size_t)*size, PROT_READ | PROT_WRITE, MAP_SHARED, image_fd, 0);
+    if (base == MAP_FAILED) {
+        printf("Error: Cannot map image %s\n", path);
+        close(image_fd);
+        image_fd = -1;
+        return NULL;
+    }
+    return (unsigned char*)base;
+#endif
+}
+
+// Unmap an image mapped by map_image_file and close it
+void unmap_image_file(unsigned char* base, int64_t size) {
+#ifdef _WIN32
+    UnmapViewOfFile(base);
+    CloseHandle(image_mapping);
+    CloseHandle(image_file);
+    image_mapping = NULL;
+    image_file = INVALID_HANDLE_VALUE;
+#else
+    munmap(base, (size_t)size);
+    close(image_fd);
+    image_fd = -1;
+#endif
+}
+
+// Drop the current volume, writing it back first if it is an image
+void release_volume() {
+    if (volume_base == NULL) {
+        return;
+    }
+    stop_writeback();
+    io_drain();
+    if (volume_is_image) {
+        // Everything logged is in the image once the log is checkpointed
+        flush_cache();
+        write_unlogged_metadata();
+        int64_t size = sb->volume_size;
+        release_metadata_copy();
+        unmap_image_file(volume_base, size);
+    } else if (volume_mapped_size != 0) {
+#ifndef _WIN32
+        munmap(volume_base, volume_mapped_size);
+#endif
+        volume_mapped_size = 0;
+    } else {
+        free(volume_base);
+    }
+    volume_base = NULL;
+    meta_base = NULL;
+    volume_is_image = 0;
+    sb = NULL;
+    inodes = NULL;
+    directory = NULL;
+    blocks = NULL;
+    block_bitmap = NULL;
+    inode_bitmap = NULL;
+    slot_bitmap = NULL;
+    name_hash_heads = NULL;
+    name_hash_next = NULL;
+    name_index_ready = 0;
+    free(inode_nodes);
+    inode_nodes = NULL;
+    free(atime_dirty);
+    atime_dirty = NULL;
+}
+
+// Initialise the locks the first time a volume is attached
+void init_locks() {
+    if (locks_ready) {
+        return;
+    }
+    rwlock_init(&namespace_lock);
+    for (int i = 0; i < INODE_LOCK_SHARDS; i++) {
+        rwlock_init(&inode_locks[i].lock);
+    }
+    mutex_init(&alloc_lock);
+    mutex_init(&name_index_lock);
+    mutex_init(&journal_lock);
+    mutex_init(&fd_lock);
+    mutex_init(&io_lock);
+    rwlock_init(&search_lock);
+    mutex_init(&node_lock);
+    mutex_init(&writeback_lock);
+    mutex_init(&flusher_lock);
+    cond_init(&writeback_wake);
+    cond_init(&writeback_progress);
+    locks_ready = 1;
+}
+
+// Set up the runtime state for a volume just attached
+void start_volume(int cache_size) {
+    init_locks();
+    io_engine_start();
+    alloc_hint = 0;
+    inode_hint = 0;
+    slot_hint = 0;
+    inode_nodes = calloc(sb->inode_count, sizeof(DirectoryStruct*));
+    atime_dirty = calloc((size_t)(sb->inode_count + 63) / 64, sizeof(uint64_t));
+    init_cache(cache_size);
+    init_journal();
+    reset_open_files();
+    start_writeback();
+}
+
+// Create (or overwrite) an image file holding an empty volume with the given geometry and mount it
+int format_image(const char* path, int block_size, int block_count, int inode_count, int cache_size) {
+    if (!valid_geometry(block_size, block_count, inode_count)) {
+        return -1;
+    }
+    superblock layout;
+    volume_layout(&layout, block_size, block_count, inode_count);
+    release_volume();
+
+    int64_t size = layout.volume_size;
+    unsigned char* base = map_image_file(path, &size, 1);
+    if (base == NULL) {
+        return -1;
+    }
+    memcpy(base, &layout, sizeof(layout));  // The rest of a new file reads as zeros
+    attach_volume(base, base);
+    volume_is_image = 1;
+    reset_volume_tables();
+    sync_image();
+    if (attach_metadata_copy() != 0) {
+        unmap_image_file(base, size);
+        volume_base = NULL;
+        meta_base = NULL;
+        volume_is_image = 0;
+        return -1;
+    }
+    start_volume(cache_size);
+    return 0;
+}
+
+// Mount an image file written by format_image with a buffer cache of cache_size blocks. Only
+// the superblock is checked and the journal replayed, and the block bitmap is recounted only
+// if the image was not unmounted cleanly; the metadata is mapped copy-on-write to work on and
+// the name index rebuilt when first used, so the cost does not grow with the volume.
+int mount_image(const char* path, int cache_size) {
+    release_volume();
+
+    int64_t size = 0;
+    unsigned char* base = map_image_file(path, &size, 0);
+    if (base == NULL) {
+        return -1;
+    }
+    superblock* header = (superblock*)base;
+    superblock expected;
+    if (header->magic != FS_MAGIC || header->version != FS_VERSION) {
+        printf("Error: %s is not a volume image\n", path);
+    } else if (!valid_geometry(header->block_size, header->total_blocks, header->inode_count)) {
+        printf("Error: %s has a corrupt superblock\n", path);
+    } else {
+        volume_layout(&expected, header->block_size, header->total_blocks, header->inode_count);
+        if (header->name_hash_size != expected.name_hash_size || header->data_offset != expected.data_offset ||
+            header->inode_bitmap_offset != expected.inode_bitmap_offset ||
+            header->slot_bitmap_offset != expected.slot_bitmap_offset ||
+            header->log_offset != expected.log_offset || header->log_size != expected.log_size ||
+            header->volume_size != expected.volume_size || header->volume_size > size) {
+            printf("Error: %s has a corrupt superblock\n", path);
+        } else {
+            attach_volume(base, base);
+            volume_is_image = 1;
+            if (replay_journal() > 0 || !sb->free_blocks_valid) {
+                recount_free_blocks();
+            }
+            sb->free_blocks_valid = 0;  // Until the next clean unmount writes it back
+            sync_volume_range(0, sizeof(superblock));
+            if (attach_metadata_copy() == 0) {
+                start_volume(cache_size);
+                return 0;
+            }
+            volume_base = NULL;
+            meta_base = NULL;
+            volume_is_image = 0;
+        }
+    }
+    unmap_image_file(base, size);
+    return -1;
+}
+
+// Write everything back to the image and unmount it
+void unmount_image() {
+    if (volume_is_image) {
+        release_volume();
+    }
+}
+
+// File System Initialization
+
+// Start a fresh in-memory volume. block_size is a power of two from MIN_BLOCK_SIZE to
+// MAX_BLOCK_SIZE; cache_size is the buffer cache capacity in blocks.
+int format_filesystem(int block_size, int block_count, int inode_count, int cache_size) {
+    if (!valid_geometry(block_size, block_count, inode_count)) {
+        return -1;
+    }
+    superblock layout;
+    volume_layout(&layout, block_size, block_count, inode_count);
+    release_volume();
+
+    unsigned char* base = allocate_volume_memory((size_t)layout.volume_size);
+    if (base == NULL) {
+        printf("Error: Memory allocation failed for the volume\n");
+        return -1;
+    }
+    memcpy(base, &layout, sizeof(layout));
+    attach_volume(base, base);
+    start_volume(cache_size);
+    reset_volume_tables();
+    return 0;
+}
+
+// Start a fresh in-memory volume with the default geometry
+void initialize_filesystem() {
+    format_filesystem(DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_COUNT, DEFAULT_INODE_COUNT, CACHE_SIZE);
 }
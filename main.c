@@ -2,16 +2,53 @@
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #include "filesystem.h" // Include your filesystem header
 
+#define ICON_SIZE 32
+
+// A GtkTreeModel over the children of a DirectoryStruct, or over a list of search results.
+// Rows are read from the nodes on demand, so the view only ever touches the rows it draws.
+#define FS_TYPE_LIST_MODEL (fs_list_model_get_type())
+G_DECLARE_FINAL_TYPE(FsListModel, fs_list_model, FS, LIST_MODEL, GObject)
+
+struct _FsListModel {
+    GObject parent_instance;
+    gint stamp;                  // Changes whenever the rows are replaced, invalidating iters
+    DirectoryStruct *directory;  // Rows are its children unless showing_results is set
+    gboolean showing_results;
+    DirectoryStruct **results;   // Search results owned by the model, grown as batches arrive
+    gint result_count;
+    gint result_capacity;
+};
+
+enum { LIST_COLUMN_ICON, LIST_COLUMN_NAME, LIST_COLUMN_TYPE, LIST_COLUMN_COUNT };
+
 static GtkWidget *window;
 static GtkTreeView *tree_view;
-static GtkListStore *store;
+static FsListModel *list_model;
 static DirectoryStruct *current_directory;
 static DirectoryStruct *root_directory;
 
+// Icons decoded and scaled once by load_icons
 static GdkPixbuf *folder_pixbuf = NULL;
 static GdkPixbuf *file_pixbuf = NULL;
 
-#define ICON_SIZE 32
+// Ids a search worker looks at between two batches it hands to the main loop
+#define SEARCH_SLICE 16384
+
+// Deleted folders with more entries than this are reclaimed on a worker thread
+#define BACKGROUND_RECLAIM_NODES 1024
+
+// Volume image used when none is named on the command line, formatted on first use
+#define DEFAULT_IMAGE "filesystem.img"
+static const char *image_path = DEFAULT_IMAGE;
+
+// Worker threads still using the volume, waited for before it is unmounted
+static GMutex worker_lock;
+static GCond worker_done;
+static gint workers_running = 0;
+
+// The running search, NULL when the list shows a directory
+static GTask *search_task = NULL;
+static GtkProgressBar *search_progress;
 
 
 
@@ -31,47 +68,275 @@ static void show_error_dialog(const gchar *message) {
 
 
 
-// ... (keep existing function declarations)
+/// LIST MODEL
+static void fs_list_model_tree_model_init(GtkTreeModelIface *iface);
 
-/// New function to refresh the file list
-static void refresh_file_list() {
-        // Set the desired icon size
-    int icon_width = 32;
-    int icon_height = 32;
+G_DEFINE_TYPE_WITH_CODE(FsListModel, fs_list_model, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(GTK_TYPE_TREE_MODEL, fs_list_model_tree_model_init))
 
-    gtk_list_store_clear(store);
-    GdkPixbuf *folder_pixbuf = gdk_pixbuf_new_from_file("folder.png", NULL);
-    GdkPixbuf *file_pixbuf = gdk_pixbuf_new_from_file("file.png", NULL);
+static gint list_row_count(FsListModel *model) {
+    if (model->showing_results) {
+        return model->result_count;
+    }
+    return model->directory ? model->directory->child_count : 0;
+}
 
+static DirectoryStruct *list_row(FsListModel *model, gint index) {
+    return model->showing_results ? model->results[index] : model->directory->children[index];
+}
 
-    if (!folder_pixbuf || !file_pixbuf) {
-        show_error_dialog("Failed to load icons.");
-        if (folder_pixbuf) g_object_unref(folder_pixbuf);
-        if (file_pixbuf) g_object_unref(file_pixbuf);
-        return;
+// Point iter at row index, FALSE past the last row
+static gboolean list_make_iter(FsListModel *model, GtkTreeIter *iter, gint index) {
+    if (index < 0 || index >= list_row_count(model)) {
+        iter->stamp = 0;
+        return FALSE;
     }
+    iter->stamp = model->stamp;
+    iter->user_data = GINT_TO_POINTER(index);
+    return TRUE;
+}
+
+static GtkTreeModelFlags list_get_flags(GtkTreeModel *tree_model) {
+    return GTK_TREE_MODEL_LIST_ONLY;
+}
 
-    GdkPixbuf *scaled_folder_pixbuf = gdk_pixbuf_scale_simple(folder_pixbuf, icon_width, icon_height, GDK_INTERP_BILINEAR);
-    GdkPixbuf *scaled_file_pixbuf = gdk_pixbuf_scale_simple(file_pixbuf, icon_width, icon_height, GDK_INTERP_BILINEAR);
+static gint list_get_n_columns(GtkTreeModel *tree_model) {
+    return LIST_COLUMN_COUNT;
+}
+
+static GType list_get_column_type(GtkTreeModel *tree_model, gint column) {
+    return column == LIST_COLUMN_ICON ? GDK_TYPE_PIXBUF : G_TYPE_STRING;
+}
+
+static gboolean list_get_iter(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreePath *path) {
+    if (gtk_tree_path_get_depth(path) != 1) {
+        return FALSE;
+    }
+    return list_make_iter(FS_LIST_MODEL(tree_model), iter, gtk_tree_path_get_indices(path)[0]);
+}
+
+static GtkTreePath *list_get_path(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    return gtk_tree_path_new_from_indices(GPOINTER_TO_INT(iter->user_data), -1);
+}
+
+// Only called for rows the view draws; the name is copied into the GValue
+static void list_get_value(GtkTreeModel *tree_model, GtkTreeIter *iter, gint column, GValue *value) {
+    DirectoryStruct *node = list_row(FS_LIST_MODEL(tree_model), GPOINTER_TO_INT(iter->user_data));
+    g_value_init(value, list_get_column_type(tree_model, column));
+    if (column == LIST_COLUMN_ICON) {
+        g_value_set_object(value, node->is_directory ? folder_pixbuf : file_pixbuf);
+    } else if (column == LIST_COLUMN_NAME) {
+        g_value_set_string(value, node->name);
+    } else {
+        g_value_set_static_string(value, node->is_directory ? "Folder" : "File");
+    }
+}
+
+static gboolean list_iter_next(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    return list_make_iter(FS_LIST_MODEL(tree_model), iter, GPOINTER_TO_INT(iter->user_data) + 1);
+}
+
+static gboolean list_iter_previous(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    return list_make_iter(FS_LIST_MODEL(tree_model), iter, GPOINTER_TO_INT(iter->user_data) - 1);
+}
+
+static gboolean list_iter_children(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *parent) {
+    return parent == NULL && list_make_iter(FS_LIST_MODEL(tree_model), iter, 0);
+}
+
+static gboolean list_iter_has_child(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    return FALSE;
+}
+
+static gint list_iter_n_children(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    return iter == NULL ? list_row_count(FS_LIST_MODEL(tree_model)) : 0;
+}
+
+static gboolean list_iter_nth_child(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *parent, gint n) {
+    return parent == NULL && list_make_iter(FS_LIST_MODEL(tree_model), iter, n);
+}
+
+static gboolean list_iter_parent(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *child) {
+    return FALSE;
+}
+
+static void fs_list_model_tree_model_init(GtkTreeModelIface *iface) {
+    iface->get_flags = list_get_flags;
+    iface->get_n_columns = list_get_n_columns;
+    iface->get_column_type = list_get_column_type;
+    iface->get_iter = list_get_iter;
+    iface->get_path = list_get_path;
+    iface->get_value = list_get_value;
+    iface->iter_next = list_iter_next;
+    iface->iter_previous = list_iter_previous;
+    iface->iter_children = list_iter_children;
+    iface->iter_has_child = list_iter_has_child;
+    iface->iter_n_children = list_iter_n_children;
+    iface->iter_nth_child = list_iter_nth_child;
+    iface->iter_parent = list_iter_parent;
+}
+
+static void fs_list_model_finalize(GObject *object) {
+    free(FS_LIST_MODEL(object)->results);
+    G_OBJECT_CLASS(fs_list_model_parent_class)->finalize(object);
+}
+
+static void fs_list_model_class_init(FsListModelClass *klass) {
+    G_OBJECT_CLASS(klass)->finalize = fs_list_model_finalize;
+}
 
-    // Populate the list with files and directories in the current directory
-    for (int i = 0; i < current_directory->child_count; i++) {
+static void fs_list_model_init(FsListModel *model) {
+    model->stamp = g_random_int();
+}
+
+// Replace every row: the view is detached meanwhile so it rebuilds its row index in one
+// pass instead of handling a signal per row
+static void list_model_replace(DirectoryStruct *directory, gboolean showing_results) {
+    gtk_tree_view_set_model(tree_view, NULL);
+    free(list_model->results);
+    list_model->directory = directory;
+    list_model->showing_results = showing_results;
+    list_model->results = NULL;
+    list_model->result_count = 0;
+    list_model->result_capacity = 0;
+    list_model->stamp++;
+    gtk_tree_view_set_model(tree_view, GTK_TREE_MODEL(list_model));
+}
+
+// List the children of directory
+static void list_model_reset(DirectoryStruct *directory) {
+    list_model_replace(directory, FALSE);
+}
+
+// Start an empty list of search results for list_model_append to fill
+static void list_model_show_results() {
+    list_model_replace(NULL, TRUE);
+}
+
+// Add a batch of search results after the rows already shown
+static void list_model_append(DirectoryStruct **nodes, gint count) {
+    if (count == 0) {
+        return;
+    }
+    if (list_model->result_count + count > list_model->result_capacity) {
+        gint capacity = list_model->result_capacity ? list_model->result_capacity : 256;
+        while (capacity < list_model->result_count + count) {
+            capacity *= 2;
+        }
+        list_model->results = realloc(list_model->results, capacity * sizeof(DirectoryStruct *));
+        list_model->result_capacity = capacity;
+    }
+    memcpy(list_model->results + list_model->result_count, nodes, count * sizeof(DirectoryStruct *));
+    for (gint i = 0; i < count; i++) {
         GtkTreeIter iter;
-        gtk_list_store_append(store, &iter);
+        gint index = list_model->result_count++;
+        list_make_iter(list_model, &iter, index);
+        GtkTreePath *path = gtk_tree_path_new_from_indices(index, -1);
+        gtk_tree_model_row_inserted(GTK_TREE_MODEL(list_model), path, &iter);
+        gtk_tree_path_free(path);
+    }
+}
+
+// Is the list showing the children of dir
+static gboolean list_model_shows(DirectoryStruct *dir) {
+    return !list_model->showing_results && list_model->directory == dir;
+}
+
+// Row of a node in the list, -1 if it is not shown. A listed directory's rows are its
+// children in order, so only search results are scanned.
+static gint list_model_index_of(DirectoryStruct *node) {
+    if (!list_model->showing_results) {
+        return node->parent == list_model->directory ? node_cold(node)->child_index : -1;
+    }
+    for (gint i = 0; i < list_row_count(list_model); i++) {
+        if (list_row(list_model, i) == node) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Node shown in a row. Search results come from anywhere under the folder searched, so
+// a row's name alone does not find its node in the current directory.
+static DirectoryStruct *list_iter_node(GtkTreeIter *iter) {
+    return list_row(list_model, GPOINTER_TO_INT(iter->user_data));
+}
+
+static void cancel_search();
+
+static void worker_started() {
+    g_mutex_lock(&worker_lock);
+    workers_running++;
+    g_mutex_unlock(&worker_lock);
+}
 
-        const char* item_type = current_directory->children[i]->is_directory ? "Folder" : "File";
-        GdkPixbuf *icon = current_directory->children[i]->is_directory ? scaled_folder_pixbuf : scaled_file_pixbuf;
+static void worker_finished() {
+    g_mutex_lock(&worker_lock);
+    if (--workers_running == 0) {
+        g_cond_broadcast(&worker_done);
+    }
+    g_mutex_unlock(&worker_lock);
+}
 
+static void wait_for_workers() {
+    g_mutex_lock(&worker_lock);
+    while (workers_running > 0) {
+        g_cond_wait(&worker_done, &worker_lock);
+    }
+    g_mutex_unlock(&worker_lock);
+}
+
+/// New function to refresh the file list
+static void refresh_file_list() {
+    cancel_search();
+    list_model_reset(current_directory);
+}
+
+// Show a node just added to its parent, add_child put it last
+static void list_node_added(DirectoryStruct *node) {
+    if (!list_model_shows(node->parent)) {
+        refresh_file_list();
+        return;
+    }
+    GtkTreeIter iter;
+    gint index = node->parent->child_count - 1;
+    list_make_iter(list_model, &iter, index);
+    GtkTreePath *path = gtk_tree_path_new_from_indices(index, -1);
+    gtk_tree_model_row_inserted(GTK_TREE_MODEL(list_model), path, &iter);
+    gtk_tree_path_free(path);
+}
 
-        gtk_list_store_set(store, &iter,
-                           0, icon,
-                           1, current_directory->children[i]->name,
-                           2, item_type,
-                           -1);
+// Drop the row a node had before it was deleted (index from list_model_index_of). The
+// folder's last child took the node's place, so the last row goes and the node's is redrawn.
+static void list_node_removed(gint index) {
+    if (index < 0 || list_model->showing_results) {
+        refresh_file_list();  // Results may hold nodes from inside a deleted folder
+        return;
+    }
+    gint last = list_row_count(list_model);
+    GtkTreePath *path = gtk_tree_path_new_from_indices(last, -1);
+    gtk_tree_model_row_deleted(GTK_TREE_MODEL(list_model), path);
+    gtk_tree_path_free(path);
+    if (index < last) {
+        GtkTreeIter iter;
+        list_make_iter(list_model, &iter, index);
+        path = gtk_tree_path_new_from_indices(index, -1);
+        gtk_tree_model_row_changed(GTK_TREE_MODEL(list_model), path, &iter);
+        gtk_tree_path_free(path);
     }
-    g_object_unref(folder_pixbuf);
-    g_object_unref(file_pixbuf);
+}
 
+// Redraw the row of a node whose name changed
+static void list_node_changed(DirectoryStruct *node) {
+    gint index = list_model_index_of(node);
+    if (index < 0) {
+        return;
+    }
+    GtkTreeIter iter;
+    list_make_iter(list_model, &iter, index);
+    GtkTreePath *path = gtk_tree_path_new_from_indices(index, -1);
+    gtk_tree_model_row_changed(GTK_TREE_MODEL(list_model), path, &iter);
+    gtk_tree_path_free(path);
 }
 
 
@@ -87,35 +352,28 @@ static void on_back_clicked(GtkWidget *widget, gpointer data) {
 /// ON FILE CLICKED
 static void on_file_clicked(GtkTreeView *tree_view, GtkTreePath *path, GtkTreeViewColumn *column, gpointer user_data) {
     GtkTreeIter iter;
-    gchar *icon, *name, *type;
+    gchar *name, *type;
     GtkTreeModel *model = gtk_tree_view_get_model(tree_view);
 
     if (gtk_tree_model_get_iter(model, &iter, path)) {
-        gtk_tree_model_get(model, &iter, 0,&icon, 1, &name, 2, &type, -1);
+        gtk_tree_model_get(model, &iter, LIST_COLUMN_NAME, &name, LIST_COLUMN_TYPE, &type, -1);
+        DirectoryStruct *node = list_iter_node(&iter);
 
         if (strcmp(type, "Folder") == 0) {
-            DirectoryStruct *new_dir = find_directory(current_directory, name);
-            if (new_dir) {
-                current_directory = new_dir;
-                refresh_file_list();
-            } else {
-                show_error_dialog("Failed to change directory.");
-            }
+            current_directory = node;
+            refresh_file_list();
         } else {
-            int file_descriptor = open_file(name);
+            int file_descriptor = open_inode(node->inode_number);
             if (file_descriptor != -1) {
-                char buffer[50];
+                char buffer[BUFFER_SIZE];
                 int bytes_read = read_file(file_descriptor, buffer, BUFFER_SIZE);
-                buffer[bytes_read] = '\0';
-                char str[20];
-                sprintf(str, "%d", bytes_read);
                 if (bytes_read > 0) {
                     // Display file contents (you might want to create a new window for this)
                     GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(window),
                                                                GTK_DIALOG_DESTROY_WITH_PARENT,
                                                                GTK_MESSAGE_INFO,
                                                                GTK_BUTTONS_OK,
-                                                               "File contents:\n%.*s", "testing file", buffer);
+                                                               "File contents:\n%.*s", bytes_read, buffer);
                     gtk_dialog_run(GTK_DIALOG(dialog));
                     gtk_widget_destroy(dialog);
                 }
@@ -160,7 +418,7 @@ static void on_create_folder(GtkWidget *widget, gpointer data) {
         if (strlen(folder_name) > 0) {
             DirectoryStruct *new_dir = create_dir(folder_name, current_directory);
             if (new_dir) {
-                refresh_file_list();
+                list_node_added(new_dir);
             } else {
                 show_error_dialog("Failed to create folder.");
             }
@@ -173,6 +431,41 @@ static void on_create_folder(GtkWidget *widget, gpointer data) {
 }
 
 
+// A folder taken out of the tree whose inodes and nodes are still to be freed
+typedef struct {
+    DirectoryStruct **nodes;
+    int count;
+} Reclaim;
+
+static void reclaim_worker(GTask *task, gpointer source, gpointer data, GCancellable *cancellable) {
+    Reclaim *reclaim = data;
+    reclaim_subtree(reclaim->nodes, reclaim->count);
+    g_task_return_boolean(task, TRUE);
+    worker_finished();
+}
+
+// Delete a folder and everything in it. It leaves the tree at once; freeing a large one's
+// space and nodes happens on a worker thread so the window does not wait for it.
+static void delete_folder(DirectoryStruct *dir) {
+    DirectoryStruct **nodes;
+    int count = detach_subtree(dir, &nodes);
+    if (count <= 0) {
+        return;
+    }
+    if (count <= BACKGROUND_RECLAIM_NODES) {
+        reclaim_subtree(nodes, count);
+        return;
+    }
+    Reclaim *reclaim = g_new(Reclaim, 1);
+    reclaim->nodes = nodes;
+    reclaim->count = count;
+    GTask *task = g_task_new(NULL, NULL, NULL, NULL);
+    g_task_set_task_data(task, reclaim, g_free);
+    worker_started();
+    g_task_run_in_thread(task, reclaim_worker);
+    g_object_unref(task);
+}
+
 /// ON DELETE
 static void on_delete(GtkWidget *widget, gpointer data) {
     GtkTreeSelection *selection;
@@ -184,7 +477,8 @@ static void on_delete(GtkWidget *widget, gpointer data) {
         gchar *name = NULL;
         gchar *type = NULL;
 
-        gtk_tree_model_get(model, &iter, 1, &name, 2, &type, -1);
+        gtk_tree_model_get(model, &iter, LIST_COLUMN_NAME, &name, LIST_COLUMN_TYPE, &type, -1);
+        DirectoryStruct *node = list_iter_node(&iter);
 
         GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(window),
                                                    GTK_DIALOG_DESTROY_WITH_PARENT,
@@ -194,25 +488,16 @@ static void on_delete(GtkWidget *widget, gpointer data) {
         gint result = gtk_dialog_run(GTK_DIALOG(dialog));
 
         if (result == GTK_RESPONSE_YES) {
+            cancel_search();  // Batches still queued may hold the nodes about to be freed
+            gint index = list_model_index_of(node);
             if (strcmp(type, "File") == 0) {
-                delete_file(name);
+                delete_node(node);
                 g_print("deleted successfuly");
-                refresh_file_list();
-
             } else {
-                DirectoryStruct *dir_to_delete = find_directory(current_directory, name);
-                if (dir_to_delete) {
-                    delete_directory(dir_to_delete);
-                    g_print("Directory %s deleted successfully.\n", name);
-                } else {
-                    show_error_dialog("Error: Directory not found.");
-                }
-
-                refresh_file_list();
-
-                // The delete_file function already prints success or error messages
+                delete_folder(node);
+                g_print("Directory %s deleted successfully.\n", name);
             }
-            refresh_file_list();
+            list_node_removed(index);
         }
 
         gtk_widget_destroy(dialog);
@@ -267,28 +552,10 @@ static void on_create_file(GtkWidget *widget, gpointer data) {
         if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(execute_checkbox))) permissions |= 1;
 
         if (strlen(file_name) > 0) {
-            // Assuming create_file function exists in your filesystem.h
-            int inode_number = create_file(file_name, 100, permissions);  // Creating an empty file
-            if (inode_number != -1) {
-                // Add the new file to the current directory
-                DirectoryStruct *new_file = malloc(sizeof(DirectoryStruct));
-                strcpy(new_file->name, file_name);
-                new_file->parent = current_directory;
-                new_file->children = NULL;
-                new_file->child_count = 0;
-                new_file->max_children = 0;
-                new_file->is_directory = 0;
-                new_file->inode_number = inode_number;
-                set_permissions(inode_number, permissions);
-
-                // Add to current directory's children
-                if (current_directory->child_count >= current_directory->max_children) {
-                    current_directory->max_children = current_directory->max_children ? current_directory->max_children * 2 : 1;
-                    current_directory->children = realloc(current_directory->children, current_directory->max_children * sizeof(DirectoryStruct*));
-                }
-                current_directory->children[current_directory->child_count++] = new_file;
-
-                refresh_file_list();
+            // Create the file in the current directory, inode and tree node together
+            DirectoryStruct *new_file = create_file_at(current_directory, file_name, 100, permissions);
+            if (new_file != NULL) {
+                list_node_added(new_file);
             } else {
                 show_error_dialog("Failed to create file.");
             }
@@ -317,7 +584,7 @@ int write_file_by_path(DirectoryStruct *root, const char *path, const char *text
         return -2; // Error: no write permission
     }
 
-    int fd = open_file(file_node->name);
+    int fd = open_inode(inode_number);
     if (fd == -1) {
         return -3; // Error: failed to open file
     }
@@ -331,15 +598,16 @@ int write_file_by_path(DirectoryStruct *root, const char *path, const char *text
 }
 
 
-void write_to_file(GtkWidget *widget, gpointer data, DirectoryStruct *current_directory) {
+static void write_to_file(GtkWidget *widget, gpointer data) {
     GtkTreeSelection *selection = gtk_tree_view_get_selection(GTK_TREE_VIEW(tree_view));
     GtkTreeModel *model;
     GtkTreeIter iter;
 
     if (gtk_tree_selection_get_selected(selection, &model, &iter)) {
         // 1. Get Selected Item Info:
-        gchar *name, *icon, *type; // Assuming columns are: 0: Icon, 1: Name, 2: Type
-        gtk_tree_model_get(model, &iter, 0, &icon, 1, &name, 2, &type, -1);
+        gchar *name, *type;
+        gtk_tree_model_get(model, &iter, LIST_COLUMN_NAME, &name, LIST_COLUMN_TYPE, &type, -1);
+        DirectoryStruct *file_node = list_iter_node(&iter);
 
         // 2. Check if Folder or File:
         if (strcmp(type, "Folder") == 0) { // Or whatever string you use to denote folders
@@ -375,7 +643,7 @@ void write_to_file(GtkWidget *widget, gpointer data, DirectoryStruct *current_di
             if (strlen(text_to_write) == 0) {
                 show_error_dialog("Text to write cannot be empty.");
             } else {
-                int fd = open_file(name);
+                int fd = open_inode(file_node->inode_number);
                 if (fd != -1) {
                     int bytes_written = write_file(fd, text_to_write, strlen(text_to_write));
                     close_file(fd);
@@ -393,8 +661,7 @@ void write_to_file(GtkWidget *widget, gpointer data, DirectoryStruct *current_di
                 gtk_widget_destroy(dialog);
         }
 
-        g_free(icon); // Free memory allocated by gtk_tree_model_get
-        g_free(name);
+        g_free(name); // Free memory allocated by gtk_tree_model_get
         g_free(type);
     } else {
         show_error_dialog("No item selected.");
@@ -412,11 +679,11 @@ static void on_rename(GtkWidget *widget, gpointer data) {
     // Get the selection from the tree view
     selection = gtk_tree_view_get_selection(tree_view);
     if (gtk_tree_selection_get_selected(selection, &model, &iter)) {
-        gchar *name, *icon, *type;
-        gboolean is_directory;
+        gchar *name, *type;
 
         // Retrieve the current name and type (file or directory) of the selected item
-        gtk_tree_model_get(model, &iter, 0, &icon, 1, &name, 2, &type, -1);
+        gtk_tree_model_get(model, &iter, LIST_COLUMN_NAME, &name, LIST_COLUMN_TYPE, &type, -1);
+        DirectoryStruct *node = list_iter_node(&iter);
 
         GtkWidget *dialog;
         GtkWidget *content_area;
@@ -448,14 +715,14 @@ static void on_rename(GtkWidget *widget, gpointer data) {
 
         if (strlen(new_name) > 0 && strcmp(name, new_name) != 0) {
             if (strcmp(type, "Folder") == 0){
-                if (rename_directory(root_directory, name, new_name) == 0) {
-                    refresh_file_list();
+                if (rename_node(node, new_name) == 0) {
+                    list_node_changed(node);
                 } else {
                     show_error_dialog("Failed to rename directory.");
                 }
             } else {
-                if (rename_file(name, new_name) == 0) {
-                    refresh_file_list();
+                if (rename_node(node, new_name) == 0) {
+                    list_node_changed(node);
                 } else {
                     show_error_dialog("Failed to rename file.");
                 }
@@ -466,7 +733,6 @@ static void on_rename(GtkWidget *widget, gpointer data) {
         // Destroy the dialog and free memory
         gtk_widget_destroy(dialog);
         g_free(name);
-        g_free(icon);
         g_free(type);
     } else {
         // Show an error dialog if no item is selected
@@ -478,39 +744,210 @@ static GdkPixbuf* resize_pixbuf(GdkPixbuf *original, int width, int height) {
     return gdk_pixbuf_scale_simple(original, width, height, GDK_INTERP_BILINEAR);
 }
 
+// Decode and scale the list icons once; every row shares them
+static gboolean load_icons() {
+    GdkPixbuf *original_folder_pixbuf = gdk_pixbuf_new_from_file("folder.png", NULL);
+    GdkPixbuf *original_file_pixbuf = gdk_pixbuf_new_from_file("file.png", NULL);
+
+    if (!original_folder_pixbuf || !original_file_pixbuf) {
+        show_error_dialog("Failed to load icons.");
+        if (original_folder_pixbuf) g_object_unref(original_folder_pixbuf);
+        if (original_file_pixbuf) g_object_unref(original_file_pixbuf);
+        return FALSE;
+    }
+
+    folder_pixbuf = resize_pixbuf(original_folder_pixbuf, ICON_SIZE, ICON_SIZE);
+    file_pixbuf = resize_pixbuf(original_file_pixbuf, ICON_SIZE, ICON_SIZE);
+
+    // Free the original pixbufs as we don't need them anymore
+    g_object_unref(original_folder_pixbuf);
+    g_object_unref(original_file_pixbuf);
+
+    if (!folder_pixbuf || !file_pixbuf) {
+        show_error_dialog("Failed to resize icons.");
+        return FALSE;
+    }
+    return TRUE;
+}
+
 
 /// ON SEARCH
-static void search_directory(DirectoryStruct *dir, const char *search_term) {
-    for (int i = 0; i < dir->child_count; i++) {
-        if (strstr(dir->children[i]->name, search_term) != NULL) {
-            GtkTreeIter iter;
-            gtk_list_store_append(store, &iter);
-
-            const char* item_type = dir->children[i]->is_directory ? "Folder" : "File";
-            GdkPixbuf *icon = dir->children[i]->is_directory ? folder_pixbuf : file_pixbuf;
-
-            if (icon) {
-                gtk_list_store_set(store, &iter,
-                                   0, icon,
-                                   1, dir->children[i]->name,
-                                   2, item_type,
-                                   -1);
+// Longest run of characters every match of a glob (or regular expression) must contain
+static void pattern_literal(const char *pattern, int is_regex, char *literal, size_t size) {
+    const char *special = is_regex ? ".^$*+?[]{}\\" : "*?";
+    size_t best = 0, run = 0;
+    literal[0] = '\0';
+    if (is_regex && strpbrk(pattern, "(|") != NULL) {
+        return;  // Groups and alternatives can make any text optional
+    }
+    for (const char *p = pattern;; p++) {
+        // A character made optional by the quantifier after it ends the run before it
+        int optional = is_regex && *p != '\0' && p[1] != '\0' && strchr("*?{", p[1]) != NULL;
+        if (*p == '\0' || strchr(special, *p) != NULL || optional) {
+            if (run > best && run < size) {
+                best = run;
+                memcpy(literal, p - run, run);
+                literal[run] = '\0';
+            }
+            run = 0;
+            if (*p == '\0') {
+                break;
+            }
+            if (is_regex && *p == '\\' && p[1] != '\0') {
+                p++;  // Escapes are left to the regex check
+            } else if (is_regex && (*p == '[' || *p == '{')) {
+                // Skip a character class or repeat count, a class may start with ]
+                char close = *p == '[' ? ']' : '}';
+                const char *end = strchr(p + 1 + (*p == '[' && p[1] == ']'), close);
+                if (end == NULL) {
+                    break;
+                }
+                p = end;
+            }
+        } else {
+            run++;
+        }
+    }
+}
+
+// What a search worker looks for: names holding literal, then passing regex or glob if set
+typedef struct {
+    DirectoryStruct *scope;
+    char literal[FILE_NAME_LENGTH];
+    GRegex *regex;
+    GPatternSpec *glob;
+} SearchJob;
+
+static void search_job_free(gpointer data) {
+    SearchJob *job = data;
+    if (job->regex) {
+        g_regex_unref(job->regex);
+    }
+    if (job->glob) {
+        g_pattern_spec_free(job->glob);
+    }
+    g_free(job);
+}
+
+// SearchFilter for a job, run by search_names_next under the search lock
+static int search_job_accepts(const DirectoryStruct *node, void *context) {
+    SearchJob *job = context;
+    return !(job->regex && !g_regex_match(job->regex, node->name, 0, NULL)) &&
+           !(job->glob && !g_pattern_match_string(job->glob, node->name));
+}
+
+// Matches from one slice, handed from the worker to the main loop
+typedef struct {
+    GTask *task;            // Reference on the search that produced the batch
+    DirectoryStruct **nodes;
+    int count;
+    gboolean restart;       // The index was rebuilt, drop the rows shown so far
+    gboolean done;          // Last batch of the search
+    gdouble progress;
+} SearchBatch;
+
+// Show a batch on the main loop, unless its search has since been cancelled or replaced
+static gboolean search_batch_ready(gpointer data) {
+    SearchBatch *batch = data;
+    if (batch->task == search_task && !g_cancellable_is_cancelled(g_task_get_cancellable(batch->task))) {
+        if (batch->restart) {
+            list_model_show_results();
+        }
+        list_model_append(batch->nodes, batch->count);
+        gtk_progress_bar_set_fraction(search_progress, batch->progress);
+        if (batch->done) {
+            if (list_model->result_count == 0) {
+                gtk_progress_bar_set_text(search_progress, "No matching files or folders found.");
             } else {
-                // If icon is NULL, skip setting the icon
-                gtk_list_store_set(store, &iter,
-                                   1, dir->children[i]->name,
-                                   2, item_type,
-                                   -1);
+                gchar *text = g_strdup_printf("%d found", list_model->result_count);
+                gtk_progress_bar_set_text(search_progress, text);
+                g_free(text);
             }
+            g_clear_object(&search_task);
         }
+    }
+    free(batch->nodes);
+    g_object_unref(batch->task);
+    g_free(batch);
+    return G_SOURCE_REMOVE;
+}
 
-        if (dir->children[i]->is_directory) {
-            search_directory(dir->children[i], search_term);
+// Worker thread: search the index a slice at a time, posting each slice's matches, until
+// every id is seen or the search is cancelled
+static void search_worker(GTask *task, gpointer source, gpointer data, GCancellable *cancellable) {
+    SearchJob *job = data;
+    SearchCursor cursor;
+    search_cursor_start(&cursor);
+    gboolean done = FALSE;
+    while (!done && !g_cancellable_is_cancelled(cancellable)) {
+        SearchBatch *batch = g_new0(SearchBatch, 1);
+        batch->count = search_names_next(&cursor, job->scope, job->literal, SEARCH_SLICE,
+                                         search_job_accepts, job, &batch->nodes);
+        if (batch->count < 0) {
+            batch->count = 0;
+            batch->restart = TRUE;
         }
+        done = search_cursor_done(&cursor);
+        batch->done = done;
+        batch->progress = cursor.id_count ? (gdouble)cursor.next_id / cursor.id_count : 1.0;
+        batch->task = g_object_ref(task);
+        g_idle_add(search_batch_ready, batch);
+    }
+    g_task_return_boolean(task, done);
+    worker_finished();
+}
+
+// Stop the running search, if any, and hide its progress; batches it already posted are
+// dropped when they arrive
+static void cancel_search() {
+    gtk_widget_hide(GTK_WIDGET(search_progress));
+    if (search_task == NULL) {
+        return;
     }
+    g_cancellable_cancel(g_task_get_cancellable(search_task));
+    g_clear_object(&search_task);
+}
+
+// Search names under dir on a worker thread, the list filling in as matches arrive. "/expr/"
+// is a regular expression, a term with * or ? a glob over the whole name, anything else a
+// substring.
+static void start_search(DirectoryStruct *dir, const char *search_term) {
+    size_t length = strlen(search_term);
+    int is_regex = length >= 2 && search_term[0] == '/' && search_term[length - 1] == '/';
+    int is_glob = !is_regex && strpbrk(search_term, "*?") != NULL;
+    SearchJob *job = g_new0(SearchJob, 1);
+    job->scope = dir;
+
+    cancel_search();
+    list_model_show_results();
+    if (is_regex) {
+        gchar *expression = g_strndup(search_term + 1, length - 2);
+        job->regex = g_regex_new(expression, 0, 0, NULL);
+        pattern_literal(expression, 1, job->literal, sizeof(job->literal));
+        g_free(expression);
+        if (job->regex == NULL) {
+            search_job_free(job);  // Nothing matches an invalid expression
+            return;
+        }
+    } else if (is_glob) {
+        job->glob = g_pattern_spec_new(search_term);
+        pattern_literal(search_term, 0, job->literal, sizeof(job->literal));
+    } else {
+        g_strlcpy(job->literal, search_term, sizeof(job->literal));
+    }
+
+    // The index narrows the candidates to names holding the literal part, the filter decides
+    GCancellable *cancellable = g_cancellable_new();
+    search_task = g_task_new(NULL, cancellable, NULL, NULL);
+    g_object_unref(cancellable);
+    g_task_set_task_data(search_task, job, search_job_free);
+    gtk_progress_bar_set_fraction(search_progress, 0.0);
+    gtk_progress_bar_set_text(search_progress, "Searching...");
+    gtk_widget_show(GTK_WIDGET(search_progress));
+    worker_started();
+    g_task_run_in_thread(search_task, search_worker);
 }
 
-/// SEARCH
 static void on_search(GtkWidget *widget, gpointer data) {
     GtkEntry *entry = GTK_ENTRY(data);
     const gchar *search_term = gtk_entry_get_text(entry);
@@ -520,14 +957,38 @@ static void on_search(GtkWidget *widget, gpointer data) {
         return;
     }
 
-    gtk_list_store_clear(store);
+    start_search(current_directory, search_term);
+}
 
-    search_directory(current_directory, search_term);
+// Search as the user types, each change replacing the search still running
+static void on_search_changed(GtkEditable *editable, gpointer data) {
+    const gchar *search_term = gtk_entry_get_text(GTK_ENTRY(editable));
 
-    // If no results were found, show a message
-    if (gtk_tree_model_iter_n_children(GTK_TREE_MODEL(store), NULL) == 0) {
-        show_error_dialog("No matching files or folders found.");
+    if (strlen(search_term) == 0) {
+        refresh_file_list();
+        return;
     }
+    start_search(current_directory, search_term);
+}
+
+
+/// OPEN AND CLOSE THE VOLUME
+// Mount the image, formatting a new one with the default geometry if the file does not exist
+static gboolean open_volume(const char *path) {
+    if (g_file_test(path, G_FILE_TEST_EXISTS)) {
+        return mount_image(path, CACHE_SIZE) == 0;
+    }
+    return format_image(path, DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_COUNT, DEFAULT_INODE_COUNT, CACHE_SIZE) == 0;
+}
+
+// Stop the search, let the workers finish with the volume and write it back to the image
+static void close_volume() {
+    if (search_task != NULL) {
+        g_cancellable_cancel(g_task_get_cancellable(search_task));
+        g_clear_object(&search_task);
+    }
+    wait_for_workers();
+    unmount_image();
 }
 
 
@@ -542,6 +1003,12 @@ static void activate(GtkApplication *app, gpointer user_data) {
     GtkToolItem *search_item, *search_button;
     GtkToolItem *new_folder_button, *delete_button, *rename_button, *new_file_button, *write_file_button;
 
+    // The volume is already open when another launch activates this instance
+    if (root_directory != NULL) {
+        gtk_window_present(GTK_WINDOW(window));
+        return;
+    }
+
     // Create main window
     window = gtk_application_window_new(app);
     gtk_window_set_title(GTK_WINDOW(window), "File System GUI");
@@ -626,7 +1093,7 @@ static void activate(GtkApplication *app, gpointer user_data) {
         fprintf(stderr, "Failed to load icon: rename.png\n");
     }
     gtk_toolbar_insert(GTK_TOOLBAR(toolbar), write_file_button, -1);
-    g_signal_connect(write_file_button, "clicked", G_CALLBACK(write_to_file), current_directory);
+    g_signal_connect(write_file_button, "clicked", G_CALLBACK(write_to_file), NULL);
 
     // Back Button
     GtkToolItem *back_button = gtk_tool_button_new(NULL, "Back");
@@ -659,6 +1126,7 @@ static void activate(GtkApplication *app, gpointer user_data) {
      }
      gtk_toolbar_insert(GTK_TOOLBAR(toolbar), search_button, -1);
      g_signal_connect(search_button, "clicked", G_CALLBACK(on_search), search_entry);
+     g_signal_connect(search_entry, "changed", G_CALLBACK(on_search_changed), NULL);
 
 
     // Create tree view
@@ -670,56 +1138,59 @@ static void activate(GtkApplication *app, gpointer user_data) {
     gtk_widget_set_hexpand(scrolled_window, TRUE);
     gtk_widget_set_vexpand(scrolled_window, TRUE);
 
-    store = gtk_list_store_new(3, GDK_TYPE_PIXBUF, G_TYPE_STRING, G_TYPE_STRING);
-    tree_view = GTK_TREE_VIEW(gtk_tree_view_new_with_model(GTK_TREE_MODEL(store)));
-    g_object_unref(store);
+    list_model = g_object_new(FS_TYPE_LIST_MODEL, NULL);
+    tree_view = GTK_TREE_VIEW(gtk_tree_view_new_with_model(GTK_TREE_MODEL(list_model)));
+    // Every row has the same height, so the view only asks the model for the rows on screen
+    gtk_tree_view_set_fixed_height_mode(tree_view, TRUE);
 
     renderer = gtk_cell_renderer_pixbuf_new();
-    column = gtk_tree_view_column_new_with_attributes("Icon", renderer, "pixbuf", 0, NULL);
+    column = gtk_tree_view_column_new_with_attributes("Icon", renderer, "pixbuf", LIST_COLUMN_ICON, NULL);
+    gtk_tree_view_column_set_sizing(column, GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_column_set_fixed_width(column, ICON_SIZE + 8);
     gtk_tree_view_append_column(tree_view, column);
 
     renderer = gtk_cell_renderer_text_new();
-    column = gtk_tree_view_column_new_with_attributes("Name", renderer, "text", 1, NULL);
+    column = gtk_tree_view_column_new_with_attributes("Name", renderer, "text", LIST_COLUMN_NAME, NULL);
+    gtk_tree_view_column_set_sizing(column, GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_column_set_fixed_width(column, 560);
+    gtk_tree_view_column_set_resizable(column, TRUE);
     gtk_tree_view_append_column(tree_view, column);
 
-    column = gtk_tree_view_column_new_with_attributes("Type", renderer, "text", 2, NULL);
+    column = gtk_tree_view_column_new_with_attributes("Type", renderer, "text", LIST_COLUMN_TYPE, NULL);
+    gtk_tree_view_column_set_sizing(column, GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_column_set_fixed_width(column, 120);
     gtk_tree_view_append_column(tree_view, column);
 
     gtk_container_add(GTK_CONTAINER(scrolled_window), GTK_WIDGET(tree_view));
 
+    // Shown while a search runs, then with its outcome until the list changes
+    search_progress = GTK_PROGRESS_BAR(gtk_progress_bar_new());
+    gtk_progress_bar_set_show_text(search_progress, TRUE);
+    gtk_widget_set_no_show_all(GTK_WIDGET(search_progress), TRUE);
+    gtk_grid_attach(GTK_GRID(grid), GTK_WIDGET(search_progress), 0, 2, 1, 1);
+
     // Connect double-click signal
     g_signal_connect(tree_view, "row-activated", G_CALLBACK(on_file_clicked), NULL);
 
-    // Initialize the file system
-    initialize_filesystem();
-    current_directory = create_root_dir();
-    root_directory = create_root_dir();
-
-    // Populate the initial view
-    refresh_file_list();
-
-    GdkPixbuf *original_folder_pixbuf = gdk_pixbuf_new_from_file("folder.png", NULL);
-    GdkPixbuf *original_file_pixbuf = gdk_pixbuf_new_from_file("file.png", NULL);
-
-    if (!original_folder_pixbuf || !original_file_pixbuf) {
-        show_error_dialog("Failed to load icons.");
-        // Handle the error appropriately
+    // Open the image and build the folder tree from what it holds
+    if (!open_volume(image_path) || (root_directory = load_root_dir()) == NULL) {
+        gchar *message = g_strdup_printf("Failed to open the volume image %s.", image_path);
+        show_error_dialog(message);
+        g_free(message);
+        unmount_image();
+        gtk_widget_destroy(window);
         return;
     }
+    current_directory = root_directory;
 
-    folder_pixbuf = resize_pixbuf(original_folder_pixbuf, ICON_SIZE, ICON_SIZE);
-    file_pixbuf = resize_pixbuf(original_file_pixbuf, ICON_SIZE, ICON_SIZE);
-
-    // Free the original pixbufs as we don't need them anymore
-    g_object_unref(original_folder_pixbuf);
-    g_object_unref(original_file_pixbuf);
-
-    if (!folder_pixbuf || !file_pixbuf) {
-        show_error_dialog("Failed to resize icons.");
+    if (!load_icons()) {
         // Handle the error appropriately
         return;
     }
 
+    // Populate the initial view
+    refresh_file_list();
+
     gtk_widget_show_all(window);
 }
 
@@ -727,10 +1198,19 @@ int main(int argc, char **argv) {
     GtkApplication *app;
     int status;
 
+    // The first argument, if any, names the image; the rest are left to GTK
+    if (argc > 1 && argv[1][0] != '-') {
+        image_path = argv[1];
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+
     app = gtk_application_new("org.example.filesystem_gui", G_APPLICATION_FLAGS_NONE);
     g_signal_connect(app, "activate", G_CALLBACK(activate), NULL);
     status = g_application_run(G_APPLICATION(app), argc, argv);
     g_object_unref(app);
+    close_volume();
 
     return status;
 }